@@ -0,0 +1,121 @@
+#include "lib/array.h"
+#include "lib/simd.h"
+
+/* Every kernel runs its SIMD loop over as many whole blocks as fit and
+ * finishes the rest, which is everything without SIMD_WIDTH, one double at
+ * a time. */
+
+void addArrays(const double* a, const double* b, double* out, int count) {
+	int i = 0;
+#ifdef SIMD_WIDTH
+	for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+		storeDoubles(out + i, addDoubles(loadDoubles(a + i), loadDoubles(b + i)));
+	}
+#endif
+	for (; i < count; i++) out[i] = a[i] + b[i];
+}
+
+void addScalar(const double* a, double b, double* out, int count) {
+	int i = 0;
+#ifdef SIMD_WIDTH
+	Doubles2 scalar = splatDouble(b);
+	for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+		storeDoubles(out + i, addDoubles(loadDoubles(a + i), scalar));
+	}
+#endif
+	for (; i < count; i++) out[i] = a[i] + b;
+}
+
+void multiplyArrays(const double* a, const double* b, double* out, int count) {
+	int i = 0;
+#ifdef SIMD_WIDTH
+	for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+		storeDoubles(out + i, multiplyDoubles(loadDoubles(a + i), loadDoubles(b + i)));
+	}
+#endif
+	for (; i < count; i++) out[i] = a[i] * b[i];
+}
+
+void multiplyScalar(const double* a, double b, double* out, int count) {
+	int i = 0;
+#ifdef SIMD_WIDTH
+	Doubles2 scalar = splatDouble(b);
+	for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+		storeDoubles(out + i, multiplyDoubles(loadDoubles(a + i), scalar));
+	}
+#endif
+	for (; i < count; i++) out[i] = a[i] * b;
+}
+
+/* Two blocks per iteration into separate accumulators, so one addition
+ * doesn't have to wait for the one before it. */
+double sumArray(const double* values, int count) {
+	double sum = 0;
+	int i = 0;
+#ifdef SIMD_WIDTH
+	Doubles2 even = splatDouble(0);
+	Doubles2 odd = splatDouble(0);
+	for (; i + 2 * SIMD_DOUBLES <= count; i += 2 * SIMD_DOUBLES) {
+		even = addDoubles(even, loadDoubles(values + i));
+		odd = addDoubles(odd, loadDoubles(values + i + SIMD_DOUBLES));
+	}
+	Doubles2 total = addDoubles(even, odd);
+	sum = firstDouble(total) + secondDouble(total);
+#endif
+	for (; i < count; i++) sum += values[i];
+	return sum;
+}
+
+double dotArrays(const double* a, const double* b, int count) {
+	double sum = 0;
+	int i = 0;
+#ifdef SIMD_WIDTH
+	Doubles2 even = splatDouble(0);
+	Doubles2 odd = splatDouble(0);
+	for (; i + 2 * SIMD_DOUBLES <= count; i += 2 * SIMD_DOUBLES) {
+		even = addDoubles(even, multiplyDoubles(loadDoubles(a + i), loadDoubles(b + i)));
+		odd = addDoubles(odd, multiplyDoubles(loadDoubles(a + i + SIMD_DOUBLES),
+											  loadDoubles(b + i + SIMD_DOUBLES)));
+	}
+	Doubles2 total = addDoubles(even, odd);
+	sum = firstDouble(total) + secondDouble(total);
+#endif
+	for (; i < count; i++) sum += a[i] * b[i];
+	return sum;
+}
+
+/* Every lane starts from values[0] and the new value goes first, so each
+ * lane does what the scalar loop does for its share of the elements. */
+double minArray(const double* values, int count) {
+	double min = values[0];
+	int i = 0;
+#ifdef SIMD_WIDTH
+	Doubles2 lanes = splatDouble(min);
+	for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+		lanes = lesserDoubles(loadDoubles(values + i), lanes);
+	}
+	min = firstDouble(lanes);
+	if (secondDouble(lanes) < min) min = secondDouble(lanes);
+#endif
+	for (; i < count; i++) {
+		if (values[i] < min) min = values[i];
+	}
+	return min;
+}
+
+double maxArray(const double* values, int count) {
+	double max = values[0];
+	int i = 0;
+#ifdef SIMD_WIDTH
+	Doubles2 lanes = splatDouble(max);
+	for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+		lanes = greaterDoubles(loadDoubles(values + i), lanes);
+	}
+	max = firstDouble(lanes);
+	if (secondDouble(lanes) > max) max = secondDouble(lanes);
+#endif
+	for (; i < count; i++) {
+		if (values[i] > max) max = values[i];
+	}
+	return max;
+}
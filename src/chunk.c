@@ -1,37 +1,403 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib/chunk.h"
+#include "lib/jit.h"
 #include "lib/memory.h"
+#include "lib/vm.h"
+
+#define CONSTANT_INDEX_MAX_LOAD 0.75
 
 void initChunk(Chunk *chunk) {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
 	chunk->lines = NULL;
 	initValueArray(&chunk->constants);	// Initializes constant list when a new chunk is initialized
+	chunk->constantIndex = NULL;
+	chunk->constantIndexCapacity = 0;
+	chunk->maxStack = 0;
 }
 
-void freeChunk(Chunk *chunk) { 
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
-	freeValueArray(&chunk->constants);	// frees the constants when we free the chunk
+void freeChunk(VM* vm, Chunk *chunk) { 
+	if (vm->chunk == chunk) vm->chunk = NULL;	/* its constants stop being roots */
+	jitFreeChunk(vm, chunk);
+	FREE_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(vm, MEM_LINES, LineStart, chunk->lines, chunk->lineCapacity);
+	freeValueArray(vm, &chunk->constants);	// frees the constants when we free the chunk
+	FREE_ARRAY(vm, MEM_CONSTANT_INDEX, int, chunk->constantIndex, chunk->constantIndexCapacity);
 	initChunk(chunk);
 }
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {	/* writeChunk() can write opcodes or operands. It's all raw bytes as fas as that function is concerned. */
+
+void resetChunkCode(VM* vm, Chunk *chunk) {
+	jitFreeChunk(vm, chunk);	/* the next code lands at the same addresses */
+	chunk->count = 0;
+	chunk->lineCount = 0;
+	chunk->maxStack = 0;
+}
+
+void resetChunkConstants(VM* vm, Chunk *chunk) {
+	resetChunkCode(vm, chunk);
+	chunk->constants.count = 0;
+	for (int i = 0; i < chunk->constantIndexCapacity; i++) chunk->constantIndex[i] = -1;
+}
+
+void writeChunk(VM* vm, Chunk *chunk, uint8_t byte, int line) {	/* writeChunk() can write opcodes or operands. It's all raw bytes as fas as that function is concerned. */
 	if (chunk->capacity < chunk->count + 1) {
 		int oldCapacity = chunk->capacity;
 		chunk->capacity =  GROW_CAPACITY(oldCapacity);
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity); /* When we allocate or grow the array,*/
-		chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity); /* we do the same for the line info too */
+		chunk->code = GROW_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, oldCapacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;	/* we store the line number in the array */
 	chunk->count++;
+
+	/* Still on the same line as the previous byte, so the current run covers it. */
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+	if (chunk->lineCapacity < chunk->lineCount + 1) {
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = GROW_ARRAY(vm, MEM_LINES, LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+	}
+
+	LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+	lineStart->offset = chunk->count - 1;
+	lineStart->line = line;
+}
+
+void truncateChunk(Chunk *chunk, int count) {
+	chunk->count = count;
+	while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+		chunk->lineCount--;
+	}
+}
+
+int instructionLength(uint8_t instruction) {
+	switch (instruction) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_ARRAY:
+			return 2;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER_NUM:
+		case OP_JUMP_IF_NOT_LESS_NUM:
+		case OP_ADD_LOCALS:
+		case OP_ADD_LOCAL_CONSTANT:
+			return 3;
+		case OP_CONSTANT_LONG:
+		case OP_GET_GLOBAL_LONG:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+uint8_t genericOpcode(uint8_t instruction) {
+	switch (instruction) {
+		case OP_ADD_NUM:
+		case OP_ADD_STRING:					return OP_ADD;
+		case OP_SUBTRACT_NUM:				return OP_SUBTRACT;
+		case OP_MULTIPLY_NUM:				return OP_MULTIPLY;
+		case OP_DIVIDE_NUM:					return OP_DIVIDE;
+		case OP_GREATER_NUM:				return OP_GREATER;
+		case OP_LESS_NUM:					return OP_LESS;
+		case OP_JUMP_IF_NOT_GREATER_NUM:	return OP_JUMP_IF_NOT_GREATER;
+		case OP_JUMP_IF_NOT_LESS_NUM:		return OP_JUMP_IF_NOT_LESS;
+		default:							return instruction;
+	}
+}
+
+/* How an instruction moves the stack: it needs pops values there to start
+ * with, leaves it delta slots higher, and at most peak slots higher while it
+ * runs (the fused local adds push both operands when they fall back). */
+typedef struct {
+	int pops;
+	int delta;
+	int peak;
+} StackEffect;
+
+static bool stackEffect(const uint8_t* code, StackEffect* effect) {
+	switch (genericOpcode(code[0])) {
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:		*effect = (StackEffect){0, 1, 1}; return true;
+		case OP_ARRAY:					*effect = (StackEffect){code[1], 1 - code[1], code[1] == 0 ? 1 : 0}; return true;
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_PRINT:
+		case OP_POP_JUMP_IF_FALSE:		*effect = (StackEffect){1, -1, 0}; return true;
+		case OP_SET_LOCAL:
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG:
+		case OP_NOT:
+		case OP_NEGATE:
+		case OP_JUMP_IF_FALSE:
+		case OP_NEW_ARRAY:
+		case OP_LENGTH:
+		case OP_ARRAY_SUM:
+		case OP_ARRAY_MIN:
+		case OP_ARRAY_MAX:				*effect = (StackEffect){1, 0, 0}; return true;
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_GET_INDEX:
+		case OP_ARRAY_ADD:
+		case OP_ARRAY_MULTIPLY:
+		case OP_ARRAY_DOT:				*effect = (StackEffect){2, -1, 0}; return true;
+		case OP_SET_INDEX:				*effect = (StackEffect){3, -2, 0}; return true;
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS:		*effect = (StackEffect){2, -2, 0}; return true;
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_RETURN:					*effect = (StackEffect){0, 0, 0}; return true;
+		case OP_ADD_LOCALS:				*effect = (StackEffect){0, 1, 2}; return true;
+		case OP_ADD_LOCAL_CONSTANT:		*effect = (StackEffect){0, 0, 2}; return true;
+		default:						return false;	/* not an opcode */
+	}
+}
+
+/* Records that offset is reached with the stack depth slots deep, queueing
+ * it if that's news. False if it contradicts an earlier path or is out of
+ * the chunk. */
+static bool reach(Chunk* chunk, int* depths, int* pending, int* pendingCount, int offset, int depth) {
+	if (offset < 0 || offset >= chunk->count) return false;
+	if (depths[offset] != -1) return depths[offset] == depth;
+	depths[offset] = depth;
+	pending[(*pendingCount)++] = offset;
+	return true;
+}
+
+/* Constant and global operands have to name one that exists, and locals
+ * have to be below localCount. Only a corrupt image gets these wrong. */
+static bool operandsInRange(Chunk* chunk, const uint8_t* code, int globalCount, int localCount) {
+	int constantCount = chunk->constants.count;
+	switch (genericOpcode(code[0])) {
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:				return code[1] < localCount;
+		case OP_ADD_LOCAL_CONSTANT:		return code[1] < localCount && code[2] < constantCount;
+		case OP_ADD_LOCALS:				return code[1] < localCount && code[2] < localCount;
+		case OP_CONSTANT:				return code[1] < constantCount;
+		case OP_CONSTANT_LONG:			return (int)((code[1] << 16) | (code[2] << 8) | code[3]) < constantCount;
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:				return code[1] < globalCount;
+		case OP_GET_GLOBAL_LONG:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG:		return (int)((code[1] << 16) | (code[2] << 8) | code[3]) < globalCount;
+		default:						return true;
+	}
+}
+
+/* Finds where the instruction at code, with next the offset after it,
+ * jumps to. False if it isn't a jump. */
+static bool jumpTarget(const uint8_t* code, int next, int* target) {
+	switch (genericOpcode(code[0])) {
+		case OP_LOOP:
+			*target = next - ((code[1] << 8) | code[2]);
+			return true;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS:
+			*target = next + ((code[1] << 8) | code[2]);
+			return true;
+		default:
+			return false;
+	}
 }
 
-int addConstant(Chunk *chunk, Value value) {
-	writeValueArray(&chunk->constants, value);
+int maxStackDepth(Chunk *chunk, int globalCount) {
+	if (chunk->count == 0) return 0;
+
+	/* Each offset is queued at most once, the first time a path reaches it. */
+	int* depths = (int*)malloc(sizeof(int) * chunk->count);
+	int* pending = (int*)malloc(sizeof(int) * chunk->count);
+	if (depths == NULL || pending == NULL) exit(1);
+	for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+	int pendingCount = 0;
+	int maxDepth = 0;
+	bool ok = reach(chunk, depths, pending, &pendingCount, 0, 0);
+	while (ok && pendingCount > 0) {
+		int offset = pending[--pendingCount];
+		int depth = depths[offset];
+		uint8_t* code = chunk->code + offset;
+		uint8_t instruction = genericOpcode(*code);
+		int next = offset + instructionLength(instruction);
+		StackEffect effect;
+		if (next > chunk->count || !stackEffect(code, &effect) || depth < effect.pops) {
+			ok = false;
+			break;
+		}
+
+		/* Locals live at the bottom of the stack, below anything pushed since. */
+		ok = operandsInRange(chunk, code, globalCount, depth);
+		if (depth + effect.peak > maxDepth) maxDepth = depth + effect.peak;
+		depth += effect.delta;
+
+		int target = 0;
+		jumpTarget(code, next, &target);
+		switch (instruction) {
+			case OP_RETURN:
+				break;
+			case OP_JUMP:
+			case OP_LOOP:
+				ok = ok && reach(chunk, depths, pending, &pendingCount, target, depth);
+				break;
+			case OP_JUMP_IF_FALSE:
+			case OP_POP_JUMP_IF_FALSE:
+			case OP_JUMP_IF_NOT_EQUAL:
+			case OP_JUMP_IF_NOT_GREATER:
+			case OP_JUMP_IF_NOT_LESS:
+				ok = ok && reach(chunk, depths, pending, &pendingCount, target, depth);
+				/* fall through */
+			default:
+				ok = ok && reach(chunk, depths, pending, &pendingCount, next, depth);
+				break;
+		}
+	}
+
+	/* run() only ever executes what the walk reached, but the JIT decodes
+	 * every instruction between a loop's head and its OP_LOOP, and code the
+	 * walk never reached can sit in there (--no-optimize leaves some after
+	 * infinite loops). So the whole chunk has to decode, from the start,
+	 * into instructions whose constants and globals exist, and every offset
+	 * reached or jumped to has to be where one of them starts. Locals are
+	 * left to the walk: the JIT doesn't read them until the code runs, and
+	 * unreached code doesn't. pending marks the starts. */
+	for (int i = 0; ok && i < chunk->count; i++) pending[i] = 0;
+	for (int offset = 0; ok && offset < chunk->count;) {
+		uint8_t* code = chunk->code + offset;
+		int next = offset + instructionLength(genericOpcode(*code));
+		StackEffect effect;
+		ok = next <= chunk->count && stackEffect(code, &effect) && operandsInRange(chunk, code, globalCount, UINT8_COUNT);
+		pending[offset] = 1;
+		offset = next;
+	}
+	for (int offset = 0; ok && offset < chunk->count; offset++) {
+		if (depths[offset] != -1 && !pending[offset]) ok = false;
+		if (!pending[offset]) continue;
+		int next = offset + instructionLength(genericOpcode(chunk->code[offset]));
+		int target;
+		if (jumpTarget(chunk->code + offset, next, &target) &&
+			(target < 0 || target >= chunk->count || !pending[target])) {
+			ok = false;
+		}
+	}
+
+	free(depths);
+	free(pending);
+	return ok ? maxDepth : -1;
+}
+
+/* Binary search for the last run that starts at or before offset. */
+int getLine(Chunk *chunk, int offset) {
+	int start = 0;
+	int end = chunk->lineCount - 1;
+
+	for (;;) {
+		int mid = (start + end) / 2;
+		LineStart* line = &chunk->lines[mid];
+		if (offset < line->offset) {
+			end = mid - 1;
+		} else if (mid == chunk->lineCount - 1 || offset < chunk->lines[mid + 1].offset) {
+			return line->line;
+		} else {
+			start = mid + 1;
+		}
+	}
+}
+
+/* Two constants can share a slot only if nothing could tell them apart, so
+ * numbers compare by their bits (keeping 0 and -0 apart) and objects by
+ * identity, which for interned strings means equal contents. */
+static bool sameConstant(Value a, Value b) {
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+	return valuesEqual(a, b);
+}
+
+static uint32_t hashConstant(Value value) {
+	uint64_t bits = 0;
+	if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		memcpy(&bits, &number, sizeof(double));
+	} else if (IS_OBJ(value)) {
+		bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+	} else if (IS_BOOL(value)) {
+		bits = AS_BOOL(value) ? 1 : 2;
+	}
+	bits ^= bits >> 33;	/* fold the high bits down, where the exponent and pointer page live */
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+/* Returns the slot in constantIndex where value lives, or the empty slot
+ * where it should go. The capacity is a power of two, so we mask. */
+static int findConstantSlot(Chunk* chunk, Value value) {
+	uint32_t mask = (uint32_t)chunk->constantIndexCapacity - 1;
+	uint32_t index = hashConstant(value) & mask;
+	for (;;) {
+		int constant = chunk->constantIndex[index];
+		if (constant == -1 || sameConstant(chunk->constants.values[constant], value)) return (int)index;
+		index = (index + 1) & mask;
+	}
+}
+
+static void growConstantIndex(VM* vm, Chunk* chunk) {
+	FREE_ARRAY(vm, MEM_CONSTANT_INDEX, int, chunk->constantIndex, chunk->constantIndexCapacity);
+	chunk->constantIndexCapacity = GROW_CAPACITY(chunk->constantIndexCapacity);
+	chunk->constantIndex = ALLOCATE(vm, MEM_CONSTANT_INDEX, int, chunk->constantIndexCapacity);
+	for (int i = 0; i < chunk->constantIndexCapacity; i++) chunk->constantIndex[i] = -1;
+
+	/* The constants array itself is the source of truth, so just reinsert it. */
+	for (int i = 0; i < chunk->constants.count; i++) {
+		chunk->constantIndex[findConstantSlot(chunk, chunk->constants.values[i])] = i;
+	}
+}
+
+int addConstant(VM* vm, Chunk *chunk, Value value) {
+	if (chunk->constants.count + 1 > chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD) {
+		growConstantIndex(vm, chunk);
+	}
+
+	int slot = findConstantSlot(chunk, value);
+	if (chunk->constantIndex[slot] != -1) return chunk->constantIndex[slot];	/* reuse the identical constant */
+
+	writeValueArray(vm, &chunk->constants, value);
+	chunk->constantIndex[slot] = chunk->constants.count - 1;
 	return chunk->constants.count - 1;	/* chunk ptr is accessing a field of ValueArray struct that is within the Chunk struct */
 	/* after we add the constant, we return the index where was appended so that we can locate that same constant later*/
 }
@@ -5,19 +5,16 @@
 
 #include "lib/common.h"
 #include "lib/compiler.h"
+#include "lib/memory.h"
+#include "lib/optimizer.h"
 #include "lib/scanner.h"
+#include "lib/source.h"
+#include "lib/tokens.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "lib/debug.h"
 #endif
 
-typedef struct {
-	Token current;
-	Token previous;
-	bool hadError;
-	bool panicMode;
-} Parser;
-
 typedef enum {
 	PREC_NONE,
 	PREC_ASSIGNMENT, // =
@@ -32,41 +29,78 @@ typedef enum {
 	PREC_PRIMARY
 } Precedence;
 
-/*
- ParseFn type is a simple typedef for a function type 
- that takes no arguments and returns nothing.
- */
-typedef void (*ParseFn)(bool canAssign);
-
-typedef struct {
-	ParseFn prefix;
-	ParseFn infix;
-	Precedence precedence;
-} ParseRule;
-
 /* each local in the array is one of these: */
 typedef struct {
 	Token name;
 	int depth;
 } Local;
 
+/* The most recent instruction that pushed a value known at compile time.
+ * If it spans exactly the code of an operand, that operand is a constant
+ * and can be folded away. */
+typedef struct {
+	int start;	/* offset of the instruction, -1 when there is none */
+	int end;	/* offset just past it */
+	Value value;
+} FoldableConstant;
+
 /* states for defining local variables */
 typedef struct {
 	Local locals[UINT8_COUNT];
 	int localCount;
 	int scopeDepth;
+	FoldableConstant lastConstant;
+	int operandStart;	/* where the left operand of the infix rule being called begins */
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
+#define NAMES_MAX_LOAD 0.75
+
+/* A global's name and the slot identifierSlot() found for it. */
+typedef struct {
+	const char* start;	/* NULL for an empty entry */
+	int length;
+	uint32_t hash;
+	int slot;
+} CachedName;
+
+/* Everything one call to compile() works with. It's passed to every parse
+ * function instead of living in globals, so separate VMs can compile at the
+ * same time. */
+typedef struct {
+	VM* vm;	/* the VM the chunk is compiled for, which owns its constants and global slots */
+	TokenStream tokens;
+	Token current;
+	Token previous;
+	bool hadError;
+	bool panicMode;
+	Compiler* compiler;	/* the scope state of the code being compiled */
+	Chunk* chunk;
+	/* Open addressing on the token hash, so a name that comes up again goes
+	 * straight to its slot without being interned or looked up in
+	 * vm->globalNames. */
+	CachedName* names;
+	int nameCount;
+	int nameCapacity;	/* a power of two */
+} Parser;
+
+/*
+ ParseFn type is a simple typedef for a function type 
+ that takes the parser and returns nothing.
+ */
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
+
+typedef struct {
+	ParseFn prefix;
+	ParseFn infix;
+	Precedence precedence;
+} ParseRule;
 
 /*
  The chunk that we're writing gets passed into compile(), but it needs to make
  its way to emitByte(). To do that, we rely on this intermediary function.
  */
-static Chunk* currentChunk() {
-	return compilingChunk;
+static Chunk* currentChunk(Parser* parser) {
+	return parser->chunk;
 }
 
 /*
@@ -76,9 +110,9 @@ static Chunk* currentChunk() {
  we set this hadError flag. That records whether any error occurred during
  compilation. This field hadError lives in the parser struct.
  */
-static void errorAt(Token* token, const char* message) {
-	if (parser.panicMode) return;	/* While the panic mode flag is set, we simply suppress any other errors that get detected. */
-	parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+	if (parser->panicMode) return;	/* While the panic mode flag is set, we simply suppress any other errors that get detected. */
+	parser->panicMode = true;
 	fprintf(stderr, "[line %d] Error", token->line);
 
 	if (token->type == TOKEN_EOF) {
@@ -90,11 +124,11 @@ static void errorAt(Token* token, const char* message) {
 	}
 
 	fprintf(stderr, ": %s\n", message);
-	parser.hadError = true;
+	parser->hadError = true;
 }
 
-static void error(const char* message) {
-	errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+	errorAt(parser, &parser->previous, message);
 }
 
 /*
@@ -102,8 +136,8 @@ static void error(const char* message) {
  We pull the location out the current token in order to tell the user where
  the error occurred and forward it ot errorAt(). 
  */
-static void errorAtCurrent(const char* message) {
-	errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+	errorAt(parser, &parser->current, message);
 }
 
 /* 
@@ -113,14 +147,14 @@ static void errorAtCurrent(const char* message) {
  that in a previous field. That will come in handy later so that we 
  can get at the lexeme after we match a token.
  */
-static void advance() {	
-	parser.previous = parser.current;
+static void advance(Parser* parser) {	
+	parser->previous = parser->current;
 
 	for (;;) {
-		parser.current = scanToken();
-		if (parser.current.type != TOKEN_ERROR) break;
+		parser->current = nextToken(&parser->tokens);
+		if (parser->current.type != TOKEN_ERROR) break;
 
-		errorAtCurrent(parser.current.start);
+		errorAtCurrent(parser, parser->current.start);
 	}
 }
 
@@ -130,23 +164,23 @@ static void advance() {
  If not, it reports an error. This function is the foundation
  of most syntax errors in the compiler.
  */
-static void consume(TokenType type, const char* message) {
-	if (parser.current.type == type) {
-		advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+	if (parser->current.type == type) {
+		advance(parser);
 		return;
 	}
 
-	errorAtCurrent(message);
+	errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {	/* returns true if the current passed token has the given type.*/
-	return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {	/* returns true if the current passed token has the given type.*/
+	return parser->current.type == type;
 }
 
 
-static bool match(TokenType type) {
-	if (!check(type)) return false;
-	advance();
+static bool match(Parser* parser, TokenType type) {
+	if (!check(parser, type)) return false;
+	advance(parser);
 	return true;
 }
 
@@ -155,8 +189,8 @@ static bool match(TokenType type) {
  translate that to a series of bytecode instructions. It starts with the easiest
  possible step: appending a single byte to the chunk.
  */
-static void emitByte(uint8_t byte) {
-	writeChunk(currentChunk(), byte, parser.previous.line);	/* emitByte() sends in the previous token's line information so that runtime errors are 
+static void emitByte(Parser* parser, uint8_t byte) {
+	writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);	/* emitByte() sends in the previous token's line information so that runtime errors are 
 	associated with that line. */
 }
 
@@ -165,114 +199,223 @@ static void emitByte(uint8_t byte) {
  Over time, we'll have enough cases where we need to write an opcode followed
  by a one-byte operand that it's worth defining this convenience function.
  */
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-	emitByte(byte1);
-	emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+	emitByte(parser, byte1);
+	emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart) {
-	emitByte(OP_LOOP);
+/* Emits an instruction that takes an index operand, picking the one-byte
+ * form when the index fits and the 24-bit _LONG form otherwise. */
+static void emitIndexed(Parser* parser, uint8_t instruction, uint8_t longInstruction, int index) {
+	if (index <= UINT8_MAX) {
+		emitBytes(parser, instruction, (uint8_t)index);
+		return;
+	}
+
+	emitByte(parser, longInstruction);
+	emitByte(parser, (index >> 16) & 0xff);
+	emitByte(parser, (index >> 8) & 0xff);
+	emitByte(parser, index & 0xff);
+}
 
-	int offset = currentChunk()->count - loopStart + 2;
-	if (offset > UINT16_MAX) error("Loop body too large.");
+static void emitLoop(Parser* parser, int loopStart) {
+	emitByte(parser, OP_LOOP);
 
-	emitByte((offset >> 8) & 0xff);
-	emitByte(offset & 0xff);
+	int offset = currentChunk(parser)->count - loopStart + 2;
+	if (offset > UINT16_MAX) error(parser, "Loop body too large.");
+
+	emitByte(parser, (offset >> 8) & 0xff);
+	emitByte(parser, offset & 0xff);
 }
 
-static int emitJump(uint8_t instruction) {
-	emitByte(instruction);
-	emitByte(0xff);	// writes a placeholder for the jump offset
-	emitByte(0xff);
-	return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+	emitByte(parser, instruction);
+	emitByte(parser, 0xff);	// writes a placeholder for the jump offset
+	emitByte(parser, 0xff);
+	return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn() {
-	emitByte(OP_RETURN);
+static void emitReturn(Parser* parser) {
+	emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-	int constant = addConstant(currentChunk(), value);
-	if (constant > UINT8_MAX) {
-		error("Too many constants in one chunk.");
+static int makeConstant(Parser* parser, Value value) {
+	int constant = addConstant(parser->vm, currentChunk(parser), value);
+	if (constant > UINT24_MAX) {
+		error(parser, "Too many constants in one chunk.");
 		return 0;
 	}
 
-	return (uint8_t)constant;
+	return constant;
 }
 
 
-static void emitConstant(Value value) {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+	int start = currentChunk(parser)->count;
+	emitIndexed(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
+
+	parser->compiler->lastConstant.start = start;
+	parser->compiler->lastConstant.end = currentChunk(parser)->count;
+	parser->compiler->lastConstant.value = value;
+}
+
+/* Like emitConstant(), but uses the dedicated opcodes for nil and booleans. */
+static void emitValue(Parser* parser, Value value) {
+	if (!IS_NIL(value) && !IS_BOOL(value)) {
+		emitConstant(parser, value);
+		return;
+	}
+
+	int start = currentChunk(parser)->count;
+	emitByte(parser, IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	parser->compiler->lastConstant.start = start;
+	parser->compiler->lastConstant.end = currentChunk(parser)->count;
+	parser->compiler->lastConstant.value = value;
+}
+
+/* Whether the code from start up to the end of the chunk is a single
+ * constant load, and if so, which value it pushes. */
+static bool constantSince(Parser* parser, int start, Value* value) {
+	if (parser->compiler->lastConstant.start != start ||
+		parser->compiler->lastConstant.end != currentChunk(parser)->count) {
+		return false;
+	}
+
+	*value = parser->compiler->lastConstant.value;
+	return true;
+}
+
+/* Throws away the operand code from start on and pushes value instead. */
+static void replaceWithConstant(Parser* parser, int start, Value value) {
+	truncateChunk(currentChunk(parser), start);
+	emitValue(parser, value);
 }
 
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
 	// -2 to adjust for the bytecode for the jump offset itself.
-	int jump = currentChunk()->count - offset - 2;
+	int jump = currentChunk(parser)->count - offset - 2;
 
 	if (jump > UINT16_MAX) {
-		error("Too much code to jump over.");
+		error(parser, "Too much code to jump over.");
 	}
 
-	currentChunk()->code[offset] = (jump >> 8) & 0xff;
-	currentChunk()->code[offset + 1] = jump & 0xff;
+	currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+	currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
 /* little function to initialize the compiler which initializes to 0 the localCount
  * and scopeDepth and sets the compiler to NULL */
-static void initCompiler(Compiler* compiler) {
+static void initCompiler(Parser* parser, Compiler* compiler) {
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
-	current = compiler;
+	compiler->lastConstant.start = -1;
+	compiler->lastConstant.end = -1;
+	compiler->operandStart = -1;
+	parser->compiler = compiler;
 }
 
-static void endCompiler() {
-	emitReturn();
+static void endCompiler(Parser* parser) {
+	emitReturn(parser);
+	if (optimizerEnabled && !parser->hadError) optimizeChunk(parser->vm, currentChunk(parser));
+	/* Measured on the final code, as the peephole pass changes what each
+	 * instruction pushes. */
+	if (!parser->hadError) currentChunk(parser)->maxStack = maxStackDepth(currentChunk(parser), parser->vm->globalValues.count);
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError) {
-	disassembleChunk(currentChunk(), "code");
+	if (!parser->hadError) {
+	disassembleChunk(parser->vm, currentChunk(parser), "code");
 }
 #endif
 }
 
-static void beginScope() {
-	current->scopeDepth++;
+static void beginScope(Parser* parser) {
+	parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-	current->scopeDepth--;
+static void endScope(Parser* parser) {
+	parser->compiler->scopeDepth--;
 
-	while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-		emitByte(OP_POP);
-		current->localCount--;
+	while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+		emitByte(parser, OP_POP);
+		parser->compiler->localCount--;
 	}
 }
 
 /* these are function prototypes, a heads up for the compiler */
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+
+/* The string for some characters of the source. With --borrow-strings it
+ * points into the source, which main() keeps mapped for as long as the VM
+ * runs, instead of copying them. */
+static ObjString* sourceString(Parser* parser, const char* start, int length, uint32_t hash) {
+	return borrowStrings ? borrowStringHashed(parser->vm, start, length, hash)
+						 : copyStringHashed(parser->vm, start, length, hash);
+}
+
+static CachedName* findName(CachedName* names, int capacity, Token* name) {
+	uint32_t index = name->hash & (capacity - 1);
+	for (;;) {
+		CachedName* entry = &names[index];
+		if (entry->start == NULL ||
+			(entry->hash == name->hash && entry->length == name->length &&
+			 memcmp(entry->start, name->start, name->length) == 0)) {
+			return entry;
+		}
+		index = (index + 1) & (capacity - 1);
+	}
+}
 
-/* this function takes the given token and add its lexeme to the chunk's 
- * constant table as a string. It then returns the index of that constant
- * in the constant table.*/
-static uint8_t identifierConstant(Token* name) {
-	return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static void growNames(Parser* parser) {
+	int capacity = GROW_CAPACITY(parser->nameCapacity);
+	CachedName* names = ALLOCATE(parser->vm, MEM_SCRATCH, CachedName, capacity);
+	for (int i = 0; i < capacity; i++) names[i].start = NULL;
+	for (int i = 0; i < parser->nameCapacity; i++) {
+		CachedName* entry = &parser->names[i];
+		if (entry->start == NULL) continue;
+		Token name = {.start = entry->start, .length = entry->length, .hash = entry->hash};
+		*findName(names, capacity, &name) = *entry;
+	}
+	FREE_ARRAY(parser->vm, MEM_SCRATCH, CachedName, parser->names, parser->nameCapacity);
+	parser->names = names;
+	parser->nameCapacity = capacity;
+}
+
+/* this function takes the given token and resolves its lexeme to the VM's
+ * slot for that global variable, so the runtime can index straight into 
+ * vm.globalValues instead of hashing the name on every access.*/
+static int identifierSlot(Parser* parser, Token* name) {
+	if (parser->nameCount + 1 > parser->nameCapacity * NAMES_MAX_LOAD) growNames(parser);
+	CachedName* entry = findName(parser->names, parser->nameCapacity, name);
+	if (entry->start != NULL) return entry->slot;
+
+	int slot = globalSlot(parser->vm, sourceString(parser, name->start, name->length, name->hash));
+	if (slot > UINT24_MAX) {
+		error(parser, "Too many global variables.");
+		return 0;
+	}
+
+	entry->start = name->start;
+	entry->length = name->length;
+	entry->hash = name->hash;
+	entry->slot = slot;
+	parser->nameCount++;
+	return slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
-	if (a->length != b->length) return false;
+	if (a->hash != b->hash || a->length != b->length) return false;
 	return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
 	for (int i = compiler->localCount - 1; i >= 0; i--) {
 		Local* local = &compiler->locals[i];
 		if (identifiersEqual(name, &local->name)) {
 			if (local->depth == -1) {	/* if the variable has the sentinel depth, it must be a reference to a variable in its own initializer */
-				error("Can't read local variable in its own initializer.");	/* and we report that as an error. */
+				error(parser, "Can't read local variable in its own initializer.");	/* and we report that as an error. */
 			}
 			return i;
 		}
@@ -283,81 +426,139 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 
 /* adds a new local variable to the current compiler's list
  * of locals, storing its name and depth of its scope. */
-static void addLocal(Token name) {
-	if (current->localCount == UINT8_COUNT) {
-		error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+	if (parser->compiler->localCount == UINT8_COUNT) {
+		error(parser, "Too many local variables in function.");
 		return;
 	}
-	Local* local = &current->locals[current->localCount++];
+	Local* local = &parser->compiler->locals[parser->compiler->localCount++];
 	local->name = name;
 	local->depth = -1;	/* special sentinel value, reads as initialized */
 }
 
-static void declareVariable() {
-	if (current->scopeDepth == 0) return;
+static void declareVariable(Parser* parser) {
+	if (parser->compiler->scopeDepth == 0) return;
 
-	Token* name = &parser.previous;
-	for (int i = current->localCount -1; i >= 0; i--) {
-		Local* local = &current->locals[i];
-		if (local->depth != -1 && local->depth < current->scopeDepth) {
+	Token* name = &parser->previous;
+	for (int i = parser->compiler->localCount -1; i >= 0; i--) {
+		Local* local = &parser->compiler->locals[i];
+		if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
 			break;
 		}
 
 		if (identifiersEqual(name, &local->name)) {
-			error("Already a variable with this name in this scope.");
+			error(parser, "Already a variable with this name in this scope.");
 		}
 	}
-	addLocal(*name);
+	addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-	consume(TOKEN_IDENTIFIER, errorMessage);
+static int parseVariable(Parser* parser, const char* errorMessage) {
+	consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-	declareVariable();
-	if (current->scopeDepth > 0) return 0;
+	declareVariable(parser);
+	if (parser->compiler->scopeDepth > 0) return 0;
 
-	return identifierConstant(&parser.previous);
+	return identifierSlot(parser, &parser->previous);
 }
 
-static void markInitialized() {
-	current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+	parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-	if (current->scopeDepth > 0) {
-		markInitialized();
+static void defineVariable(Parser* parser, int global) {
+	if (parser->compiler->scopeDepth > 0) {
+		markInitialized(parser);
 		return;
 	}
 
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitIndexed(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 /* new parser function for AND */
-static void and_(bool canAssign) {
-	int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+	int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-	emitByte(OP_POP);
-	parsePrecedence(PREC_AND);
+	emitByte(parser, OP_POP);
+	parsePrecedence(parser, PREC_AND);
 
-	patchJump(endJump);
+	patchJump(parser, endJump);
 }
 
-static void binary(bool canAssign) {
-	TokenType operatorType = parser.previous.type;
+static bool isFalsey(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/* Evaluates a binary operator on two constants the same way run() would.
+ * Returns false, leaving the work to the VM, when the operand types would
+ * make run() report an error. */
+static bool foldBinary(Parser* parser, TokenType operatorType, Value a, Value b, Value* result) {
+	if (operatorType == TOKEN_EQUAL_EQUAL) {
+		*result = BOOL_VAL(valuesEqual(a, b));
+		return true;
+	}
+	if (operatorType == TOKEN_BANG_EQUAL) {
+		*result = BOOL_VAL(!valuesEqual(a, b));
+		return true;
+	}
+
+	if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+		ObjString* left = AS_STRING(a);
+		ObjString* right = AS_STRING(b);
+		int length = left->length + right->length;
+		ObjString* string = allocateString(parser->vm, length);
+		memcpy(string->storage, left->chars, left->length);
+		memcpy(string->storage + left->length, right->chars, right->length);
+		*result = OBJ_VAL(takeString(parser->vm, string));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	switch (operatorType) {
+		case TOKEN_GREATER:			*result = BOOL_VAL(x > y); break;
+		case TOKEN_GREATER_EQUAL:	*result = BOOL_VAL(!(x < y)); break;	/* same as OP_LESS, OP_NOT, which matters for NaN */
+		case TOKEN_LESS:			*result = BOOL_VAL(x < y); break;
+		case TOKEN_LESS_EQUAL:		*result = BOOL_VAL(!(x > y)); break;
+		case TOKEN_PLUS:			*result = NUMBER_VAL(x + y); break;
+		case TOKEN_MINUS:			*result = NUMBER_VAL(x - y); break;
+		case TOKEN_STAR:			*result = NUMBER_VAL(x * y); break;
+		case TOKEN_SLASH:			*result = NUMBER_VAL(x / y); break;
+		default: return false; // Unreachable.
+	}
+	return true;
+}
+
+static void binary(Parser* parser, bool canAssign) {
+	TokenType operatorType = parser->previous.type;
+	int leftStart = parser->compiler->operandStart;
+	Value left;
+	bool leftConstant = constantSince(parser, leftStart, &left);
+
 	ParseRule* rule = getRule(operatorType);	/* Look up the precedence of the current operator. */
-	parsePrecedence((Precedence)(rule->precedence + 1));
+	int rightStart = currentChunk(parser)->count;
+	parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+	/* Both operands are literals, so the result is too. */
+	Value right, result;
+	if (leftConstant && constantSince(parser, rightStart, &right) &&
+		foldBinary(parser, operatorType, left, right, &result)) {
+		replaceWithConstant(parser, leftStart, result);
+		return;
+	}
 
 	switch (operatorType) {
-		case TOKEN_BANG_EQUAL:		emitBytes(OP_EQUAL, OP_NOT); break;
-		case TOKEN_EQUAL_EQUAL:		emitByte(OP_EQUAL); break;
-		case TOKEN_GREATER:			emitByte(OP_GREATER); break;
-		case TOKEN_GREATER_EQUAL:	emitBytes(OP_LESS, OP_NOT); break;
-		case TOKEN_LESS:			emitByte(OP_LESS); break;
-		case TOKEN_LESS_EQUAL:		emitBytes(OP_GREATER, OP_NOT); break;
-		case TOKEN_PLUS:			emitByte(OP_ADD); break;
-		case TOKEN_MINUS:			emitByte(OP_SUBTRACT); break;
-		case TOKEN_STAR:			emitByte(OP_MULTIPLY); break;
-		case TOKEN_SLASH:			emitByte(OP_DIVIDE); break;
+		case TOKEN_BANG_EQUAL:		emitBytes(parser, OP_EQUAL, OP_NOT); break;
+		case TOKEN_EQUAL_EQUAL:		emitByte(parser, OP_EQUAL); break;
+		case TOKEN_GREATER:			emitByte(parser, OP_GREATER); break;
+		case TOKEN_GREATER_EQUAL:	emitBytes(parser, OP_LESS, OP_NOT); break;
+		case TOKEN_LESS:			emitByte(parser, OP_LESS); break;
+		case TOKEN_LESS_EQUAL:		emitBytes(parser, OP_GREATER, OP_NOT); break;
+		case TOKEN_PLUS:			emitByte(parser, OP_ADD); break;
+		case TOKEN_MINUS:			emitByte(parser, OP_SUBTRACT); break;
+		case TOKEN_STAR:			emitByte(parser, OP_MULTIPLY); break;
+		case TOKEN_SLASH:			emitByte(parser, OP_DIVIDE); break;
 		default: return; // Unreachable.
 	}
 }
@@ -366,77 +567,178 @@ static void binary(bool canAssign) {
  When the parser encounters false, nil, or true, in prefix postion,
  it calls this new parser function:
  */
-static void literal(bool canAssign) {
-	switch (parser.previous.type) {
-		case TOKEN_FALSE: emitByte(OP_FALSE); break;
-		case TOKEN_NIL: emitByte(OP_NIL); break;
-		case TOKEN_TRUE: emitByte(OP_TRUE); break;
+static void literal(Parser* parser, bool canAssign) {
+	switch (parser->previous.type) {	/* emitValue() also remembers these so they can be folded */
+		case TOKEN_FALSE: emitValue(parser, BOOL_VAL(false)); break;
+		case TOKEN_NIL: emitValue(parser, NIL_VAL); break;
+		case TOKEN_TRUE: emitValue(parser, BOOL_VAL(true)); break;
 		default: return; // Unreachable
 	}
 }
 
-static void grouping(bool canAssign) {
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
-	double value = strtod(parser.previous.start, NULL);
-	emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+	double value = strtod(parser->previous.start, NULL);
+	emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign) {
-	int elseJump = emitJump(OP_JUMP_IF_FALSE);
-	int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+	int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	int endJump = emitJump(parser, OP_JUMP);
 
-	patchJump(elseJump);
-	emitByte(OP_POP);
+	patchJump(parser, elseJump);
+	emitByte(parser, OP_POP);
 
-	parsePrecedence(PREC_OR);
-	patchJump(endJump);
+	parsePrecedence(parser, PREC_OR);
+	patchJump(parser, endJump);
 }
 
 /* This takes the string's characters directly from the lexeme. The + 1 and - 2
  * parts trim the leading and trailing quotation marks. It then creates a string
  * object, wraps it in a Value, and stuffs it into the constant table.*/
-static void string(bool canAssign) {
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+	emitConstant(parser, OBJ_VAL(sourceString(parser, parser->previous.start + 1, parser->previous.length - 2, parser->previous.hash)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
 	uint8_t getOp, setOp;
-	int arg = resolveLocal(current, &name);
+	int arg = resolveLocal(parser, parser->compiler, &name);
 	if (arg != -1) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
 	} else {
-		arg = identifierConstant(&name);
+		arg = identifierSlot(parser, &name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
-	if (canAssign && match(TOKEN_EQUAL)) {
-		expression();
-		emitBytes(setOp, (uint8_t)arg);
+	/* Locals always fit in a byte, so only globals ever take the _LONG form. */
+	if (canAssign && match(parser, TOKEN_EQUAL)) {
+		expression(parser);
+		emitIndexed(parser, setOp, OP_SET_GLOBAL_LONG, arg);
 	} else {
-		emitBytes(getOp, (uint8_t)arg);
+		emitIndexed(parser, getOp, OP_GET_GLOBAL_LONG, arg);
+	}
+}
+
+/* There are no functions yet, so the only calls are to these, and each
+ * compiles straight to its instruction once its arguments are pushed. A
+ * name in front of '(' always means the built-in, whatever variables
+ * there are. */
+typedef struct {
+	const char* name;
+	int arity;
+	OpCode instruction;
+} Builtin;
+
+static const Builtin builtins[] = {
+	{"array",	1, OP_NEW_ARRAY},
+	{"len",		1, OP_LENGTH},
+	{"add",		2, OP_ARRAY_ADD},
+	{"mul",		2, OP_ARRAY_MULTIPLY},
+	{"sum",		1, OP_ARRAY_SUM},
+	{"min",		1, OP_ARRAY_MIN},
+	{"max",		1, OP_ARRAY_MAX},
+	{"dot",		2, OP_ARRAY_DOT},
+};
+
+static const Builtin* findBuiltin(Token* name) {
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		const char* builtin = builtins[i].name;
+		if ((int)strlen(builtin) == name->length && memcmp(builtin, name->start, name->length) == 0) {
+			return &builtins[i];
+		}
 	}
+	return NULL;
 }
 
-static void variable(bool canAssign) {
-	namedVariable(parser.previous, canAssign);
+static void call(Parser* parser, Token name) {
+	const Builtin* builtin = findBuiltin(&name);
+	if (builtin == NULL) error(parser, "Can only call built-in functions.");
+
+	advance(parser);	/* the '(' */
+	int argCount = 0;
+	if (!check(parser, TOKEN_RIGHT_PAREN)) {
+		do {
+			expression(parser);
+			argCount++;
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+	if (builtin == NULL) return;
+
+	if (argCount != builtin->arity) {
+		char message[64];
+		snprintf(message, sizeof(message), "Expected %d argument%s but got %d.",
+				 builtin->arity, builtin->arity == 1 ? "" : "s", argCount);
+		error(parser, message);
+		return;
+	}
+	emitByte(parser, builtin->instruction);
 }
 
-static void unary(bool canAssign) {
-	TokenType operatorType = parser.previous.type;
+static void variable(Parser* parser, bool canAssign) {
+	if (check(parser, TOKEN_LEFT_PAREN)) {
+		call(parser, parser->previous);
+		return;
+	}
+	namedVariable(parser, parser->previous, canAssign);
+}
+
+/* [a, b, c] pushes the elements in order and OP_ARRAY packs them up. */
+static void array(Parser* parser, bool canAssign) {
+	int count = 0;
+	if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+		do {
+			expression(parser);
+			if (count == UINT8_MAX) error(parser, "Can't have more than 255 elements in an array literal.");
+			count++;
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+	emitBytes(parser, OP_ARRAY, (uint8_t)count);
+}
+
+static void subscript(Parser* parser, bool canAssign) {
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+	if (canAssign && match(parser, TOKEN_EQUAL)) {
+		expression(parser);
+		emitByte(parser, OP_SET_INDEX);
+	} else {
+		emitByte(parser, OP_GET_INDEX);
+	}
+}
+
+static void unary(Parser* parser, bool canAssign) {
+	TokenType operatorType = parser->previous.type;
 
 	// Compile the operand.
-	parsePrecedence(PREC_UNARY);
+	int operandStart = currentChunk(parser)->count;
+	parsePrecedence(parser, PREC_UNARY);
+
+	// Fold it if it's a literal, unless negating it would be a runtime error.
+	Value operand;
+	if (constantSince(parser, operandStart, &operand)) {
+		if (operatorType == TOKEN_BANG) {
+			replaceWithConstant(parser, operandStart, BOOL_VAL(isFalsey(operand)));
+			return;
+		}
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+			replaceWithConstant(parser, operandStart, NUMBER_VAL(-AS_NUMBER(operand)));
+			return;
+		}
+	}
 
 	// Emit the operator instruction.
 	switch (operatorType) {
-		case TOKEN_BANG: emitByte(OP_NOT); break;
-		case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+		case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+		case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
 		default: return; // Unreachable.
 	}
 }
@@ -446,6 +748,8 @@ ParseRule rules[] = {
 	[TOKEN_RIGHT_PAREN]		= {NULL,	NULL,	PREC_NONE},
 	[TOKEN_LEFT_BRACE]		= {NULL,	NULL,	PREC_NONE},
 	[TOKEN_RIGHT_BRACE]		= {NULL,	NULL,	PREC_NONE},
+	[TOKEN_LEFT_BRACKET]	= {array,	subscript,	PREC_CALL},
+	[TOKEN_RIGHT_BRACKET]	= {NULL,	NULL,	PREC_NONE},
 	[TOKEN_COMMA]			= {NULL,	NULL,	PREC_NONE},
 	[TOKEN_DOT]				= {NULL,	NULL,	PREC_NONE},
 	[TOKEN_MINUS]			= {unary,	binary, PREC_TERM},
@@ -484,26 +788,28 @@ ParseRule rules[] = {
 	[TOKEN_EOF]				= {NULL,	NULL,	PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence) {
-	advance();
-	ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+	advance(parser);
+	ParseFn prefixRule = getRule(parser->previous.type)->prefix;
 	if (prefixRule == NULL) {
-		error("Expect expression.");
+		error(parser, "Expect expression.");
 		return;
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
-	prefixRule(canAssign);	/* since assignment is the lowest-precedence expression, the only time we allow an assignment is when parsing */
+	int start = currentChunk(parser)->count;
+	prefixRule(parser, canAssign);	/* since assignment is the lowest-precedence expression, the only time we allow an assignment is when parsing */
 	/* an assignment expression or top-level expression like in an expression statement. */
 
-	while(precedence <= getRule(parser.current.type)->precedence) {
-		advance();
-		ParseFn infixRule = getRule(parser.previous.type)->infix;
-		infixRule(canAssign);
+	while(precedence <= getRule(parser->current.type)->precedence) {
+		advance(parser);
+		ParseFn infixRule = getRule(parser->previous.type)->infix;
+		parser->compiler->operandStart = start;	/* binary() folds the left operand if it's a constant */
+		infixRule(parser, canAssign);
 	}
 
-	if (canAssign && match(TOKEN_EQUAL)) {
-		error("Invalid assignment target.");
+	if (canAssign && match(parser, TOKEN_EQUAL)) {
+		error(parser, "Invalid assignment target.");
 	}
 }
 
@@ -527,128 +833,128 @@ static ParseRule* getRule(TokenType type) {
  Unary negation: -123
  The four horsemen of the arithmetic: +, -, *, /
  */
-static void expression() {
-	parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+	parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block() {
-	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-		declaration();
+static void block(Parser* parser) {
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+		declaration(parser);
 	}
 
-	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 /* if we managed to identify a var keyword we call this function */
-static void varDeclaration() {
-	uint8_t global = parseVariable("Expect variable name.");	/* the keyword is followed by the variable name, which is compiled by parseVariable() */
+static void varDeclaration(Parser* parser) {
+	int global = parseVariable(parser, "Expect variable name.");	/* the keyword is followed by the variable name, which is compiled by parseVariable() */
 
-	if (match(TOKEN_EQUAL)) {	/* we look for an = sign followed by initializer expression.*/
-		expression();
+	if (match(parser, TOKEN_EQUAL)) {	/* we look for an = sign followed by initializer expression.*/
+		expression(parser);
 	} else {	/* if the user doesn't initialize the variable, the compiler implicitly initializes it to nil by emitting an OP_NIL opcode */
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 	}
-	consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");	/* either way we expect the statement to be terminated with (;)*/
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");	/* either way we expect the statement to be terminated with (;)*/
 
-	defineVariable(global);
+	defineVariable(parser, global);
 }
 
 
-static void expressionStatement() {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-	emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+	emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-	beginScope();
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-	if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser* parser) {
+	beginScope(parser);
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	if (match(parser, TOKEN_SEMICOLON)) {
 		// No initializer
-	} else if (match(TOKEN_VAR)) {
-		varDeclaration();
+	} else if (match(parser, TOKEN_VAR)) {
+		varDeclaration(parser);
 	} else {
-		expressionStatement();
+		expressionStatement(parser);
 	}
 
-	int loopStart = currentChunk()->count;
+	int loopStart = currentChunk(parser)->count;
 	int exitJump = -1;
-	if (match(TOKEN_SEMICOLON)) {
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+	if (!match(parser, TOKEN_SEMICOLON)) {
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
 		// Jump out of the loop if the condition is false.
-		exitJump = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP); // Condition
+		exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+		emitByte(parser, OP_POP); // Condition
 	}
 
-	if (!match(TOKEN_RIGHT_PAREN)) {
-		int bodyJump = emitJump(OP_JUMP);
-		int incrementStart = currentChunk()->count;
-		expression();
-		emitByte(OP_POP);
-		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+	if (!match(parser, TOKEN_RIGHT_PAREN)) {
+		int bodyJump = emitJump(parser, OP_JUMP);
+		int incrementStart = currentChunk(parser)->count;
+		expression(parser);
+		emitByte(parser, OP_POP);
+		consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-		emitLoop(loopStart);
+		emitLoop(parser, loopStart);
 		loopStart = incrementStart;
-		patchJump(bodyJump);
+		patchJump(parser, bodyJump);
 	}
 
-	statement();
-	emitLoop(loopStart);
+	statement(parser);
+	emitLoop(parser, loopStart);
 
-	if (exitJump != 1) {
-		patchJump(exitJump);
-		emitByte(OP_POP); // Condition
+	if (exitJump != -1) {
+		patchJump(parser, exitJump);
+		emitByte(parser, OP_POP); // Condition
 	}
-	endScope();
+	endScope(parser);
 }
 
-static void ifStatement() {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int thenJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);	// When the condition is truthy, we pop it right before the code inside the then branch.
-	statement();
+	int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);	// When the condition is truthy, we pop it right before the code inside the then branch.
+	statement(parser);
 
-	int elseJump = emitJump(OP_JUMP);
+	int elseJump = emitJump(parser, OP_JUMP);
 
-	patchJump(thenJump);
-	emitByte(OP_POP);	// Otherwise, we pop it at the beginning of the else branch.
+	patchJump(parser, thenJump);
+	emitByte(parser, OP_POP);	// Otherwise, we pop it at the beginning of the else branch.
 	 
-	if (match(TOKEN_ELSE)) statement();
-	patchJump(elseJump);
+	if (match(parser, TOKEN_ELSE)) statement(parser);
+	patchJump(parser, elseJump);
 }
 
-static void printStatement() {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-	emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+	emitByte(parser, OP_PRINT);
 }
 
-static void whileStatement() {
-	int loopStart = currentChunk()->count;
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+	int loopStart = currentChunk(parser)->count;
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int exitJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
-	emitLoop(loopStart);
+	int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);
+	statement(parser);
+	emitLoop(parser, loopStart);
 
-	patchJump(exitJump);
-	emitByte(OP_POP);
+	patchJump(parser, exitJump);
+	emitByte(parser, OP_POP);
 }
 
-static void synchronize() {
-	parser.panicMode = false;
+static void synchronize(Parser* parser) {
+	parser->panicMode = false;
 
-	while (parser.current.type != TOKEN_EOF) {
-		if (parser.previous.type == TOKEN_SEMICOLON) return;
-		switch (parser.current.type) {
+	while (parser->current.type != TOKEN_EOF) {
+		if (parser->previous.type == TOKEN_SEMICOLON) return;
+		switch (parser->current.type) {
 			case TOKEN_CLASS:
 			case TOKEN_FUN:
 			case TOKEN_VAR:
@@ -663,7 +969,7 @@ static void synchronize() {
 				; // Do nothing.
 		}
 
-		advance();
+		advance(parser);
 	}
 }
 
@@ -672,49 +978,59 @@ static void synchronize() {
  * - accesing the value of a variable using an identifier expression
  * - storing a new value in an existing variable using an assignment expression */
 
-static void declaration() {
-	if (match(TOKEN_VAR)) {
-		varDeclaration();
+static void declaration(Parser* parser) {
+	if (match(parser, TOKEN_VAR)) {
+		varDeclaration(parser);
 	} else {
-		statement();
+		statement(parser);
 	}
 
-	if (parser.panicMode) synchronize();
+	if (parser->panicMode) synchronize(parser);
 }
 
-static void statement() {
-	if (match(TOKEN_PRINT)) {
-		printStatement();
-	} else if (match(TOKEN_FOR)) {
-		forStatement();
-	} else if (match(TOKEN_IF)) { 
-		ifStatement();
-	} else if (match(TOKEN_WHILE)) {
-		whileStatement();
-	} else if (match(TOKEN_LEFT_BRACE)) {
-		beginScope();
-		block();
-		endScope();
+static void statement(Parser* parser) {
+	if (match(parser, TOKEN_PRINT)) {
+		printStatement(parser);
+	} else if (match(parser, TOKEN_FOR)) {
+		forStatement(parser);
+	} else if (match(parser, TOKEN_IF)) { 
+		ifStatement(parser);
+	} else if (match(parser, TOKEN_WHILE)) {
+		whileStatement(parser);
+	} else if (match(parser, TOKEN_LEFT_BRACE)) {
+		beginScope(parser);
+		block(parser);
+		endScope(parser);
 	} else {	/* if we don't see a print keyword, then we must be looking at an expression stmt.*/
-		expressionStatement();
+		expressionStatement(parser);
 	}
 }
 
-bool compile(const char* source, Chunk* chunk) {
-	initScanner(source); /* the compiler set up the scanner */
+bool compile(VM* vm, const char* source, Chunk* chunk) {
+	beginCompilerArena(vm);
+	vm->chunk = chunk;	/* keeps the constants alive once compiling is done */
+	Parser parser;
+	parser.vm = vm;
+	initTokenStream(&parser.tokens, source); /* the compiler set up the scanner */
+	parser.names = NULL;
+	parser.nameCount = 0;
+	parser.nameCapacity = 0;
 	Compiler compiler;
-	initCompiler(&compiler);
-	compilingChunk = chunk;
+	initCompiler(&parser, &compiler);
+	parser.chunk = chunk;
 
 	parser.hadError = false;
 	parser.panicMode = false;
 
-	advance();	/* primes the pump on the scanner */
-	while (!match(TOKEN_EOF)) {	/* while match to TOKEN_EOF is false we call declaration */
-		declaration();
+	advance(&parser);	/* primes the pump on the scanner */
+	while (!match(&parser, TOKEN_EOF)) {	/* while match to TOKEN_EOF is false we call declaration */
+		declaration(&parser);
 	}
 	// expression();
 	// consume(TOKEN_EOF, "Expect end of expression.");
-	endCompiler();
+	endCompiler(&parser);
+	freeTokenStream(&parser.tokens);
+	FREE_ARRAY(vm, MEM_SCRATCH, CachedName, parser.names, parser.nameCapacity);
+	endCompilerArena(vm);
 	return !parser.hadError;
 }
@@ -1,21 +1,114 @@
 #include <stdio.h>
 
 #include "lib/debug.h"
+#include "lib/object.h"
 #include "lib/value.h"
+#include "lib/vm.h"
 
-void disassembleChunk(Chunk *chunk, const char *name) {
+/* Printable names for each opcode, used by the profiler report. */
+static const char* opcodeNames[] = {
+	[OP_CONSTANT]		= "OP_CONSTANT",
+	[OP_CONSTANT_LONG]	= "OP_CONSTANT_LONG",
+	[OP_NIL]			= "OP_NIL",
+	[OP_TRUE]			= "OP_TRUE",
+	[OP_FALSE]			= "OP_FALSE",
+	[OP_POP]			= "OP_POP",
+	[OP_GET_LOCAL]		= "OP_GET_LOCAL",
+	[OP_SET_LOCAL]		= "OP_SET_LOCAL",
+	[OP_GET_GLOBAL]		= "OP_GET_GLOBAL",
+	[OP_GET_GLOBAL_LONG]	= "OP_GET_GLOBAL_LONG",
+	[OP_DEFINE_GLOBAL]	= "OP_DEFINE_GLOBAL",
+	[OP_DEFINE_GLOBAL_LONG]	= "OP_DEFINE_GLOBAL_LONG",
+	[OP_SET_GLOBAL]		= "OP_SET_GLOBAL",
+	[OP_SET_GLOBAL_LONG]	= "OP_SET_GLOBAL_LONG",
+	[OP_EQUAL]			= "OP_EQUAL",
+	[OP_GREATER]		= "OP_GREATER",
+	[OP_LESS]			= "OP_LESS",
+	[OP_ADD]			= "OP_ADD",
+	[OP_SUBTRACT]		= "OP_SUBTRACT",
+	[OP_MULTIPLY]		= "OP_MULTIPLY",
+	[OP_DIVIDE]			= "OP_DIVIDE",
+	[OP_NOT]			= "OP_NOT",
+	[OP_NEGATE]			= "OP_NEGATE",
+	[OP_PRINT]			= "OP_PRINT",
+	[OP_JUMP]			= "OP_JUMP",
+	[OP_JUMP_IF_FALSE]	= "OP_JUMP_IF_FALSE",
+	[OP_LOOP]			= "OP_LOOP",
+	[OP_RETURN]			= "OP_RETURN",
+	[OP_ARRAY]				= "OP_ARRAY",
+	[OP_NEW_ARRAY]			= "OP_NEW_ARRAY",
+	[OP_GET_INDEX]			= "OP_GET_INDEX",
+	[OP_SET_INDEX]			= "OP_SET_INDEX",
+	[OP_LENGTH]				= "OP_LENGTH",
+	[OP_ARRAY_ADD]			= "OP_ARRAY_ADD",
+	[OP_ARRAY_MULTIPLY]		= "OP_ARRAY_MULTIPLY",
+	[OP_ARRAY_SUM]			= "OP_ARRAY_SUM",
+	[OP_ARRAY_MIN]			= "OP_ARRAY_MIN",
+	[OP_ARRAY_MAX]			= "OP_ARRAY_MAX",
+	[OP_ARRAY_DOT]			= "OP_ARRAY_DOT",
+	[OP_POP_JUMP_IF_FALSE]		= "OP_POP_JUMP_IF_FALSE",
+	[OP_JUMP_IF_NOT_EQUAL]		= "OP_JUMP_IF_NOT_EQUAL",
+	[OP_JUMP_IF_NOT_GREATER]	= "OP_JUMP_IF_NOT_GREATER",
+	[OP_JUMP_IF_NOT_LESS]		= "OP_JUMP_IF_NOT_LESS",
+	[OP_ADD_LOCALS]				= "OP_ADD_LOCALS",
+	[OP_ADD_LOCAL_CONSTANT]		= "OP_ADD_LOCAL_CONSTANT",
+	[OP_ADD_NUM]				= "OP_ADD_NUM",
+	[OP_ADD_STRING]				= "OP_ADD_STRING",
+	[OP_SUBTRACT_NUM]			= "OP_SUBTRACT_NUM",
+	[OP_MULTIPLY_NUM]			= "OP_MULTIPLY_NUM",
+	[OP_DIVIDE_NUM]				= "OP_DIVIDE_NUM",
+	[OP_GREATER_NUM]			= "OP_GREATER_NUM",
+	[OP_LESS_NUM]				= "OP_LESS_NUM",
+	[OP_JUMP_IF_NOT_GREATER_NUM]	= "OP_JUMP_IF_NOT_GREATER_NUM",
+	[OP_JUMP_IF_NOT_LESS_NUM]		= "OP_JUMP_IF_NOT_LESS_NUM",
+};
+
+const char* opcodeName(uint8_t instruction) {
+	if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+		opcodeNames[instruction] == NULL) {
+		return "UNKNOWN";
+	}
+	return opcodeNames[instruction];
+}
+
+void disassembleChunk(VM* vm, Chunk *chunk, const char *name) {
 	printf("== %s ==\n", name);
 
 	for (int offset = 0; offset < chunk->count;) { 
-		offset = disassembleInstruction(chunk, offset);
+		offset = disassembleInstruction(vm, chunk, offset);
 	}
 }
 
-static int constantInstruction(const char *name, Chunk *chunk, int offset) { 
+static int constantInstruction(VM* vm, const char *name, Chunk *chunk, int offset) { 
 	uint8_t constant = chunk->code[offset + 1];
 	printf("%-16s %4d '", name, constant);
-	printValue(chunk->constants.values[constant]);
+	printValue(vm, chunk->constants.values[constant]);
+	printf("'\n");
+	return offset + 2;
+}
+
+static int constantLongInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+	uint32_t constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+	printf("%-16s %4d '", name, constant);
+	printValue(vm, chunk->constants.values[constant]);
 	printf("'\n");
+	return offset + 4;
+}
+
+static void printGlobal(VM* vm, const char* name, int slot) {
+	ObjString* global = globalName(vm, slot);
+	printf("%-16s %4d '%.*s'\n", name, slot, global->length, global->chars);
+}
+
+static int globalLongInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+	uint32_t slot = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+	printGlobal(vm, name, (int)slot);
+	return offset + 4;
+}
+
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+	uint8_t slot = chunk->code[offset + 1];
+	printGlobal(vm, name, slot);
 	return offset + 2;
 }
 
@@ -30,6 +123,20 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+	printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+	return offset + 3;
+}
+
+static int localConstantInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+	uint8_t slot = chunk->code[offset + 1];
+	uint8_t constant = chunk->code[offset + 2];
+	printf("%-16s %4d %4d '", name, slot, constant);
+	printValue(vm, chunk->constants.values[constant]);
+	printf("'\n");
+	return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -37,18 +144,21 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 	return offset + 3;
 }
 
-int disassembleInstruction(Chunk *chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk *chunk, int offset) {
 	printf("%04d ", offset);	/* It's helpful to show which source line each instruction was compiled from. */
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {	/* That gives us a way to map back to the original code */
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1)) {	/* That gives us a way to map back to the original code */
 		printf("   | ");	/* when we're trying to figure out what some blob of bytecode is supposed to do.*/
 	} else { 
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
 	switch (instruction) {
 		case OP_CONSTANT:
-			return constantInstruction("OP_CONSTANT", chunk, offset);
+			return constantInstruction(vm, "OP_CONSTANT", chunk, offset);
+		case OP_CONSTANT_LONG:
+			return constantLongInstruction(vm, "OP_CONSTANT_LONG", chunk, offset);
 		case OP_NIL:
 			return simpleInstruction("OP_NIL", offset);
 		case OP_TRUE:
@@ -62,11 +172,17 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 		case OP_SET_LOCAL:
 			return byteInstruction("OP_SET_LOCAL", chunk, offset);
 		case OP_GET_GLOBAL:
-			return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+			return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
+		case OP_GET_GLOBAL_LONG:
+			return globalLongInstruction(vm, "OP_GET_GLOBAL_LONG", chunk, offset);
 		case OP_DEFINE_GLOBAL:
-			return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+			return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
+		case OP_DEFINE_GLOBAL_LONG:
+			return globalLongInstruction(vm, "OP_DEFINE_GLOBAL_LONG", chunk, offset);
 		case OP_SET_GLOBAL:
-			return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+			return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
+		case OP_SET_GLOBAL_LONG:
+			return globalLongInstruction(vm, "OP_SET_GLOBAL_LONG", chunk, offset);
 		case OP_EQUAL:
 			return simpleInstruction("OP_EQUAL", offset);
 		case OP_GREATER:
@@ -95,6 +211,58 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 			return jumpInstruction("OP_LOOP", -1, chunk, offset);
 		case OP_RETURN:
 			return simpleInstruction("OP_RETURN", offset);
+		case OP_ARRAY:
+			return byteInstruction("OP_ARRAY", chunk, offset);
+		case OP_NEW_ARRAY:
+			return simpleInstruction("OP_NEW_ARRAY", offset);
+		case OP_GET_INDEX:
+			return simpleInstruction("OP_GET_INDEX", offset);
+		case OP_SET_INDEX:
+			return simpleInstruction("OP_SET_INDEX", offset);
+		case OP_LENGTH:
+			return simpleInstruction("OP_LENGTH", offset);
+		case OP_ARRAY_ADD:
+			return simpleInstruction("OP_ARRAY_ADD", offset);
+		case OP_ARRAY_MULTIPLY:
+			return simpleInstruction("OP_ARRAY_MULTIPLY", offset);
+		case OP_ARRAY_SUM:
+			return simpleInstruction("OP_ARRAY_SUM", offset);
+		case OP_ARRAY_MIN:
+			return simpleInstruction("OP_ARRAY_MIN", offset);
+		case OP_ARRAY_MAX:
+			return simpleInstruction("OP_ARRAY_MAX", offset);
+		case OP_ARRAY_DOT:
+			return simpleInstruction("OP_ARRAY_DOT", offset);
+		case OP_POP_JUMP_IF_FALSE:
+			return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_EQUAL:
+			return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_GREATER:
+			return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_LESS:
+			return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+		case OP_ADD_LOCALS:
+			return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+		case OP_ADD_LOCAL_CONSTANT:
+			return localConstantInstruction(vm, "OP_ADD_LOCAL_CONSTANT", chunk, offset);
+		case OP_ADD_NUM:
+			return simpleInstruction("OP_ADD_NUM", offset);
+		case OP_ADD_STRING:
+			return simpleInstruction("OP_ADD_STRING", offset);
+		case OP_SUBTRACT_NUM:
+			return simpleInstruction("OP_SUBTRACT_NUM", offset);
+		case OP_MULTIPLY_NUM:
+			return simpleInstruction("OP_MULTIPLY_NUM", offset);
+		case OP_DIVIDE_NUM:
+			return simpleInstruction("OP_DIVIDE_NUM", offset);
+		case OP_GREATER_NUM:
+			return simpleInstruction("OP_GREATER_NUM", offset);
+		case OP_LESS_NUM:
+			return simpleInstruction("OP_LESS_NUM", offset);
+		case OP_JUMP_IF_NOT_GREATER_NUM:
+			return jumpInstruction("OP_JUMP_IF_NOT_GREATER_NUM", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_LESS_NUM:
+			return jumpInstruction("OP_JUMP_IF_NOT_LESS_NUM", 1, chunk, offset);
 		default:
 			printf("Unknown opcode %d\n", instruction);
 			return offset + 1;
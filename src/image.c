@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/image.h"
+#include "lib/memory.h"
+#include "lib/object.h"
+#include "lib/source.h"
+#include "lib/vm.h"
+
+/*
+ * Layout. Every integer is a little-endian uint32 unless noted.
+ *
+ *   header:    "LOXC" version checksum bodyLength
+ *   code:      count, then count bytes
+ *   lines:     count, then count (offset, line) pairs
+ *   constants: count, then per constant a tag byte and its payload:
+ *              nil/false/true have none, a number is its 8 raw bytes,
+ *              a string is its index in the string table
+ *   globals:   count, then the string index naming each slot in order
+ *   strings:   count, then (length, hash) per string, then every
+ *              string's characters back to back
+ *
+ * The checksum is FNV-1a over the body. Strings live together at the end
+ * with their hashes, so the loader interns them all in one pass without
+ * rehashing.
+ */
+
+#define IMAGE_HEADER_SIZE 16
+
+typedef enum {
+	IMAGE_NIL,
+	IMAGE_FALSE,
+	IMAGE_TRUE,
+	IMAGE_NUMBER,
+	IMAGE_STRING,
+} ImageTag;
+
+/* A growable byte buffer the writer serializes into. */
+typedef struct {
+	VM* vm;
+	uint8_t* bytes;
+	int count;
+	int capacity;
+} ImageBuffer;
+
+static void writeByte(ImageBuffer* buffer, uint8_t byte) {
+	if (buffer->capacity < buffer->count + 1) {
+		int oldCapacity = buffer->capacity;
+		buffer->capacity = GROW_CAPACITY(oldCapacity);
+		buffer->bytes = GROW_ARRAY(buffer->vm, MEM_SCRATCH, uint8_t, buffer->bytes, oldCapacity, buffer->capacity);
+	}
+	buffer->bytes[buffer->count++] = byte;
+}
+
+static void writeU32(ImageBuffer* buffer, uint32_t value) {
+	for (int i = 0; i < 4; i++) writeByte(buffer, (value >> (8 * i)) & 0xff);
+}
+
+static void writeBytes(ImageBuffer* buffer, const void* bytes, int length) {
+	for (int i = 0; i < length; i++) writeByte(buffer, ((const uint8_t*)bytes)[i]);
+}
+
+static uint32_t checksum(const uint8_t* bytes, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/* The strings an image refers to, in the order they'll be written. */
+typedef struct {
+	VM* vm;
+	ObjString** strings;
+	int count;
+	int capacity;
+	Table indices;	/* string -> its index above, so each one is written once */
+} StringPool;
+
+static uint32_t poolString(StringPool* pool, ObjString* string) {
+	Value index;
+	if (tableGet(&pool->indices, string, &index)) return (uint32_t)AS_NUMBER(index);
+
+	if (pool->capacity < pool->count + 1) {
+		int oldCapacity = pool->capacity;
+		pool->capacity = GROW_CAPACITY(oldCapacity);
+		pool->strings = GROW_ARRAY(pool->vm, MEM_SCRATCH, ObjString*, pool->strings, oldCapacity, pool->capacity);
+	}
+	pool->strings[pool->count] = string;
+	tableSet(pool->vm, &pool->indices, string, NUMBER_VAL(pool->count));
+	return (uint32_t)pool->count++;
+}
+
+bool writeImage(VM* vm, Chunk* chunk, const char* path) {
+	ImageBuffer body = {vm, NULL, 0, 0};
+	StringPool pool;
+	pool.vm = vm;
+	pool.strings = NULL;
+	pool.count = 0;
+	pool.capacity = 0;
+	initTable(&pool.indices);
+
+	/* Always the generic opcodes, so an image doesn't depend on which types
+	 * a run that happened before it was written saw. */
+	writeU32(&body, (uint32_t)chunk->count);
+	for (int offset = 0; offset < chunk->count;) {
+		int length = instructionLength(chunk->code[offset]);
+		writeByte(&body, genericOpcode(chunk->code[offset]));
+		writeBytes(&body, chunk->code + offset + 1, length - 1);
+		offset += length;
+	}
+
+	writeU32(&body, (uint32_t)chunk->lineCount);
+	for (int i = 0; i < chunk->lineCount; i++) {
+		writeU32(&body, (uint32_t)chunk->lines[i].offset);
+		writeU32(&body, (uint32_t)chunk->lines[i].line);
+	}
+
+	writeU32(&body, (uint32_t)chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++) {
+		Value value = chunk->constants.values[i];
+		if (IS_NIL(value)) {
+			writeByte(&body, IMAGE_NIL);
+		} else if (IS_BOOL(value)) {
+			writeByte(&body, AS_BOOL(value) ? IMAGE_TRUE : IMAGE_FALSE);
+		} else if (IS_NUMBER(value)) {
+			double number = AS_NUMBER(value);
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(double));
+			writeByte(&body, IMAGE_NUMBER);
+			writeU32(&body, (uint32_t)bits);
+			writeU32(&body, (uint32_t)(bits >> 32));
+		} else {
+			writeByte(&body, IMAGE_STRING);
+			writeU32(&body, poolString(&pool, AS_STRING(value)));
+		}
+	}
+
+	/* Slots are numbered in the order names were first seen, so writing the
+	 * VM's names in slot order lets the loader hand out the same numbers. */
+	writeU32(&body, (uint32_t)vm->globalValues.count);
+	for (int slot = 0; slot < vm->globalValues.count; slot++) {
+		writeU32(&body, poolString(&pool, globalName(vm, slot)));
+	}
+
+	writeU32(&body, (uint32_t)pool.count);
+	for (int i = 0; i < pool.count; i++) {
+		writeU32(&body, (uint32_t)pool.strings[i]->length);
+		writeU32(&body, pool.strings[i]->hash);
+	}
+	for (int i = 0; i < pool.count; i++) {
+		writeBytes(&body, pool.strings[i]->chars, pool.strings[i]->length);
+	}
+
+	ImageBuffer header = {vm, NULL, 0, 0};
+	writeBytes(&header, "LOXC", 4);
+	writeU32(&header, IMAGE_VERSION);
+	writeU32(&header, checksum(body.bytes, body.count));
+	writeU32(&header, (uint32_t)body.count);
+
+	bool ok = false;
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Could not open \"%s\" for writing.\n", path);
+	} else {
+		ok = fwrite(header.bytes, 1, header.count, file) == (size_t)header.count &&
+			 fwrite(body.bytes, 1, body.count, file) == (size_t)body.count;
+		if (fclose(file) != 0) ok = false;
+		if (!ok) fprintf(stderr, "Could not write \"%s\".\n", path);
+	}
+
+	FREE_ARRAY(vm, MEM_SCRATCH, uint8_t, header.bytes, header.capacity);
+	FREE_ARRAY(vm, MEM_SCRATCH, uint8_t, body.bytes, body.capacity);
+	FREE_ARRAY(vm, MEM_SCRATCH, ObjString*, pool.strings, pool.capacity);
+	freeTable(vm, &pool.indices);
+	return ok;
+}
+
+/* Reads the image back. Every read is bounds checked against end, and a
+ * short read leaves the reader failed instead of running off the mapping. */
+typedef struct {
+	const uint8_t* current;
+	const uint8_t* end;
+	bool failed;
+} ImageReader;
+
+static uint32_t readU32(ImageReader* reader) {
+	if (reader->end - reader->current < 4) {
+		reader->failed = true;
+		return 0;
+	}
+	const uint8_t* bytes = reader->current;
+	reader->current += 4;
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+		   ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint8_t readByte(ImageReader* reader) {
+	if (reader->current >= reader->end) {
+		reader->failed = true;
+		return 0;
+	}
+	return *reader->current++;
+}
+
+/* Returns a pointer to the next length bytes and skips past them. */
+static const uint8_t* readBytes(ImageReader* reader, size_t length) {
+	if ((size_t)(reader->end - reader->current) < length) {
+		reader->failed = true;
+		return NULL;
+	}
+	const uint8_t* bytes = reader->current;
+	reader->current += length;
+	return bytes;
+}
+
+static bool parseImage(VM* vm, const uint8_t* bytes, size_t size, Chunk* chunk, const char* path) {
+	if (size < IMAGE_HEADER_SIZE || memcmp(bytes, "LOXC", 4) != 0) {
+		fprintf(stderr, "\"%s\" is not a clox image.\n", path);
+		return false;
+	}
+
+	ImageReader reader = {bytes + 4, bytes + IMAGE_HEADER_SIZE, false};
+	uint32_t version = readU32(&reader);
+	uint32_t sum = readU32(&reader);
+	uint32_t bodyLength = readU32(&reader);
+	if (version != IMAGE_VERSION) {
+		fprintf(stderr, "\"%s\" was built for image version %u, expected %d. Recompile it.\n",
+				path, version, IMAGE_VERSION);
+		return false;
+	}
+	if (bodyLength != size - IMAGE_HEADER_SIZE ||
+		checksum(bytes + IMAGE_HEADER_SIZE, bodyLength) != sum) {
+		fprintf(stderr, "\"%s\" is corrupt (checksum mismatch).\n", path);
+		return false;
+	}
+
+	reader.current = bytes + IMAGE_HEADER_SIZE;
+	reader.end = bytes + size;
+
+	uint32_t codeCount = readU32(&reader);
+	const uint8_t* code = readBytes(&reader, codeCount);
+	uint32_t lineCount = readU32(&reader);
+	const uint8_t* lines = readBytes(&reader, (size_t)lineCount * 8);
+	uint32_t constantCount = readU32(&reader);
+	const uint8_t* constants = reader.current;
+	/* Constants are variable length, so skip them now and come back once
+	 * the string table they point into has been interned. */
+	for (uint32_t i = 0; i < constantCount && !reader.failed; i++) {
+		uint8_t tag = readByte(&reader);
+		if (tag == IMAGE_NUMBER) readBytes(&reader, 8);
+		if (tag == IMAGE_STRING) readU32(&reader);
+	}
+	uint32_t globalCount = readU32(&reader);
+	const uint8_t* globals = readBytes(&reader, (size_t)globalCount * 4);
+	uint32_t stringCount = readU32(&reader);
+	const uint8_t* stringHeaders = readBytes(&reader, (size_t)stringCount * 8);
+	if (reader.failed) {
+		fprintf(stderr, "\"%s\" is truncated.\n", path);
+		return false;
+	}
+
+	/* getLine() needs a run starting at 0 and the rest in order to find
+	 * anything, and runtimeError(), --profile and the sampler all call it. */
+	bool linesOk = codeCount == 0 || lineCount > 0;
+	ImageReader lineCheck = {lines, lines + lineCount * 8, false};
+	uint32_t least = 0;	/* the first run starts at 0, and each after it later */
+	for (uint32_t i = 0; linesOk && i < lineCount; i++) {
+		uint32_t offset = readU32(&lineCheck);
+		readU32(&lineCheck);
+		linesOk = (i == 0 ? offset == 0 : offset >= least) && offset < codeCount;
+		least = offset + 1;
+	}
+	if (!linesOk) {
+		fprintf(stderr, "\"%s\" is corrupt.\n", path);
+		return false;
+	}
+
+	/* Bulk intern the string table straight out of the image. */
+	ObjString** strings = ALLOCATE(vm, MEM_SCRATCH, ObjString*, stringCount);
+	ImageReader headers = {stringHeaders, stringHeaders + stringCount * 8, false};
+	for (uint32_t i = 0; i < stringCount; i++) {
+		uint32_t length = readU32(&headers);
+		uint32_t hash = readU32(&headers);
+		const uint8_t* chars = readBytes(&reader, length);
+		if (reader.failed) break;
+		strings[i] = borrowStrings ? borrowStringHashed(vm, (const char*)chars, (int)length, hash)
+								   : copyStringHashed(vm, (const char*)chars, (int)length, hash);
+	}
+
+	bool ok = !reader.failed;
+	ImageReader globalReader = {globals, globals + globalCount * 4, false};
+	for (uint32_t slot = 0; ok && slot < globalCount; slot++) {
+		uint32_t index = readU32(&globalReader);
+		if (index >= stringCount || globalSlot(vm, strings[index]) != (int)slot) {
+			fprintf(stderr, "\"%s\" uses global slots this VM has already handed out.\n", path);
+			ok = false;
+		}
+	}
+
+	ImageReader constantReader = {constants, reader.end, false};
+	for (uint32_t i = 0; ok && i < constantCount; i++) {
+		switch (readByte(&constantReader)) {
+			case IMAGE_NIL:		writeValueArray(vm, &chunk->constants, NIL_VAL); break;
+			case IMAGE_FALSE:	writeValueArray(vm, &chunk->constants, BOOL_VAL(false)); break;
+			case IMAGE_TRUE:	writeValueArray(vm, &chunk->constants, BOOL_VAL(true)); break;
+			case IMAGE_NUMBER: {
+				uint64_t bits = readU32(&constantReader);
+				bits |= (uint64_t)readU32(&constantReader) << 32;
+				double number;
+				memcpy(&number, &bits, sizeof(double));
+				writeValueArray(vm, &chunk->constants, NUMBER_VAL(number));
+				break;
+			}
+			case IMAGE_STRING: {
+				uint32_t index = readU32(&constantReader);
+				if (index >= stringCount) {
+					ok = false;
+					break;
+				}
+				writeValueArray(vm, &chunk->constants, OBJ_VAL(strings[index]));
+				break;
+			}
+			default:
+				ok = false;
+		}
+	}
+	FREE_ARRAY(vm, MEM_SCRATCH, ObjString*, strings, stringCount);
+
+	if (!ok) {
+		/* The characters run out only while interning. */
+		fprintf(stderr, reader.failed ? "\"%s\" is truncated.\n" : "\"%s\" is corrupt.\n", path);
+		return false;
+	}
+
+	/* Code and line runs are copied in wholesale; nothing gets scanned or
+	 * compiled. */
+	chunk->code = ALLOCATE(vm, MEM_CODE, uint8_t, codeCount);
+	memcpy(chunk->code, code, codeCount);
+	chunk->count = chunk->capacity = (int)codeCount;
+
+	chunk->lines = ALLOCATE(vm, MEM_LINES, LineStart, lineCount);
+	ImageReader lineReader = {lines, lines + lineCount * 8, false};
+	for (uint32_t i = 0; i < lineCount; i++) {
+		chunk->lines[i].offset = (int)readU32(&lineReader);
+		chunk->lines[i].line = (int)readU32(&lineReader);
+	}
+	chunk->lineCount = chunk->lineCapacity = (int)lineCount;
+
+	/* Recomputed rather than stored, which also catches code that would
+	 * run off the stack or the chunk, or index past its constants or the
+	 * image's globals. */
+	chunk->maxStack = maxStackDepth(chunk, (int)globalCount);
+	if (chunk->maxStack < 0) {
+		fprintf(stderr, "\"%s\" is corrupt (malformed bytecode).\n", path);
+		return false;
+	}
+	return true;
+}
+
+/* Loading runs in the compiler arena, both because what it allocates lives as
+ * long as a compiled chunk would and so no collection can run while the
+ * interned strings are only in a local array. */
+bool loadImage(VM* vm, const char* path, Chunk* chunk) {
+	SourceFile file;
+	if (!openSource(path, &file)) return false;
+	if (file.length == 0) {
+		fprintf(stderr, "\"%s\" is not a clox image.\n", path);
+		closeSource(&file);
+		return false;
+	}
+
+	vm->chunk = chunk;
+	beginCompilerArena(vm);
+	bool ok = parseImage(vm, (const uint8_t*)file.chars, file.length, chunk, path);
+	endCompilerArena(vm);
+
+	if (ok && borrowStrings) {
+		keepSource(vm, &file);	/* the string table is borrowed straight out of it */
+	} else {
+		closeSource(&file);
+	}
+	return ok;
+}
@@ -0,0 +1,685 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/jit.h"
+#include "lib/profile.h"
+#include "lib/sampler.h"
+#include "lib/vm.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define JIT_X86_64	/* the only backend so far */
+#endif
+
+bool jitEnabled = false;
+
+#define JIT_HOT_LOOP 1000
+
+/* One loop run() has jumped back through, keyed by its first instruction. */
+typedef struct {
+	const uint8_t* start;	/* NULL for an empty entry */
+	int backEdges;	/* counts up to JIT_HOT_LOOP, then the loop gets compiled */
+	JitCode code;	/* NULL until then, and for loops that couldn't be */
+	void* memory;	/* the mapping code lives in */
+	size_t size;
+} JitLoop;
+
+/* One per VM that has run with --jit, made by the first jitLoop(). Like the
+ * profiler's tables it comes straight from malloc, so nothing here can
+ * trigger a collection in the middle of an instruction. */
+typedef struct Jit {
+	JitLoop* loops;	/* open addressed on start */
+	int count;
+	int capacity;
+	bool unavailable;	/* executable memory couldn't be had, so stop trying */
+} Jit;
+
+#ifdef JIT_X86_64
+
+/* Registers the templates use. Native code keeps the top of the VM's stack
+ * in RBX, the locals (which start at vm->stack) in R12, the globals in R13
+ * and the VM in R14. With NAN_BOXING R15 holds QNAN for the tag checks. */
+enum {
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RDI = 7,
+	R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+enum { XMM0 = 0, XMM1 = 1, XMM2 = 2 };
+
+#define VALUE_SIZE ((int)sizeof(Value))
+#ifdef NAN_BOXING
+#define PAYLOAD 0	/* where the double sits inside a Value */
+#else
+#define PAYLOAD ((int)offsetof(Value, as))
+#endif
+
+/* A jump or guard whose target isn't known until the whole loop is out. */
+typedef struct {
+	int position;	/* of the rel32 to patch */
+	const uint8_t* target;	/* bytecode it should end up at */
+	bool exit;	/* always leave native code, even for a target inside the loop */
+} Fixup;
+
+typedef struct {
+	const uint8_t* target;
+	int position;	/* of the stub returning target to run() */
+} ExitStub;
+
+typedef struct {
+	uint8_t* code;
+	int count;
+	int capacity;
+	bool failed;	/* out of memory */
+	const uint8_t* start;	/* the loop being compiled is [start, end) */
+	const uint8_t* end;
+	const uint8_t* instruction;	/* the one whose template is being emitted */
+	int* offsets;	/* native offset of each bytecode offset in the loop, -1 inside operands */
+	Fixup* fixups;
+	int fixupCount;
+	int fixupCapacity;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+	if (as->count == as->capacity) {
+		int capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+		uint8_t* code = (uint8_t*)realloc(as->code, capacity);
+		if (code == NULL) {
+			as->failed = true;
+			return;
+		}
+		as->code = code;
+		as->capacity = capacity;
+	}
+	as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, const char* bytes, int length) {
+	for (int i = 0; i < length; i++) emitByte(as, (uint8_t)bytes[i]);
+}
+
+static void emitU32(Assembler* as, uint32_t value) {
+	for (int i = 0; i < 4; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emitU64(Assembler* as, uint64_t value) {
+	emitU32(as, (uint32_t)value);
+	emitU32(as, (uint32_t)(value >> 32));
+}
+
+/* [prefix] [REX] opcode ModRM [SIB] disp32: an instruction with reg in the
+ * ModRM reg field (or an opcode extension) and [base + disp] as its memory
+ * operand. Always using a 32-bit displacement keeps this one encoding. */
+static void emitMemory(Assembler* as, uint8_t prefix, bool wide, const char* opcode, int opcodeLength,
+					   int reg, int base, int32_t disp) {
+	if (prefix != 0) emitByte(as, prefix);
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+	if (rex != 0x40) emitByte(as, rex);
+	emitBytes(as, opcode, opcodeLength);
+	emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == 4) emitByte(as, 0x24);	/* R12 as a base needs a SIB byte */
+	emitU32(as, (uint32_t)disp);
+}
+
+static void loadQuad(Assembler* as, int reg, int base, int32_t disp) {
+	emitMemory(as, 0, true, "\x8b", 1, reg, base, disp);	/* mov reg, [base + disp] */
+}
+
+static void storeQuad(Assembler* as, int base, int32_t disp, int reg) {
+	emitMemory(as, 0, true, "\x89", 1, reg, base, disp);	/* mov [base + disp], reg */
+}
+
+static void loadDouble(Assembler* as, int xmm, int base, int32_t disp) {
+	emitMemory(as, 0xf2, false, "\x0f\x10", 2, xmm, base, disp);	/* movsd xmm, [base + disp] */
+}
+
+static void storeDouble(Assembler* as, int base, int32_t disp, int xmm) {
+	emitMemory(as, 0xf2, false, "\x0f\x11", 2, xmm, base, disp);	/* movsd [base + disp], xmm */
+}
+
+/* lea rbx, [rbx + delta]: moves the stack top without touching the flags,
+ * so it can sit between a compare and its jump. */
+static void moveStack(Assembler* as, int delta) {
+	emitMemory(as, 0, true, "\x8d", 1, RBX, RBX, delta * VALUE_SIZE);
+}
+
+static void copyValue(Assembler* as, int toBase, int32_t toDisp, int fromBase, int32_t fromDisp) {
+#ifdef NAN_BOXING
+	loadQuad(as, RAX, fromBase, fromDisp);
+	storeQuad(as, toBase, toDisp, RAX);
+#else
+	emitMemory(as, 0xf3, false, "\x0f\x6f", 2, XMM2, fromBase, fromDisp);	/* movdqu xmm2, [from] */
+	emitMemory(as, 0xf3, false, "\x0f\x7f", 2, XMM2, toBase, toDisp);	/* movdqu [to], xmm2 */
+#endif
+}
+
+static void storeConstant(Assembler* as, int base, int32_t disp, Value value) {
+#ifdef NAN_BOXING
+	emitBytes(as, "\x48\xb8", 2);	/* mov rax, imm64 */
+	emitU64(as, value);
+	storeQuad(as, base, disp, RAX);
+#else
+	uint64_t payload;
+	memcpy(&payload, &value.as, sizeof(payload));
+	emitMemory(as, 0, false, "\xc7", 1, 0, base, disp);	/* mov dword [base + disp], type */
+	emitU32(as, (uint32_t)value.type);
+	emitBytes(as, "\x48\xb8", 2);
+	emitU64(as, payload);
+	storeQuad(as, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+/* Stores the double in XMM0 as a Value. */
+static void storeNumber(Assembler* as, int base, int32_t disp) {
+#ifndef NAN_BOXING
+	emitMemory(as, 0, false, "\xc7", 1, 0, base, disp);
+	emitU32(as, VAL_NUMBER);
+#endif
+	storeDouble(as, base, disp + PAYLOAD, XMM0);
+}
+
+/* Stores the bool in AL as a Value. */
+static void storeBool(Assembler* as, int base, int32_t disp) {
+	emitBytes(as, "\x0f\xb6\xc0", 3);	/* movzx eax, al */
+#ifdef NAN_BOXING
+	emitBytes(as, "\x49\x8d\x44\x07\x02", 5);	/* lea rax, [r15 + rax + TAG_FALSE] */
+	storeQuad(as, base, disp, RAX);
+#else
+	emitMemory(as, 0, false, "\xc7", 1, 0, base, disp);
+	emitU32(as, VAL_BOOL);
+	storeQuad(as, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+static void addFixup(Assembler* as, const uint8_t* target, bool exit) {
+	if (as->fixupCount == as->fixupCapacity) {
+		int capacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+		Fixup* fixups = (Fixup*)realloc(as->fixups, sizeof(Fixup) * capacity);
+		if (fixups == NULL) {
+			as->failed = true;
+			return;
+		}
+		as->fixups = fixups;
+		as->fixupCapacity = capacity;
+	}
+	Fixup* fixup = &as->fixups[as->fixupCount++];
+	fixup->position = as->count;
+	fixup->target = target;
+	fixup->exit = exit;
+	emitU32(as, 0);
+}
+
+/* jcc (or jmp, for condition 0) to the instruction at target. */
+static void emitJump(Assembler* as, uint8_t condition, const uint8_t* target) {
+	if (condition == 0) {
+		emitByte(as, 0xe9);
+	} else {
+		emitByte(as, 0x0f);
+		emitByte(as, condition);
+	}
+	addFixup(as, target, false);
+}
+
+/* Hands the current instruction back to run() when condition holds. */
+static void emitGuard(Assembler* as, uint8_t condition) {
+	if (condition == 0) {
+		emitByte(as, 0xe9);
+	} else {
+		emitByte(as, 0x0f);
+		emitByte(as, condition);
+	}
+	addFixup(as, as->instruction, true);
+}
+
+#define JE	0x84
+#define JNE	0x85
+#define JBE	0x86
+#define JP	0x8a
+
+/* Exits unless the Value at [base + disp] is a number. */
+static void guardNumber(Assembler* as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	loadQuad(as, RAX, base, disp);
+	emitBytes(as, "\x48\x89\xc1", 3);	/* mov rcx, rax */
+	emitBytes(as, "\x4c\x21\xf9", 3);	/* and rcx, r15 */
+	emitBytes(as, "\x4c\x39\xf9", 3);	/* cmp rcx, r15 */
+	emitGuard(as, JE);
+#else
+	emitMemory(as, 0, false, "\x83", 1, 7, base, disp);	/* cmp dword [base + disp], VAL_NUMBER */
+	emitByte(as, VAL_NUMBER);
+	emitGuard(as, JNE);
+#endif
+}
+
+/* Exits if the global at [base + disp] hasn't been defined yet. */
+static void guardDefined(Assembler* as, int32_t disp) {
+#ifdef NAN_BOXING
+	loadQuad(as, RAX, R13, disp);
+	emitBytes(as, "\x4c\x39\xf8", 3);	/* cmp rax, r15: UNDEFINED_VAL is QNAN itself */
+#else
+	emitMemory(as, 0, false, "\x83", 1, 7, R13, disp);
+	emitByte(as, VAL_UNDEFINED);
+#endif
+	emitGuard(as, JE);
+}
+
+/* Sets AL to whether the value at [base + disp] is falsey. */
+static void testFalsey(Assembler* as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	loadQuad(as, RAX, base, disp);
+	emitBytes(as, "\x49\x8d\x4f\x01", 4);	/* lea rcx, [r15 + TAG_NIL] */
+	emitBytes(as, "\x48\x39\xc8", 3);	/* cmp rax, rcx */
+	emitBytes(as, "\x0f\x94\xc2", 3);	/* sete dl */
+	emitBytes(as, "\x49\x8d\x4f\x02", 4);	/* lea rcx, [r15 + TAG_FALSE] */
+	emitBytes(as, "\x48\x39\xc8", 3);
+	emitBytes(as, "\x0f\x94\xc0", 3);	/* sete al */
+	emitBytes(as, "\x08\xd0", 2);	/* or al, dl */
+#else
+	emitMemory(as, 0, false, "\x8b", 1, RAX, base, disp);	/* mov eax, type */
+	emitBytes(as, "\x83\xf8", 2);	/* cmp eax, VAL_NIL */
+	emitByte(as, VAL_NIL);
+	emitBytes(as, "\x0f\x94\xc2", 3);	/* sete dl */
+	emitBytes(as, "\x83\xf8", 2);	/* cmp eax, VAL_BOOL */
+	emitByte(as, VAL_BOOL);
+	emitBytes(as, "\x0f\x94\xc1", 3);	/* sete cl */
+	emitMemory(as, 0, false, "\x80", 1, 7, base, disp + PAYLOAD);	/* cmp byte [payload], 0 */
+	emitByte(as, 0);
+	emitBytes(as, "\x0f\x94\xc0", 3);	/* sete al */
+	emitBytes(as, "\x20\xc8", 2);	/* and al, cl */
+	emitBytes(as, "\x08\xd0", 2);	/* or al, dl */
+#endif
+}
+
+/* Loads the two numbers on top of the stack into XMM0 and XMM1, exiting
+ * unless both are numbers. */
+static void loadOperands(Assembler* as) {
+	guardNumber(as, RBX, -2 * VALUE_SIZE);
+	guardNumber(as, RBX, -1 * VALUE_SIZE);
+	loadDouble(as, XMM0, RBX, -2 * VALUE_SIZE + PAYLOAD);
+	loadDouble(as, XMM1, RBX, -1 * VALUE_SIZE + PAYLOAD);
+}
+
+/* addsd, subsd, mulsd or divsd xmm0, xmm1, then the result replaces both. */
+static void arithmetic(Assembler* as, uint8_t operation) {
+	loadOperands(as);
+	emitBytes(as, "\xf2\x0f", 2);
+	emitByte(as, operation);
+	emitByte(as, 0xc1);
+	storeDouble(as, RBX, -2 * VALUE_SIZE + PAYLOAD, XMM0);	/* a's tag already says number */
+	moveStack(as, -1);
+}
+
+/* ucomisd in the order that makes "above" mean the comparison holds. */
+static void compare(Assembler* as, OpCode op) {
+	if (op == OP_LESS || op == OP_JUMP_IF_NOT_LESS) {
+		emitBytes(as, "\x66\x0f\x2e\xc8", 4);	/* ucomisd xmm1, xmm0 */
+	} else {
+		emitBytes(as, "\x66\x0f\x2e\xc1", 4);	/* ucomisd xmm0, xmm1 */
+	}
+}
+
+static int readShort(const uint8_t* operands) {
+	return (operands[0] << 8) | operands[1];
+}
+
+static int readLong(const uint8_t* operands) {
+	return (operands[0] << 16) | (operands[1] << 8) | operands[2];
+}
+
+/* Emits the template for the instruction at as->instruction. Anything it
+ * doesn't have a template for becomes an unconditional exit. */
+static void emitInstruction(Assembler* as, Chunk* chunk) {
+	const uint8_t* instruction = as->instruction;
+	const uint8_t* next = instruction + instructionLength(*instruction);
+	Value* constants = chunk->constants.values;
+	switch (genericOpcode(*instruction)) {
+		case OP_CONSTANT:
+			storeConstant(as, RBX, 0, constants[instruction[1]]);
+			moveStack(as, 1);
+			break;
+		case OP_CONSTANT_LONG:
+			storeConstant(as, RBX, 0, constants[readLong(instruction + 1)]);
+			moveStack(as, 1);
+			break;
+		case OP_NIL:	storeConstant(as, RBX, 0, NIL_VAL); moveStack(as, 1); break;
+		case OP_TRUE:	storeConstant(as, RBX, 0, BOOL_VAL(true)); moveStack(as, 1); break;
+		case OP_FALSE:	storeConstant(as, RBX, 0, BOOL_VAL(false)); moveStack(as, 1); break;
+		case OP_POP:	moveStack(as, -1); break;
+		case OP_GET_LOCAL:
+			copyValue(as, RBX, 0, R12, instruction[1] * VALUE_SIZE);
+			moveStack(as, 1);
+			break;
+		case OP_SET_LOCAL:
+			copyValue(as, R12, instruction[1] * VALUE_SIZE, RBX, -VALUE_SIZE);
+			break;
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG: {
+			int slot = *instruction == OP_GET_GLOBAL ? instruction[1] : readLong(instruction + 1);
+			guardDefined(as, slot * VALUE_SIZE);
+			copyValue(as, RBX, 0, R13, slot * VALUE_SIZE);
+			moveStack(as, 1);
+			break;
+		}
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG: {
+			int slot = *instruction == OP_DEFINE_GLOBAL ? instruction[1] : readLong(instruction + 1);
+			copyValue(as, R13, slot * VALUE_SIZE, RBX, -VALUE_SIZE);
+			moveStack(as, -1);
+			break;
+		}
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG: {
+			int slot = *instruction == OP_SET_GLOBAL ? instruction[1] : readLong(instruction + 1);
+			guardDefined(as, slot * VALUE_SIZE);
+			copyValue(as, R13, slot * VALUE_SIZE, RBX, -VALUE_SIZE);
+			break;
+		}
+		case OP_EQUAL:	/* numbers only: anything else might involve a rope */
+			loadOperands(as);
+			emitBytes(as, "\x66\x0f\x2e\xc1", 4);	/* ucomisd xmm0, xmm1 */
+			emitBytes(as, "\x0f\x94\xc0", 3);	/* sete al */
+			emitBytes(as, "\x0f\x9b\xc1", 3);	/* setnp cl: NaN is unordered and never equal */
+			emitBytes(as, "\x20\xc8", 2);	/* and al, cl */
+			storeBool(as, RBX, -2 * VALUE_SIZE);
+			moveStack(as, -1);
+			break;
+		case OP_GREATER:
+		case OP_LESS:
+			loadOperands(as);
+			compare(as, genericOpcode(*instruction));
+			emitBytes(as, "\x0f\x97\xc0", 3);	/* seta al */
+			storeBool(as, RBX, -2 * VALUE_SIZE);
+			moveStack(as, -1);
+			break;
+		case OP_ADD:		arithmetic(as, 0x58); break;	/* strings go back to run() */
+		case OP_SUBTRACT:	arithmetic(as, 0x5c); break;
+		case OP_MULTIPLY:	arithmetic(as, 0x59); break;
+		case OP_DIVIDE:		arithmetic(as, 0x5e); break;
+		case OP_NOT:
+			testFalsey(as, RBX, -VALUE_SIZE);
+			storeBool(as, RBX, -VALUE_SIZE);
+			break;
+		case OP_NEGATE:
+			guardNumber(as, RBX, -VALUE_SIZE);
+			emitMemory(as, 0, true, "\x0f\xba", 2, 7, RBX, -VALUE_SIZE + PAYLOAD);	/* btc qword [top], 63 */
+			emitByte(as, 63);
+			break;
+		case OP_JUMP:
+			emitJump(as, 0, next + readShort(instruction + 1));
+			break;
+		case OP_JUMP_IF_FALSE:
+			testFalsey(as, RBX, -VALUE_SIZE);
+			emitBytes(as, "\x84\xc0", 2);	/* test al, al */
+			emitJump(as, JNE, next + readShort(instruction + 1));
+			break;
+		case OP_POP_JUMP_IF_FALSE:
+			testFalsey(as, RBX, -VALUE_SIZE);
+			emitBytes(as, "\x84\xc0", 2);
+			moveStack(as, -1);
+			emitJump(as, JNE, next + readShort(instruction + 1));
+			break;
+		case OP_LOOP:
+			emitJump(as, 0, next - readShort(instruction + 1));
+			break;
+		case OP_JUMP_IF_NOT_EQUAL:
+			loadOperands(as);
+			emitBytes(as, "\x66\x0f\x2e\xc1", 4);
+			moveStack(as, -2);
+			emitJump(as, JNE, next + readShort(instruction + 1));
+			emitJump(as, JP, next + readShort(instruction + 1));
+			break;
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS:
+			loadOperands(as);
+			compare(as, genericOpcode(*instruction));
+			moveStack(as, -2);
+			emitJump(as, JBE, next + readShort(instruction + 1));	/* not above, or unordered */
+			break;
+		case OP_ADD_LOCALS:
+			guardNumber(as, R12, instruction[1] * VALUE_SIZE);
+			guardNumber(as, R12, instruction[2] * VALUE_SIZE);
+			loadDouble(as, XMM0, R12, instruction[1] * VALUE_SIZE + PAYLOAD);
+			loadDouble(as, XMM1, R12, instruction[2] * VALUE_SIZE + PAYLOAD);
+			emitBytes(as, "\xf2\x0f\x58\xc1", 4);	/* addsd xmm0, xmm1 */
+			storeNumber(as, RBX, 0);
+			moveStack(as, 1);
+			break;
+		case OP_ADD_LOCAL_CONSTANT: {
+			Value constant = constants[instruction[2]];
+			if (!IS_NUMBER(constant)) {
+				emitGuard(as, 0);
+				break;
+			}
+			int32_t local = instruction[1] * VALUE_SIZE;
+			guardNumber(as, R12, local);
+			loadDouble(as, XMM0, R12, local + PAYLOAD);
+			double number = AS_NUMBER(constant);
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			emitBytes(as, "\x48\xb8", 2);	/* mov rax, imm64 */
+			emitU64(as, bits);
+			emitBytes(as, "\x66\x48\x0f\x6e\xc8", 5);	/* movq xmm1, rax */
+			emitBytes(as, "\xf2\x0f\x58\xc1", 4);
+			storeDouble(as, R12, local + PAYLOAD, XMM0);
+			break;
+		}
+		default:	/* OP_PRINT, OP_RETURN */
+			emitGuard(as, 0);
+			break;
+	}
+}
+
+/* Frees everything but the code itself. */
+static void freeAssembler(Assembler* as) {
+	free(as->offsets);
+	free(as->fixups);
+	free(as->code);
+}
+
+/* Compiles [start, end) into freshly mapped memory. Returns false if it
+ * couldn't, after which loop->code stays NULL. */
+/* Where the code for the loop ending at end has to begin. That's usually
+ * the loop's own start, but a for loop's body jumps back to the increment,
+ * which in turn loops back to the condition before it, so the code grows
+ * back to cover any loop inside it that starts earlier. */
+static const uint8_t* regionStart(const uint8_t* start, const uint8_t* end) {
+	for (;;) {
+		const uint8_t* from = start;
+		for (const uint8_t* instruction = start; instruction < end;
+			 instruction += instructionLength(*instruction)) {
+			if (*instruction != OP_LOOP) continue;
+			const uint8_t* target = instruction + 3 - readShort(instruction + 1);
+			if (target < from) from = target;
+		}
+		if (from == start) return start;
+		start = from;
+	}
+}
+
+static bool compileLoop(Jit* jit, VM* vm, JitLoop* loop, const uint8_t* end) {
+	Assembler as;
+	memset(&as, 0, sizeof(as));
+	as.start = regionStart(loop->start, end);
+	as.end = end;
+	int length = (int)(end - as.start);
+	as.offsets = (int*)malloc(sizeof(int) * length);
+	if (as.offsets == NULL) return false;
+	for (int i = 0; i < length; i++) as.offsets[i] = -1;
+
+	emitBytes(&as, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);	/* push rbx, r12, r13, r14, r15 */
+	emitBytes(&as, "\x49\x89\xfe", 3);	/* mov r14, rdi */
+	loadQuad(&as, RBX, RDI, (int32_t)offsetof(VM, stackTop));
+	loadQuad(&as, R12, RDI, (int32_t)offsetof(VM, stack));
+	loadQuad(&as, R13, RDI, (int32_t)offsetof(VM, globalValues.values));
+#ifdef NAN_BOXING
+	emitBytes(&as, "\x49\xbf", 2);	/* mov r15, QNAN */
+	emitU64(&as, QNAN);
+#endif
+	if (as.start != loop->start) emitJump(&as, 0, loop->start);	/* run() enters where OP_LOOP went */
+
+	for (const uint8_t* instruction = as.start; instruction < end;
+		 instruction += instructionLength(*instruction)) {
+		as.offsets[instruction - as.start] = as.count;
+		as.instruction = instruction;
+		emitInstruction(&as, vm->chunk);
+	}
+
+	/* Every exit leaves through here with the instruction to resume at in RAX. */
+	int epilogue = as.count;
+	storeQuad(&as, R14, (int32_t)offsetof(VM, stackTop), RBX);
+	emitBytes(&as, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3", 10);	/* pop r15, r14, r13, r12, rbx; ret */
+
+	ExitStub* stubs = (ExitStub*)malloc(sizeof(ExitStub) * (as.fixupCount + 1));
+	if (stubs == NULL) as.failed = true;
+	int stubCount = 0;
+	for (int i = 0; i < as.fixupCount && !as.failed; i++) {
+		Fixup* fixup = &as.fixups[i];
+		int target = -1;
+		ptrdiff_t inside = fixup->target - as.start;
+		if (!fixup->exit && inside >= 0 && inside < length) target = as.offsets[inside];
+		if (target == -1) {	/* leaves the loop: find or make the stub for it */
+			for (int j = 0; j < stubCount; j++) {
+				if (stubs[j].target == fixup->target) target = stubs[j].position;
+			}
+			if (target == -1) {
+				target = as.count;
+				stubs[stubCount].target = fixup->target;
+				stubs[stubCount++].position = target;
+				emitBytes(&as, "\x48\xb8", 2);	/* mov rax, imm64 */
+				emitU64(&as, (uint64_t)(uintptr_t)fixup->target);
+				emitByte(&as, 0xe9);	/* jmp epilogue */
+				emitU32(&as, (uint32_t)(epilogue - (as.count + 4)));
+			}
+		}
+		if (as.failed) break;
+		uint32_t rel = (uint32_t)(target - (fixup->position + 4));
+		memcpy(as.code + fixup->position, &rel, sizeof(rel));
+	}
+	free(stubs);
+	if (as.failed) {
+		freeAssembler(&as);
+		return false;
+	}
+
+	/* Written while writable, then flipped to executable, so the mapping is
+	 * never both at once. */
+	size_t size = (size_t)as.count;
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		jit->unavailable = true;
+		freeAssembler(&as);
+		return false;
+	}
+	memcpy(memory, as.code, size);
+	freeAssembler(&as);
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, size);
+		jit->unavailable = true;
+		return false;
+	}
+	loop->memory = memory;
+	loop->size = size;
+	loop->code = (JitCode)memory;
+	return true;
+}
+
+static void freeLoopCode(JitLoop* loop) {
+	if (loop->memory != NULL) munmap(loop->memory, loop->size);
+}
+
+#else
+
+static bool compileLoop(Jit* jit, VM* vm, JitLoop* loop, const uint8_t* end) {
+	(void)vm;
+	(void)loop;
+	(void)end;
+	jit->unavailable = true;	/* no backend for this platform */
+	return false;
+}
+
+static void freeLoopCode(JitLoop* loop) {
+	(void)loop;
+}
+
+#endif
+
+static JitLoop* findLoop(JitLoop* loops, int capacity, const uint8_t* start) {
+	uint32_t index = (uint32_t)(((uintptr_t)start * 2654435761u) >> 4) & (capacity - 1);
+	for (;;) {
+		JitLoop* loop = &loops[index];
+		if (loop->start == start || loop->start == NULL) return loop;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+/* Rehashes into capacity entries, dropping the loops that start in
+ * [dropFrom, dropTo) along with their code. */
+static bool resizeLoops(Jit* jit, int capacity, const uint8_t* dropFrom, const uint8_t* dropTo) {
+	JitLoop* loops = (JitLoop*)calloc(capacity, sizeof(JitLoop));
+	if (loops == NULL) return false;
+	jit->count = 0;
+	for (int i = 0; i < jit->capacity; i++) {
+		JitLoop* loop = &jit->loops[i];
+		if (loop->start == NULL) continue;
+		if (loop->start >= dropFrom && loop->start < dropTo) {
+			freeLoopCode(loop);
+			continue;
+		}
+		*findLoop(loops, capacity, loop->start) = *loop;
+		jit->count++;
+	}
+	free(jit->loops);
+	jit->loops = loops;
+	jit->capacity = capacity;
+	return true;
+}
+
+JitCode jitLoop(VM* vm, const uint8_t* start, const uint8_t* end) {
+	if (profiler.enabled || sampler.enabled) return NULL;	/* they have to see every instruction */
+	Jit* jit = vm->jit;
+	if (jit == NULL) {
+		jit = vm->jit = (Jit*)calloc(1, sizeof(Jit));
+		if (jit == NULL) return NULL;
+	}
+
+	JitLoop* loop = jit->capacity > 0 ? findLoop(jit->loops, jit->capacity, start) : NULL;
+	if (loop == NULL || loop->start == NULL) {	/* the first time round this loop */
+		if (jit->unavailable) return NULL;
+		if (jit->count + 1 > jit->capacity * 3 / 4 &&
+			!resizeLoops(jit, jit->capacity < 16 ? 16 : jit->capacity * 2, NULL, NULL)) {
+			return NULL;
+		}
+		loop = findLoop(jit->loops, jit->capacity, start);
+		loop->start = start;
+		jit->count++;
+	}
+	if (loop->code != NULL || loop->backEdges > JIT_HOT_LOOP) return loop->code;
+	if (++loop->backEdges > JIT_HOT_LOOP && !jit->unavailable) compileLoop(jit, vm, loop, end);
+	return loop->code;
+}
+
+static void freeLoops(Jit* jit) {
+	for (int i = 0; i < jit->capacity; i++) {
+		if (jit->loops[i].start != NULL) freeLoopCode(&jit->loops[i]);
+	}
+	free(jit->loops);
+	jit->loops = NULL;
+	jit->count = 0;
+	jit->capacity = 0;
+}
+
+void jitFreeChunk(VM* vm, Chunk* chunk) {
+	Jit* jit = vm->jit;
+	if (jit == NULL || jit->count == 0) return;
+	if (!resizeLoops(jit, jit->capacity, chunk->code, chunk->code + chunk->count)) {
+		freeLoops(jit);	/* no stale code may outlive the chunk, so drop it all */
+	}
+}
+
+void freeJit(VM* vm) {
+	Jit* jit = vm->jit;
+	if (jit == NULL) return;
+	freeLoops(jit);
+	free(jit);
+	vm->jit = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef clox_array_h
+#define clox_array_h
+
+#include "common.h"
+
+/* The loops behind the number array built-ins. Each one works on count
+ * doubles at a time, two per SIMD block where simd.h has one, and out
+ * never overlaps the inputs. */
+void addArrays(const double* a, const double* b, double* out, int count);
+void addScalar(const double* a, double b, double* out, int count);
+void multiplyArrays(const double* a, const double* b, double* out, int count);
+void multiplyScalar(const double* a, double b, double* out, int count);
+
+/* These keep several partial sums going at once, so the additions happen in
+ * a different order than a Lox loop would do them and the last bit can
+ * come out differently. */
+double sumArray(const double* values, int count);
+double dotArrays(const double* a, const double* b, int count);
+
+/* The same as starting from values[0] and keeping each value that compares
+ * less (greater), so a NaN anywhere but first is passed over. count must
+ * not be zero. */
+double minArray(const double* values, int count);
+double maxArray(const double* values, int count);
+
+#endif
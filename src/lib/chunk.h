@@ -14,6 +14,7 @@
  * with --add, subtract, look up variable, etc. Those are defined here: */
 typedef enum {
 	OP_CONSTANT, /* produces a a particular constant */
+	OP_CONSTANT_LONG,	/* same, with a 24-bit constant index for chunks past 256 constants */
 	OP_NIL,
 	OP_TRUE,
 	OP_FALSE,
@@ -21,8 +22,11 @@ typedef enum {
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
 	OP_GET_GLOBAL,
+	OP_GET_GLOBAL_LONG,
 	OP_DEFINE_GLOBAL,	/* op code for defining a global var */
+	OP_DEFINE_GLOBAL_LONG,
 	OP_SET_GLOBAL,
+	OP_SET_GLOBAL_LONG,	/* the _LONG forms take a 24-bit slot instead of one byte */
 	OP_EQUAL,
 	OP_GREATER,
 	OP_LESS,
@@ -37,6 +41,40 @@ typedef enum {
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
 	OP_RETURN,	/* return from the current function */
+	/* Number arrays. The built-in functions each compile to one of these,
+	 * see builtins[] in compiler.c. */
+	OP_ARRAY,	/* an array of the operand's count of numbers, popped off the stack */
+	OP_NEW_ARRAY,	/* array(n): n zeroes */
+	OP_GET_INDEX,
+	OP_SET_INDEX,
+	OP_LENGTH,	/* len(): of an array or a string */
+	OP_ARRAY_ADD,	/* add(a, b): elementwise, b is an array or a number */
+	OP_ARRAY_MULTIPLY,	/* mul(a, b) */
+	OP_ARRAY_SUM,
+	OP_ARRAY_MIN,
+	OP_ARRAY_MAX,
+	OP_ARRAY_DOT,
+	/* Superinstructions. The compiler never emits these directly; the
+	 * peephole pass in optimizer.c fuses common sequences into them. */
+	OP_POP_JUMP_IF_FALSE,	/* OP_JUMP_IF_FALSE + OP_POP on both paths */
+	OP_JUMP_IF_NOT_EQUAL,	/* OP_EQUAL + OP_POP_JUMP_IF_FALSE */
+	OP_JUMP_IF_NOT_GREATER,	/* OP_GREATER + OP_POP_JUMP_IF_FALSE */
+	OP_JUMP_IF_NOT_LESS,	/* OP_LESS + OP_POP_JUMP_IF_FALSE */
+	OP_ADD_LOCALS,	/* OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD */
+	OP_ADD_LOCAL_CONSTANT,	/* OP_GET_LOCAL x, OP_CONSTANT c, OP_ADD, OP_SET_LOCAL x, OP_POP */
+	/* Quickened forms. Neither the compiler nor the optimizer emits these:
+	 * run() rewrites an instruction into one once it has seen what types
+	 * its operands are, and back to the generic form when that guess turns
+	 * out wrong. genericOpcode() maps them back. */
+	OP_ADD_NUM,
+	OP_ADD_STRING,
+	OP_SUBTRACT_NUM,
+	OP_MULTIPLY_NUM,
+	OP_DIVIDE_NUM,
+	OP_GREATER_NUM,
+	OP_LESS_NUM,
+	OP_JUMP_IF_NOT_GREATER_NUM,
+	OP_JUMP_IF_NOT_LESS_NUM,
 } OpCode;
 
 /*
@@ -49,22 +87,60 @@ typedef enum {
  * 7. Update the count.
  * */
 
+/* One run of the line table: every byte from offset up to the next run's
+ * offset was compiled from the same source line. */
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
+
 /* A struct to hold the series of instructions, Bytecode and some other data */
 typedef struct {
 	int capacity;	/* the number of elements in the array we have allocated */
 	int count;	/* how many of those allocated entries are actually in use */
 	uint8_t *code;
-	int *lines;
+	int lineCount;	/* lines is run-length encoded, so it only grows when the line changes */
+	int lineCapacity;
+	LineStart *lines;
 	ValueArray constants;
+	int* constantIndex;	/* open-addressed hash of constant indices, -1 when empty, so addConstant can find duplicates */
+	int constantIndexCapacity;
+	int maxStack;	/* the most stack slots running the chunk can take up, see maxStackDepth() */
 } Chunk;
 
+/* The largest operand OP_CONSTANT_LONG and the wide global opcodes can hold. */
+#define UINT24_MAX 0xffffff
+
 /* Initializes a new chunk */
 void initChunk(Chunk *chunk);
 /* Frees a chunk */
-void freeChunk(Chunk *chunk);
+void freeChunk(VM* vm, Chunk *chunk);
+/* Empties the code and line table but keeps their storage and the constants,
+ * so --session can compile message after message into one chunk */
+void resetChunkCode(VM* vm, Chunk *chunk);
+/* resetChunkCode(), and the constants are forgotten too, though their
+ * storage is still kept */
+void resetChunkConstants(VM* vm, Chunk *chunk);
 /* Appends a byte to the end of the chunk */
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
-/* add constant to the array */
-int addConstant(Chunk *chunk, Value value);
+void writeChunk(VM* vm, Chunk *chunk, uint8_t byte, int line);
+/* Returns how many bytes the instruction, including its operands, takes up. */
+int instructionLength(uint8_t instruction);
+/* The opcode a quickened instruction was rewritten from, or instruction itself. */
+uint8_t genericOpcode(uint8_t instruction);
+/* Follows every path through the chunk and returns the deepest the value
+ * stack gets on any of them, so run() never has to check for overflow. Every
+ * instruction has to be reached with the same depth along each path, which
+ * the compiler guarantees; -1 means the code doesn't, or pops more than it
+ * pushed, reads a local above the top, jumps outside the chunk or into the
+ * middle of an instruction, or names a constant past the chunk's or a global
+ * slot from globalCount on. Code no path reaches is checked too, as the JIT
+ * decodes it along with the rest of a loop. */
+int maxStackDepth(Chunk *chunk, int globalCount);
+/* Returns the source line the byte at offset was compiled from. */
+int getLine(Chunk *chunk, int offset);
+/* Drops every byte from offset count onwards, along with their line runs. */
+void truncateChunk(Chunk *chunk, int count);
+/* add constant to the array, or return the index of an identical one already there */
+int addConstant(VM* vm, Chunk *chunk, Value value);
 
 #endif
@@ -6,9 +6,30 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+/* Build with -DNAN_BOXING to pack every Value into 64 bits (see value.h). */
+
+/* Build with -DDEBUG_PRINT_CODE to disassemble each chunk after compiling it,
+ * and -DDEBUG_TRACE_EXECUTION to print the stack before every instruction.
+ * Release builds leave both off; use --profile for runtime opcode counts. */
+
+/* Build with -DCOMPUTED_GOTO to dispatch run() through a labels-as-values
+ * jump table. Compilers without that extension get the portable switch. */
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+/* Build with -DSYSTEM_ALLOCATOR to send every reallocate() straight to
+ * realloc()/free() instead of the pools in memory.c, e.g. for valgrind or
+ * -fsanitize=address. */
+
+/* Build with -DDEBUG_STRESS_GC to collect on every allocation, which shakes
+ * out objects the collector can't reach while they're still in use. */
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+/* Defined in vm.h. Declared here because nearly every module takes the VM
+ * it's working for as its first argument, and most headers don't need more
+ * than the name. */
+typedef struct VM VM;
+
 #endif
@@ -4,6 +4,6 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);	/* We pass in the chunk where the compiler will write the code
+bool compile(VM* vm, const char* source, Chunk* chunk);	/* We pass in the chunk where the compiler will write the code
 and then compile() returns wheter or not compilation succeeded. */
 #endif
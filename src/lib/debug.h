@@ -3,7 +3,9 @@
 
 #include "chunk.h"
 
-void disassembleChunk(Chunk *chunk, const char *name);
-int disassembleInstruction(Chunk *chunk, int offset);
+/* vm is the one the chunk was compiled for, which knows its global names. */
+void disassembleChunk(VM* vm, Chunk *chunk, const char *name);
+int disassembleInstruction(VM* vm, Chunk *chunk, int offset);
+const char* opcodeName(uint8_t instruction);
 
 #endif
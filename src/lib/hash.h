@@ -0,0 +1,18 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include <stdint.h>
+
+/* FNV-1a, the hash every ObjString carries. The scanner already computes it
+ * for identifiers and string literals, so it lives here where both it and
+ * object.c can get at it, and the two always agree. */
+static inline uint32_t hashString(const char* key, int length) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "chunk.h"
+
+/* A .loxc image is a compiled top-level chunk: its code, line table,
+ * constants and the names behind its global slots. Images carry this
+ * version in their header and are rejected if it doesn't match, so bump
+ * it whenever the OpCode enum or the layout below changes. */
+#define IMAGE_VERSION 3
+
+/* Writes chunk to path. Returns false and reports why if it couldn't. */
+bool writeImage(VM* vm, Chunk* chunk, const char* path);
+/* Maps the image at path and rebuilds the chunk from it, interning its
+ * strings and reserving its global slots in vm. With borrowStrings the
+ * strings point into the mapping, which then stays open until freeVM().
+ * Returns false and reports why if the file is missing, stale or corrupt. */
+bool loadImage(VM* vm, const char* path, Chunk* chunk);
+
+#endif
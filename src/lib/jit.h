@@ -0,0 +1,28 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+
+/* Off by default; --jit turns it on. run() then counts how often each loop
+ * jumps back and, once one has done so JIT_HOT_LOOP times, compiles the
+ * bytecode between its start and its OP_LOOP into x86-64 code stitched
+ * together from one template per opcode. On other platforms, or where the
+ * OS won't hand out executable memory, every loop just stays interpreted. */
+extern bool jitEnabled;
+
+/* Native code for one loop. It runs with the VM's stack and globals in
+ * place and returns the instruction the interpreter should carry on from:
+ * where the loop exits, or the instruction it couldn't handle, such as a
+ * print or operands of the wrong type. In the latter case run() executes
+ * that instruction itself, so runtime errors still come from run() and
+ * report the right line. */
+typedef uint8_t* (*JitCode)(VM* vm);
+
+/* Called by OP_LOOP, which is about to jump from end back to start.
+ * Returns the loop's code once it has been compiled, NULL until then. */
+JitCode jitLoop(VM* vm, const uint8_t* start, const uint8_t* end);
+/* Drops the code for loops in chunk, which is about to be freed. */
+void jitFreeChunk(VM* vm, Chunk* chunk);
+void freeJit(VM* vm);
+
+#endif
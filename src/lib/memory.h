@@ -5,13 +5,58 @@
 #include "common.h"
 #include "object.h"
 
+/* What an allocation is for, so --mem-stats can say where the heap went.
+ * Every ALLOCATE/GROW_ARRAY/FREE names one, and the same kind has to be
+ * passed when the block is resized or freed. Objects get one kind per
+ * ObjType; objectMemory() maps between the two. */
+typedef enum {
+	MEM_STRING,
+	MEM_ROPE,
+	MEM_NUMBER_ARRAY,
+	MEM_CODE,			/* chunk bytecode */
+	MEM_LINES,			/* chunk line tables */
+	MEM_CONSTANTS,		/* constant arrays */
+	MEM_CONSTANT_INDEX,	/* the table addConstant() dedups through */
+	MEM_GLOBALS,		/* global slot values */
+	MEM_TABLE,			/* entries and control bytes of every other table */
+	MEM_INTERN_TABLE,	/* entries and control bytes of vm->strings */
+	MEM_SCRATCH,		/* short-lived buffers of the compiler, optimizer and image code */
+	MEM_KIND_COUNT
+} MemoryKind;
+
+static inline MemoryKind objectMemory(ObjType type) {
+	switch (type) {
+		case OBJ_STRING: return MEM_STRING;
+		case OBJ_ROPE: return MEM_ROPE;
+		case OBJ_NUMBER_ARRAY: return MEM_NUMBER_ARRAY;
+	}
+	return MEM_SCRATCH;	/* unreachable */
+}
+
+/* Bytes as asked of reallocate(), not counting the allocator's own rounding
+ * and headers. */
+typedef struct {
+	size_t live;
+	size_t peak;
+	uint64_t allocations;
+	uint64_t frees;
+} MemoryUsage;
+
+typedef struct {
+	MemoryUsage kinds[MEM_KIND_COUNT];
+	size_t live;
+	size_t peak;
+} MemoryStats;
+
+const char* memoryKindName(MemoryKind kind);
+
 /* we allocate a new array on the heap, just big enough for the string's 
  * characters and the trailing terminator, using this low-level macro that
  * allocates an array with a given element type and count: */
-#define ALLOCATE(type, count) \
-	(type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, kind, type, count) \
+	(type*)reallocate(vm, NULL, 0, sizeof(type) * (count), kind)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, kind, type, pointer) reallocate(vm, pointer, sizeof(type), 0, kind)
 
 /* This macro calculates a new capacity based on a given current capacity.
  * It also handles when the current capacity is zero, it jumps straight to
@@ -22,19 +67,64 @@
 
 /* This macro pretties up a function call to reallocate() where the real work happens. The macro itself takes care of getting the size of array's element
  * type and casting the resulting void* back to a pointer of the right type. */
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-(type*)reallocate(pointer, sizeof(type) * (oldCount), \
-				  sizeof(type) * (newCount))
+#define GROW_ARRAY(vm, kind, type, pointer, oldCount, newCount) \
+(type*)reallocate(vm, pointer, sizeof(type) * (oldCount), \
+				  sizeof(type) * (newCount), kind)
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, kind, type, pointer, oldCount) \
+reallocate(vm, pointer, sizeof(type) * (oldCount), 0, kind)
 
 /* This reallocate() is the single function we'll use for all dynamic memory management in clox --allocating memory, freeing it, and changing the size of
  * an existing allocation. Routing all of those operations through a single 
  * function will be important later when we add a garbage collector that needs to keep track of how much memory is in use. */ 
 
 /* A function for all dynamic memory management, the two size arguments passed control which operation to perform. */
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+/* Every VM has a heap of its own, so memory from one VM must only ever be
+ * resized or freed through that same VM. */
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize, MemoryKind kind);
+/* Sets up vm's heap. initVM() calls this before anything else allocates. */
+void initHeap(VM* vm);
+void freeObjects(VM* vm);
+
+/* Collection thresholds, see memory.c. The first major collection happens
+ * once the heap reaches GC_INITIAL_HEAP, and later ones once it has grown by
+ * GC_HEAP_GROW_FACTOR since the previous one. */
+#define GC_INITIAL_HEAP		(16 * 1024 * 1024)
+#define GC_HEAP_GROW_FACTOR	2
+#define GC_NURSERY_SIZE		(1024 * 1024)
+
+/* reallocate() starts collections on its own; this is for forcing one. A
+ * major collection covers both generations, a minor one only the nursery. */
+void collectGarbage(VM* vm, bool major);
+/* Collects if the heap has grown enough since the last collection.
+ * reallocate() calls it whenever memory grows, except while compiling, so a
+ * REPL line that only allocates at compile time never triggers one. The
+ * REPL and --session call it between inputs for that reason. */
+void collectIfNeeded(VM* vm);
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+/* Write barrier: the old object has just been made to point at a young one. */
+void rememberObject(VM* vm, Obj* object);
+
+/* While the compiler arena is on, small MEM_SCRATCH allocations, the arrays
+ * the compiler, optimizer and image loader free again before they return,
+ * are bump allocated, and endCompilerArena() takes them all back at once.
+ * Everything else, strings and the chunk's arrays included, comes from the
+ * pools as usual, so the collector and freeChunk() can reclaim it in a VM
+ * that compiles line after line. No collection starts while the arena is
+ * on, so compile() and loadImage() don't have to keep the objects they're
+ * building reachable. */
+void beginCompilerArena(VM* vm);
+void endCompilerArena(VM* vm);
+
+/* Running totals per VM, for --bench to report. A system allocation is every
+ * malloc/realloc, including the ones that fetch new slabs. */
+typedef struct {
+	uint64_t systemAllocations;
+	uint64_t systemFrees;
+	uint64_t poolAllocations;
+	uint64_t arenaAllocations;
+	uint64_t collections;
+} AllocationStats;
 
 #endif
@@ -7,9 +7,15 @@
 #define OBJ_TYPE(value)		(AS_OBJ(value)->type)	/* this is an abstraction for accessing the type field of Obj struct. */
 
 #define IS_STRING(value)	isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)		isObjType(value, OBJ_ROPE)
+#define IS_ANY_STRING(value)	(IS_STRING(value) || IS_ROPE(value))	/* flat or not, it's a Lox string */
+#define IS_NUMBER_ARRAY(value)	isObjType(value, OBJ_NUMBER_ARRAY)
 
 #define AS_STRING(value)	((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)	(((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)		((ObjRope*)AS_OBJ(value))
+#define AS_NUMBER_ARRAY(value)	((ObjNumberArray*)AS_OBJ(value))
+#define AS_FLAT_STRING(vm, value)	flattenString(vm, AS_OBJ(value))	/* works on either kind, see flattenString() */
 /* These two macro take a Value that is expected to contain a pointer to a valid
  * ObjString on the heap. The first one returns a the ObjString* pointer. The
  * second one steps through that to return the character array itself, since that's 
@@ -17,23 +23,90 @@
 
 typedef enum {
 	OBJ_STRING,
+	OBJ_ROPE,
+	OBJ_NUMBER_ARRAY,
 } ObjType;
 
 struct Obj {
 	ObjType type;
+	bool isMarked;	/* reached during the current collection */
+	bool isOld;	/* survived a collection, so it's on vm.objects rather than vm.youngObjects */
+	bool isFrozen;	/* owned by a frozen VM and shared with its workers, see freezeVM() */
 	struct Obj* next;	/* The Obj struct itsefl will be the linked list node. Each Obj gets a pointer to the next Obj in the chain.*/
 };
 
+/* The characters normally live right after the header, in storage, as a
+ * flexible array member. That makes it one malloc per string instead of two,
+ * and chars points a few bytes further into the same cache line. A string
+ * borrowed from a mapped file (see borrowString()) has no storage and its
+ * chars point into the mapping and aren't '\0'-terminated, so always go by
+ * length. */
 struct ObjString {
 	Obj obj;	/* instance of Obj struct, we use OBJ_TYPE to access the type field.*/
 	int length;
-	char* chars;
 	uint32_t hash; /* used for caching */
+	const char* chars;
+	char storage[];	/* length characters plus a '\0', unless borrowed */
 };
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-void printObject(Value value);
+/* Bytes taken by an ObjString of the given length, header included. */
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t)(length) + 1)
+
+/* A string built by concatenation that hasn't been needed as characters yet.
+ * left and right are each an ObjString or another ObjRope, so OP_ADD only has
+ * to allocate this node instead of copying both operands. The first time
+ * something needs the characters (printing, comparing) the whole tree is copied
+ * into one buffer and interned. The result is cached in flat, and the children
+ * are dropped so they can be freed independently. Ropes are never interned
+ * themselves, which is why equality has to look through them. */
+typedef struct {
+	Obj obj;
+	int length;
+	Obj* left;
+	Obj* right;
+	ObjString* flat;	/* NULL until the rope is flattened */
+} ObjRope;
+
+/* A fixed-length array of numbers, made by an array literal or array(n).
+ * The doubles are stored unboxed right after the header, so the bulk
+ * operations in array.c can run over them as one contiguous block. They
+ * point at nothing, so like strings they never need tracing. */
+typedef struct {
+	Obj obj;
+	int count;
+	double values[];
+} ObjNumberArray;
+
+/* Bytes taken by an ObjNumberArray of count elements, header included. */
+#define NUMBER_ARRAY_SIZE(count) (sizeof(ObjNumberArray) + sizeof(double) * (size_t)(count))
+/* The longest array array(n) makes, so its size always fits an int. */
+#define NUMBER_ARRAY_MAX (1 << 27)
+
+/* To build a string in place, allocate it with allocateString(), write
+ * its length characters into chars, and pass it to takeString(). Until then
+ * the string isn't interned and isn't on vm.objects. takeString() returns
+ * the interned string with those characters, which might be a different one
+ * than the string passed in. In that case the passed-in string is freed. */
+ObjString* allocateString(VM* vm, int length);
+ObjString* takeString(VM* vm, ObjString* string);
+ObjString* copyString(VM* vm, const char* chars, int length);
+/* copyString() for callers that already know the string's hash, such as
+ * the image loader, so interning doesn't have to rehash the characters. */
+ObjString* copyStringHashed(VM* vm, const char* chars, int length, uint32_t hash);
+/* Like copyString(), but a new string points at chars instead of copying
+ * them. Only for memory that outlives the VM's use of the string, like a
+ * file pinned with keepSource(). */
+ObjString* borrowString(VM* vm, const char* chars, int length);
+ObjString* borrowStringHashed(VM* vm, const char* chars, int length, uint32_t hash);
+ObjRope* makeRope(VM* vm, Obj* left, Obj* right, int length);
+/* A new array of count elements, left for the caller to fill in. */
+ObjNumberArray* newNumberArray(VM* vm, int count);
+/* The interned ObjString holding an OBJ_STRING or OBJ_ROPE's characters. */
+ObjString* flattenString(VM* vm, Obj* string);
+/* Equality for any two objects, looking through ropes. Flattening them can
+ * allocate, which is why this needs the VM and valuesEqual() doesn't. */
+bool objectsEqual(VM* vm, Obj* a, Obj* b);
+void writeObject(VM* vm, OutputBuffer* output, Value value);
 
 /* I think what this function does is that it checks if the given value
  * is equal to VAL_OBJ and it also checks if the type field   */
@@ -41,4 +114,15 @@ static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/* Bytes a string's allocation takes, which depends on whether it's borrowed. */
+static inline size_t stringSize(ObjString* string) {
+	return string->chars == string->storage ? STRING_SIZE(string->length) : sizeof(ObjString);
+}
+
+/* Length of an OBJ_STRING or OBJ_ROPE without flattening it. */
+static inline int stringLength(Obj* string) {
+	if (string->type == OBJ_ROPE) return ((ObjRope*)string)->length;
+	return ((ObjString*)string)->length;
+}
+
 #endif
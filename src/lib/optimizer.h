@@ -0,0 +1,14 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+/* On by default; --no-optimize turns it off so the raw compiler output can
+ * be inspected or measured against. */
+extern bool optimizerEnabled;
+
+/* Peephole pass over a finished chunk. Fuses common instruction sequences
+ * into superinstructions and re-targets every jump at the new offsets. */
+void optimizeChunk(VM* vm, Chunk* chunk);
+
+#endif
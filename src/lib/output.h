@@ -0,0 +1,43 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+
+/* print doesn't go through stdio one value at a time. Each VM collects what
+ * it prints in its own buffer and hands stdout whole buffers, which costs
+ * one locked fwrite() per buffer instead of a printf() per value and keeps
+ * every line in one piece when workers share stdout. */
+typedef enum {
+	FLUSH_WHEN_FULL,	/* the default when stdout isn't a terminal */
+	FLUSH_EVERY_LINE,	/* after every print, for terminals and --flush-lines */
+	FLUSH_NEVER,	/* the buffer grows instead, so --session can send each message's output as one response */
+} FlushPolicy;
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/* Options, read when a VM first prints. --output-buffer sets the size in
+ * bytes and --flush-lines the policy. */
+extern size_t outputBufferSize;
+extern FlushPolicy outputFlushPolicy;
+
+typedef struct {
+	char* bytes;	/* from the system allocator, allocated on the first write */
+	size_t length;
+	size_t lineEnd;	/* bytes before this end in a newline; only those go out when the buffer fills */
+	size_t capacity;
+	FlushPolicy policy;
+} OutputBuffer;
+
+void initOutput(OutputBuffer* output);
+/* Writes out anything still buffered, then frees the buffer. */
+void freeOutput(OutputBuffer* output);
+void writeOutput(OutputBuffer* output, const char* bytes, size_t length);
+/* Ends a line of output, which under FLUSH_EVERY_LINE sends it on. */
+void writeLine(OutputBuffer* output);
+/* Hands everything buffered to stdout. Runtime errors call this before
+ * reporting so the output comes out in order, and the REPL after each line. */
+void flushOutput(OutputBuffer* output);
+/* Forgets everything buffered, for a caller that has sent it on itself. */
+void clearOutput(OutputBuffer* output);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef clox_parallel_h
+#define clox_parallel_h
+
+#include "chunk.h"
+
+/* --parallel N: runs each of the chunkCount chunks repeat times, spread over
+ * workers threads with a worker VM each. The chunks must have been compiled
+ * by shared, and shared frozen with freezeVM(), so the workers can all read
+ * their constants and strings without copying them.
+ *
+ * Jobs are dealt out round robin up front and idle workers steal from the
+ * others, so a few slow scripts don't leave the rest of the threads waiting.
+ * Prints the throughput and each worker's utilization to stderr, and returns
+ * false if any run hit a runtime error. */
+bool runParallel(VM* shared, Chunk* chunks, int chunkCount, int repeat, int workers);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "chunk.h"
+
+/* Counters collected by --profile. Everything is indexed by raw opcode byte
+ * so the tables never need to know how many opcodes the VM has. */
+typedef struct {
+	bool enabled;	/* checked once per instruction by run() */
+	int previous;	/* the opcode executed just before this one, or -1 */
+	uint64_t opCounts[UINT8_COUNT];
+	uint64_t* pairCounts;	/* UINT8_COUNT * UINT8_COUNT, indexed [previous][current] */
+	uint64_t* lineCounts;	/* hits per source line, grown on demand */
+	int lineCapacity;
+} Profiler;
+
+/* One per process, as --profile only applies to the VM main() runs. Its
+ * tables come straight from malloc so they don't belong to any VM's heap. */
+extern Profiler profiler;
+
+void initProfiler();
+void freeProfiler();
+/* Records the instruction at offset in chunk, which run() is about to execute. */
+void profileInstruction(Chunk* chunk, int offset);
+/* Total number of instructions counted so far. */
+uint64_t profiledInstructions();
+/* Prints the sorted opcode, opcode-pair and line reports to stderr. */
+void printProfile();
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include <signal.h>
+
+#include "chunk.h"
+
+/* --sample-profile HZ. Instead of counting every instruction like
+ * --profile, a CPU-time timer interrupts the process HZ times a second and
+ * run() notes where it was at the next instruction. At exit the samples
+ * are written to a file in the collapsed-stack format flamegraph tools
+ * read: one line per distinct stack, its frames outermost first and
+ * separated by ';', then how many samples landed there. */
+typedef struct {
+	/* Where run() was for one sample. There's only ever the script's own
+	 * frame for now; once there are calls, a sample gets one per frame. */
+	const char* function;
+	int line;
+} SampleFrame;
+
+typedef struct {
+	int firstFrame;	/* index into Sampler.frames */
+	int frameCount;
+} Sample;
+
+typedef struct {
+	bool enabled;
+	volatile sig_atomic_t pending;	/* set by the timer's signal handler, cleared by takeSample() */
+	const char* path;	/* where writeSamples() puts the collapsed stacks */
+	SampleFrame* frames;
+	int frameCount;
+	int frameCapacity;
+	Sample* samples;
+	int sampleCount;
+	int sampleCapacity;
+} Sampler;
+
+/* One per process, like the --profile counters, so it only samples the VM
+ * main() runs. */
+extern Sampler sampler;
+
+/* Starts sampling hz times a second of CPU time. Returns false, having
+ * said why, if the platform has no timer to drive it. */
+bool startSampler(int hz, const char* path);
+/* Records the instruction at ip in chunk, which run() is about to execute. */
+void takeSample(Chunk* chunk, const uint8_t* ip);
+/* Stops the timer and writes the samples taken so far to sampler.path. */
+void writeSamples();
+void freeSampler();
+
+#endif
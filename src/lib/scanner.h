@@ -1,10 +1,13 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stdint.h>
+
 typedef enum {
 	// Single-character tokens.
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
 	TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+	TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
 	TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
 	TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 	// One or two character tokens.
@@ -28,9 +31,18 @@ typedef struct {
 	const char *start;
 	int length;
 	int line;
+	uint32_t hash;	/* hashString() of an identifier's name or a string literal's contents, 0 for the rest */
 } Token;
 
-void initScanner(const char *source);
-Token scanToken();
+/* One per source being scanned, so several can be scanned at once. */
+typedef struct {
+	const char *start;
+	const char *current;
+	const char *end;	/* the terminating '\0', so the block scans know how far they may read */
+	int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char *source);
+Token scanToken(Scanner* scanner);
 
 #endif
@@ -0,0 +1,34 @@
+#ifndef clox_session_h
+#define clox_session_h
+
+#include "vm.h"
+
+/* --session: clox as a long-lived command server. Instead of the REPL's
+ * one line per fgets(), it reads length-prefixed messages, each a whole
+ * program of any length and any number of lines:
+ *
+ *     <length in bytes>\n<source>
+ *
+ * and answers each one, in order, with its status and whatever it printed:
+ *
+ *     ok|compile-error|runtime-error <length in bytes>\n<output>
+ *
+ * Globals persist from one message to the next, like in the REPL. Every
+ * message compiles into the same chunk, whose code and line table keep
+ * their storage and whose constants stay, so a name or string a message
+ * repeats is already there. Error messages still go to stderr, and nothing
+ * but responses goes to stdout.
+ *
+ * All the messages that have arrived go through before any response is
+ * written, and their responses go out together in one write(), so a client
+ * that sends a burst of messages pays for one system call each way instead
+ * of one per message. A malformed length gets "protocol-error 0\n" and the
+ * connection is closed, since the framing after it can't be trusted. */
+
+/* Serves stdin and stdout until stdin closes. */
+bool serveSession(VM* vm);
+/* Listens on a Unix domain socket at path and serves one connection after
+ * another, all with the same VM, until accepting fails. */
+bool serveSessionSocket(VM* vm, const char* path);
+
+#endif
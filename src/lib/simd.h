@@ -0,0 +1,181 @@
+#ifndef clox_simd_h
+#define clox_simd_h
+
+#include "common.h"
+
+/* Sixteen-byte block operations shared by the table probes and the scanner,
+ * and the same sixteen bytes seen as two doubles for the number array
+ * kernels. SIMD_WIDTH is only defined when the target has SSE2 or NEON;
+ * callers keep a scalar loop for everything else and for the bytes at the
+ * end of a buffer that don't fill a whole block. Every *Mask() function
+ * returns one bit per byte, bit i for byte i. */
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#define SIMD_WIDTH 16
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SIMD_NEON
+#define SIMD_WIDTH 16
+#endif
+
+#if defined(SIMD_SSE2)
+
+typedef __m128i Bytes16;
+
+static inline Bytes16 loadBytes(const void* bytes) {
+	return _mm_loadu_si128((const __m128i*)bytes);
+}
+
+static inline uint32_t equalMask(Bytes16 bytes, uint8_t byte) {
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+}
+
+/* lo <= byte <= hi, comparing unsigned. SSE2 has no unsigned compare, but
+ * x <= k is the same as min(x, k) == x. */
+static inline uint32_t rangeMask(Bytes16 bytes, uint8_t lo, uint8_t hi) {
+	__m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8((char)lo));
+	__m128i inRange = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8((char)(hi - lo))), offset);
+	return (uint32_t)_mm_movemask_epi8(inRange);
+}
+
+static inline uint32_t highBitMask(Bytes16 bytes) {
+	return (uint32_t)_mm_movemask_epi8(bytes);
+}
+
+typedef __m128d Doubles2;
+
+static inline Doubles2 loadDoubles(const double* doubles) {
+	return _mm_loadu_pd(doubles);
+}
+
+static inline void storeDoubles(double* doubles, Doubles2 pair) {
+	_mm_storeu_pd(doubles, pair);
+}
+
+static inline Doubles2 splatDouble(double number) {
+	return _mm_set1_pd(number);
+}
+
+static inline Doubles2 addDoubles(Doubles2 a, Doubles2 b) {
+	return _mm_add_pd(a, b);
+}
+
+static inline Doubles2 multiplyDoubles(Doubles2 a, Doubles2 b) {
+	return _mm_mul_pd(a, b);
+}
+
+/* Lane by lane a < b ? a : b, which is exactly what minpd does, NaNs
+ * included. */
+static inline Doubles2 lesserDoubles(Doubles2 a, Doubles2 b) {
+	return _mm_min_pd(a, b);
+}
+
+static inline Doubles2 greaterDoubles(Doubles2 a, Doubles2 b) {
+	return _mm_max_pd(a, b);
+}
+
+#elif defined(SIMD_NEON)
+
+typedef uint8x16_t Bytes16;
+
+/* NEON has no movemask, so weight each matching lane by its bit and add
+ * each half up. */
+static inline uint32_t laneMask(uint8x16_t matches) {
+	static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t weighted = vandq_u8(matches, vld1q_u8(bits));
+	return (uint32_t)vaddv_u8(vget_low_u8(weighted)) |
+		   ((uint32_t)vaddv_u8(vget_high_u8(weighted)) << 8);
+}
+
+static inline Bytes16 loadBytes(const void* bytes) {
+	return vld1q_u8((const uint8_t*)bytes);
+}
+
+static inline uint32_t equalMask(Bytes16 bytes, uint8_t byte) {
+	return laneMask(vceqq_u8(bytes, vdupq_n_u8(byte)));
+}
+
+static inline uint32_t rangeMask(Bytes16 bytes, uint8_t lo, uint8_t hi) {
+	return laneMask(vcleq_u8(vsubq_u8(bytes, vdupq_n_u8(lo)), vdupq_n_u8((uint8_t)(hi - lo))));
+}
+
+static inline uint32_t highBitMask(Bytes16 bytes) {
+	return laneMask(vcltq_s8(vreinterpretq_s8_u8(bytes), vdupq_n_s8(0)));
+}
+
+typedef float64x2_t Doubles2;
+
+static inline Doubles2 loadDoubles(const double* doubles) {
+	return vld1q_f64(doubles);
+}
+
+static inline void storeDoubles(double* doubles, Doubles2 pair) {
+	vst1q_f64(doubles, pair);
+}
+
+static inline Doubles2 splatDouble(double number) {
+	return vdupq_n_f64(number);
+}
+
+static inline Doubles2 addDoubles(Doubles2 a, Doubles2 b) {
+	return vaddq_f64(a, b);
+}
+
+static inline Doubles2 multiplyDoubles(Doubles2 a, Doubles2 b) {
+	return vmulq_f64(a, b);
+}
+
+/* vminq_f64 returns NaN if either lane is one, so select instead to get
+ * the same a < b ? a : b as SSE2. */
+static inline Doubles2 lesserDoubles(Doubles2 a, Doubles2 b) {
+	return vbslq_f64(vcltq_f64(a, b), a, b);
+}
+
+static inline Doubles2 greaterDoubles(Doubles2 a, Doubles2 b) {
+	return vbslq_f64(vcgtq_f64(a, b), a, b);
+}
+
+#endif
+
+#ifdef SIMD_WIDTH
+#define SIMD_DOUBLES (SIMD_WIDTH / (int)sizeof(double))
+
+static inline double firstDouble(Doubles2 pair) {
+	double lanes[SIMD_DOUBLES];
+	storeDoubles(lanes, pair);
+	return lanes[0];
+}
+
+static inline double secondDouble(Doubles2 pair) {
+	double lanes[SIMD_DOUBLES];
+	storeDoubles(lanes, pair);
+	return lanes[1];
+}
+#endif
+
+/* Index of the lowest set bit. mask must not be zero. */
+static inline int lowestBit(uint32_t mask) {
+#if defined(__GNUC__)
+	return __builtin_ctz(mask);
+#else
+	int bit = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+static inline int countBits(uint32_t mask) {
+#if defined(__GNUC__)
+	return __builtin_popcount(mask);
+#else
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1) count++;
+	return count;
+#endif
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+
+/* A script or image read into memory, mapped straight from the file where
+ * the platform allows. chars[length] is always '\0', so the scanner can read
+ * the mapping in place. */
+typedef struct {
+	const char* chars;
+	size_t length;
+	void* memory;	/* what closeSource() gives back: the mapping or a heap buffer */
+	size_t size;
+	bool mapped;
+} SourceFile;
+
+/* Off by default; --borrow-strings turns it on. Then string literals,
+ * identifiers and image strings are borrowed from the file instead of
+ * copied, and the file stays mapped until freeVM(). */
+extern bool borrowStrings;
+
+/* Opens path into file. Returns false and reports why if it couldn't. */
+bool openSource(const char* path, SourceFile* file);
+void closeSource(SourceFile* file);
+/* Hands file over to vm, which closes it in freeVM(). Strings borrowed
+ * from a file need it to stay open at least that long. */
+void keepSource(VM* vm, SourceFile* file);
+void closeKeptSources(VM* vm);
+
+#endif
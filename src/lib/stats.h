@@ -0,0 +1,18 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include "common.h"
+
+/* --mem-stats prints, at exit, where the VM's heap went: live and peak
+ * bytes and allocation counts for each MemoryKind, the allocator's own
+ * counters, and how full vm->strings and vm->globalNames are along with a
+ * histogram of their probe lengths. --mem-stats-json PATH writes the same
+ * numbers as one JSON object for scripts to compare. Both only cover the
+ * VM main() runs; --parallel's workers have heaps of their own. */
+extern bool memoryReport;
+extern const char* memoryReportPath;
+
+/* Prints and writes whichever of the two reports were asked for. */
+void reportMemory(VM* vm);
+
+#endif
@@ -10,20 +10,42 @@ typedef struct {
 	Value value;
 } Entry;
 
+/* Control bytes, one per entry, kept in their own array so a lookup can scan
+ * TABLE_GROUP_SIZE of them at once without touching the entries. A full slot
+ * stores the top seven bits of its key's hash, so the high bit is only ever
+ * set for the two special states below. */
+#define TABLE_GROUP_SIZE	16
+#define CONTROL_EMPTY		((uint8_t)0x80)
+#define CONTROL_DELETED		((uint8_t)0xfe)	/* a tombstone */
+
 typedef struct {
-	int count;
-	int capacity;
-	Entry* entries;
+	int count;	/* live entries plus tombstones */
+	int capacity;	/* always zero or a power of two no smaller than TABLE_GROUP_SIZE */
+	Entry* entries;	/* key is NULL for every slot that isn't full */
+	uint8_t* control;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
+/* A snapshot for --mem-stats. probes[i] counts the keys a lookup finds in
+ * its (i + 1)th group; the last bucket also takes every longer probe. */
+#define TABLE_PROBE_BUCKETS	8
+
+typedef struct {
+	int live;
+	int tombstones;
+	int capacity;
+	int probes[TABLE_PROBE_BUCKETS];
+} TableStats;
+
+void tableStats(Table* table, TableStats* stats);
+
 #endif
 
 /*
@@ -0,0 +1,49 @@
+#ifndef clox_tokens_h
+#define clox_tokens_h
+
+#include "common.h"
+#include "scanner.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define SCAN_THREAD	/* without pthreads, --scan-thread scans on the calling thread */
+#endif
+
+/* The tokens the scanner has got ahead of the parser. The ring is filled
+ * TOKEN_BATCH tokens at a time, so the scanner's loops run over a stretch
+ * of source in one go instead of once per token the parser asks for. */
+#define TOKEN_RING_SIZE	512	/* a power of two */
+#define TOKEN_BATCH		64	/* divides TOKEN_RING_SIZE */
+
+/* --scan-thread: sources of at least SCAN_THREAD_MIN bytes are scanned on a
+ * thread of their own while the parser compiles the tokens already in the
+ * ring. Smaller ones aren't worth starting a thread for. */
+extern bool scanThread;
+#define SCAN_THREAD_MIN (256 * 1024)
+
+typedef struct {
+	Scanner scanner;
+	Token ring[TOKEN_RING_SIZE];
+	unsigned read;	/* count of tokens handed to the parser, which alone touches it */
+	unsigned available;	/* tokens the parser may read without asking for more */
+	unsigned scanned;	/* count of tokens written to the ring, only touched by the scanning side */
+	bool ended;	/* the EOF token has been scanned */
+	bool threaded;
+#ifdef SCAN_THREAD
+	/* lock guards the three fields below it. */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;	/* signalled whenever published or released moves, or stop is set */
+	unsigned published;	/* tokens the thread has finished writing */
+	unsigned released;	/* tokens the parser is done with, whose slots the thread can reuse */
+	bool stop;
+#endif
+} TokenStream;
+
+void initTokenStream(TokenStream* stream, const char* source);
+/* The next token. After the EOF token, it's EOF every time. */
+Token nextToken(TokenStream* stream);
+/* Stops the scanning thread, if there is one. */
+void freeTokenStream(TokenStream* stream);
+
+#endif
@@ -2,16 +2,70 @@
 #define clox_value_h
 
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/* With NAN_BOXING every Value is a single 64-bit word. A double is stored as
+ * itself. Everything else hides inside the unused payload bits of a quiet NaN:
+ * the low two bits tag nil/false/true, and the sign bit marks an Obj* whose
+ * address fills the lower 48 bits. No real double produced by arithmetic ever
+ * has all of the QNAN bits set, so the two spaces never overlap. */
+#define SIGN_BIT	((uint64_t)0x8000000000000000)
+#define QNAN		((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL		1 // 01.
+#define TAG_FALSE	2 // 10.
+#define TAG_TRUE	3 // 11.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)		(((value) | 1) == TRUE_VAL)	/* false and true only differ in the lowest bit */
+#define IS_NIL(value)		((value) == NIL_VAL)
+#define IS_NUMBER(value)	(((value) & QNAN) != QNAN)
+#define IS_OBJ(value)		(((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value)	((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)		((value) == TRUE_VAL)
+#define AS_NUMBER(value)	valueToNum(value)
+#define AS_OBJ(value)		((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)			((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL			((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL			((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL				((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL		((Value)(uint64_t)(QNAN))	/* tag 0: never produced by Lox code */
+#define NUMBER_VAL(num)		numToValue(num)
+#define OBJ_VAL(obj)		(Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+/* memcpy is the portable way to reinterpret the bits; compilers turn it
+ * into a plain register move. */
+static inline double valueToNum(Value value) {
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+static inline Value numToValue(double num) {
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+#else
+
 /* For now, we have only a couple of cases, but this will grow as we add strings, functions, and classes to clox.*/
 typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
-	VAL_OBJ	/* we refer to this new ValueType case for all heap-allocated types. */
+	VAL_OBJ,	/* we refer to this new ValueType case for all heap-allocated types. */
+	VAL_UNDEFINED	/* marks a global slot that has no value yet; never reaches Lox code */
 } ValueType;
 
 /* 
@@ -34,6 +88,7 @@ typedef struct {
 #define IS_NIL(value)		((value).type == VAL_NIL)	/* we use the arrow -> operator when we have a pointer to a struct. */
 #define IS_NUMBER(value)	((value).type == VAL_NUMBER)
 #define IS_OBJ(value)		((value).type == VAL_OBJ)	/* as we did with other value types, we create a macro for working with Obj values. */
+#define IS_UNDEFINED(value)	((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value)		((value).as.obj)	/* this evaluates to true if the given Value is an Obj. */
 #define AS_BOOL(value)		((value).as.boolean)
@@ -48,18 +103,38 @@ typedef struct {
 #define NIL_VAL				((Value){VAL_NIL, {.number = 0}})	/* initializing a nil data type set the number field to 0 by default */
 #define NUMBER_VAL(value)	((Value){VAL_NUMBER, {.number = value}}) /* casts the provided argument for the macro to a Value type and initializes the number field of the Value struct with the input value. */
 #define OBJ_VAL(object)		((Value){VAL_OBJ, {.obj = (Obj*)object}})	/* it extracts the Obj pointer from the value.*/
+#define UNDEFINED_VAL		((Value){VAL_UNDEFINED, {.number = 0}})
 /* This takes as bare Obj pointer and wraps it in a full Value. */
 
+#endif
+
+/* Both a and b are numbers. The & instead of && tests both tags with a
+ * single branch, which is all the quickened opcodes in run() pay. */
+#define BOTH_NUMBERS(a, b)	(IS_NUMBER(a) & IS_NUMBER(b))
+
 typedef struct {
 	int capacity;
 	int count;
 	Value *values;	/* a pointer to a type of double */ 
 } ValueArray;
 
+/* Objects compare by identity, which is equality for flat strings since
+ * they're interned. Use objectsEqual() where either side could be a rope. */
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
-void printValue(Value value);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
+/* Appends value the way print shows it to output. */
+void writeValue(VM* vm, OutputBuffer* output, Value value);
+/* Writes value to stdout straight away, along with anything vm has
+ * buffered. For the disassembler and the stack trace, which use printf()
+ * around it. */
+void printValue(VM* vm, Value value);
+
+/* Enough room for any number formatNumber() writes, and its terminator. */
+#define NUMBER_BUFFER_SIZE 32
+/* Writes number into buffer the way printf("%g") would and returns its
+ * length, without parsing a format or taking stdout's lock. */
+int formatNumber(double number, char* buffer);
 
 #endif
@@ -2,21 +2,63 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "memory.h"
+#include "output.h"
+#include "source.h"
 #include "table.h"
 #include "value.h"
 
+/* The value stack starts out with STACK_MAX slots. interpretChunk() grows
+ * it before run() starts if the chunk needs more, but never past
+ * vm->stackLimit, which starts at STACK_LIMIT. */
 #define STACK_MAX 256
+#define STACK_LIMIT (1024 * 1024)
 
-typedef struct {
+/* Everything one interpreter owns. Nothing in clox is shared between VMs
+ * except the read-only option flags (optimizerEnabled, borrowStrings), the
+ * --profile and --sample-profile state and, for workers, a frozen VM's
+ * objects, so separate VMs can run side by side, one per thread, as long as
+ * each sticks to its own objects. */
+struct VM {
 	// a pointer to Chunk struct
-	Chunk *chunk; /* This is the chunk that my VM will executes */
+	Chunk *chunk; /* This is the chunk that my VM will executes. Its constants are GC roots, so compile() and loadImage() point this at the chunk they fill, and freeChunk() clears it. */
 	uint8_t *ip; /* a 8bit/byte pointer, instruction pointer */
-	Value stack[STACK_MAX];
+	Value *stack;	/* from the system allocator, so growing it can't start a collection */
 	Value *stackTop;
-	Table globals;	/* store here the global defined vars */
-	Table strings;
-	Obj* objects;	/* the vm stores a pointer to the head of the list.*/
-} VM;	/* basically each VM object has access to these fields */
+	int stackCapacity;
+	int stackLimit;	/* the most slots reserveStack() will grow stack to, see --max-stack */
+	Table globalNames;	/* global name -> slot index, only consulted while compiling and reporting errors */
+	ValueArray globalValues;	/* one slot per global name, UNDEFINED_VAL until its var statement runs */
+	OutputBuffer output;	/* what print has written but stdout hasn't been handed yet */
+	Table strings;	/* weak: the collector drops strings nothing else refers to */
+	Obj* objects;	/* the vm stores a pointer to the head of the list. Only old objects, see youngObjects */
+
+	/* Garbage collector state, see memory.c. */
+	Obj* youngObjects;	/* objects allocated since the last collection */
+	size_t youngBytes;
+	size_t bytesAllocated;
+	size_t nextGC;
+	Obj** grayStack;
+	int grayCount;
+	int grayCapacity;
+	Obj** remembered;	/* old objects that have come to point at young ones */
+	int rememberedCount;
+	int rememberedCapacity;
+	bool majorCollection;	/* whether the collection in progress covers the old generation */
+
+	/* Allocator state, see memory.c. */
+	struct Heap* heap;	/* NULL when built with SYSTEM_ALLOCATOR */
+	bool arenaActive;
+	AllocationStats allocationStats;
+	MemoryStats memoryStats;	/* live and peak bytes by MemoryKind, see --mem-stats */
+
+	SourceFile* keptSources;	/* files borrowed strings point into, see keepSource() */
+	int keptCount;
+	int keptCapacity;
+
+	struct VM* shared;	/* the frozen VM whose chunks this one runs, or NULL, see initWorkerVM() */
+	struct Jit* jit;	/* --jit's loop counters and compiled code, made on first use, see jit.c */
+};	/* basically each VM object has access to these fields */
 
 typedef enum {
 	INTERPRET_OK,
@@ -24,16 +66,35 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
+void initVM(VM* vm);
+/* Sets vm up to run chunks compiled by shared, which has to be frozen. It
+ * gets a stack, globals and heap of its own, but finds strings in shared's
+ * table before interning them itself and reports shared's global names. */
+void initWorkerVM(VM* vm, VM* shared);
+/* Makes every object vm has allocated readable from other threads. From
+ * then on vm must not run, compile or collect again; it can only be freed
+ * once all of its workers are. */
+void freezeVM(VM* vm);
+/* Empties the value stack, e.g. before running the same chunk again. */
+void resetStack(VM* vm);
+/* Makes room for slots more values above the top of the stack. Reports an
+ * error and returns false if that would take it past vm->stackLimit. */
+bool reserveStack(VM* vm, int slots);
+void freeVM(VM* vm);
 /* Accepts a pointer that contains the source code */
-InterpretResult interpret(const char *source); /* responsible for interpreting the code contained in the Chunk struct */
+InterpretResult interpret(VM* vm, const char *source); /* responsible for interpreting the code contained in the Chunk struct */
+/* Runs an already compiled chunk, e.g. one loaded from a .loxc image. */
+InterpretResult interpretChunk(VM* vm, Chunk *chunk);
 
 /* The stack protocol supports two operations */
 
-void push(Value value);
-Value pop();
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+
+/* Returns the slot holding the global called name, reserving an undefined
+ * one the first time the compiler sees that name. */
+int globalSlot(VM* vm, ObjString* name);
+/* Looks up which name owns a global slot. Slow; meant for error messages. */
+ObjString* globalName(VM* vm, int slot);
 
 #endif
@@ -1,13 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
 #include "lib/common.h"
 #include "lib/chunk.h"
+#include "lib/compiler.h"
 #include "lib/debug.h"
+#include "lib/image.h"
+#include "lib/jit.h"
+#include "lib/memory.h"
+#include "lib/optimizer.h"
+#include "lib/output.h"
+#include "lib/parallel.h"
+#include "lib/profile.h"
+#include "lib/sampler.h"
+#include "lib/session.h"
+#include "lib/scanner.h"
+#include "lib/source.h"
+#include "lib/stats.h"
+#include "lib/tokens.h"
 #include "lib/vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
 	char line[1024];
 	for (;;) {
 		printf("> ");
@@ -17,60 +35,306 @@ static void repl() {
 			break;
 		}
 
-		interpret(line);
+		interpret(vm, line);
+		flushOutput(&vm->output);
+		collectIfNeeded(vm);	/* the line's chunk is gone, and with it the roots to its constants */
 	}
 }
 
-static char *readFile(const char *path) {
-	FILE *file = fopen(path, "rb");
-	if (file == NULL) {	/* If the user doesn't have permission or a wrong path/to/file is provided */
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
-		exit(74);
+static void openSourceOrExit(const char *path, SourceFile *file) {
+	if (!openSource(path, file)) exit(74);
+}
+
+/* Strings borrowed from the source need it around as long as the VM. */
+static void doneWithSource(VM* vm, SourceFile *file) {
+	if (borrowStrings) {
+		keepSource(vm, file);
+	} else {
+		closeSource(file);
 	}
+}
 
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
+static bool endsWith(const char* string, const char* suffix) {
+	size_t length = strlen(string);
+	size_t suffixLength = strlen(suffix);
+	return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
+}
 
-	char *buffer = (char*)malloc(fileSize + 1);	/* we add 1 for the null byte */ 
-	if (buffer == NULL) {	/* If there is not enough memory and we failed to read the Lox script*/
-		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+/* A .loxc image skips the scanner and compiler and goes straight to run(). */
+static InterpretResult runImage(VM* vm, const char *path) {
+	Chunk chunk;
+	initChunk(&chunk);
+	if (!loadImage(vm, path, &chunk)) exit(65);
+
+	InterpretResult result = interpretChunk(vm, &chunk);
+	freeChunk(vm, &chunk);
+	return result;
+}
+
+/* --compile-only: foo.lox becomes foo.loxc next to it. */
+static void compileFile(VM* vm, const char *path) {
+	SourceFile source;
+	openSourceOrExit(path, &source);
+	Chunk chunk;
+	initChunk(&chunk);
+	bool compiled = compile(vm, source.chars, &chunk);
+	doneWithSource(vm, &source);
+	if (!compiled) exit(65);
+
+	size_t length = strlen(path);
+	char *imagePath = (char*)malloc(length + 7);	/* room for ".loxc" and the null byte */
+	if (imagePath == NULL) {
+		fprintf(stderr, "Not enough memory to compile \"%s\".\n", path);
 		exit(74);
 	}
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize) {
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
+	memcpy(imagePath, path, length + 1);
+	strcat(imagePath, endsWith(path, ".lox") ? "c" : ".loxc");
+
+	bool written = writeImage(vm, &chunk, imagePath);
+	free(imagePath);
+	freeChunk(vm, &chunk);
+	if (!written) exit(74);
+}
+
+static double now() {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* Scans all of source and returns the best of runs timings, in seconds. */
+static double timeScanning(const char *source, int runs) {
+	double best = 0;
+	Scanner scanner;
+	for (int i = 0; i < runs; i++) {
+		double start = now();
+		initScanner(&scanner, source);
+		while (scanToken(&scanner).type != TOKEN_EOF) {}
+		double time = now() - start;
+		if (i == 0 || time < best) best = time;
+	}
+	return best;
+}
+
+/* --bench N: time scanning the source N times, compile once, run once to
+ * warm up and once under the profiler to count instructions, then time N more
+ * runs of the same chunk. */
+static void benchFile(VM* vm, const char *path, int runs) {
+	SourceFile source;
+	openSourceOrExit(path, &source);
+	double scanning = timeScanning(source.chars, runs);
+
+	Chunk chunk;
+	initChunk(&chunk);
+	bool compiled = compile(vm, source.chars, &chunk);
+	size_t sourceLength = source.length;
+	doneWithSource(vm, &source);
+	if (!compiled) exit(65);
+
+	if (interpretChunk(vm, &chunk) != INTERPRET_OK) exit(70);	/* warmup */
+
+	bool profiling = profiler.enabled;
+	if (!profiling) initProfiler();
+	resetStack(vm);
+	interpretChunk(vm, &chunk);
+	uint64_t instructions = profiledInstructions();
+	if (!profiling) freeProfiler();
+
+	double* times = (double*)malloc(sizeof(double) * runs);
+	if (times == NULL) {
+		fprintf(stderr, "Not enough memory to time %d runs.\n", runs);
 		exit(74);
 	}
-	buffer[bytesRead] = '\0';
+	AllocationStats before = vm->allocationStats;
+	for (int i = 0; i < runs; i++) {
+		resetStack(vm);
+		double start = now();
+		interpretChunk(vm, &chunk);
+		times[i] = now() - start;
+	}
+	AllocationStats after = vm->allocationStats;
+	freeChunk(vm, &chunk);
 
-	fclose(file);
-	return buffer;
+	qsort(times, runs, sizeof(double), compareDoubles);
+	double min = times[0];
+	double median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+	free(times);
+
+	fprintf(stderr, "%s: %d runs, %llu instructions per run\n", path, runs, (unsigned long long)instructions);
+	fprintf(stderr, "  min    %10.3f ms  %8.1f M instructions/s\n", min * 1e3, instructions / min / 1e6);
+	fprintf(stderr, "  median %10.3f ms  %8.1f M instructions/s\n", median * 1e3, instructions / median / 1e6);
+	fprintf(stderr, "  scan   %10.3f ms  %8.1f MB/s\n", scanning * 1e3, sourceLength / scanning / 1e6);
+	fprintf(stderr, "  allocations per run: %llu malloc, %llu free, %llu from pools, %llu collections\n",
+			(unsigned long long)((after.systemAllocations - before.systemAllocations) / runs),
+			(unsigned long long)((after.systemFrees - before.systemFrees) / runs),
+			(unsigned long long)((after.poolAllocations - before.poolAllocations) / runs),
+			(unsigned long long)((after.collections - before.collections) / runs));
 }
 
-static void runFile(const char *path) {
-	char *source = readFile(path);
-	InterpretResult result = interpret(source);
-	free(source);
+static void runFile(VM* vm, const char *path) {
+	InterpretResult result;
+	if (endsWith(path, ".loxc")) {
+		result = runImage(vm, path);
+	} else {
+		SourceFile source;
+		openSourceOrExit(path, &source);
+		result = interpret(vm, source.chars);
+		doneWithSource(vm, &source);
+	}
 
+	if (result == INTERPRET_RUNTIME_ERROR) {	/* the exit below skips the reports in main() */
+		printProfile();
+		writeSamples();
+		reportMemory(vm);
+	}
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+/* --parallel N: compile every script (or load its image) up front with vm,
+ * freeze it and hand the chunks to the workers. Nothing collects between the
+ * compiles, so the earlier chunks' constants survive without being roots. */
+static void runParallelFiles(VM* vm, const char** paths, int count, int workers, int repeat) {
+	Chunk* chunks = (Chunk*)malloc(sizeof(Chunk) * count);
+	if (chunks == NULL) {
+		fprintf(stderr, "Not enough memory to compile %d scripts.\n", count);
+		exit(74);
+	}
+	for (int i = 0; i < count; i++) {
+		initChunk(&chunks[i]);
+		if (endsWith(paths[i], ".loxc")) {
+			if (!loadImage(vm, paths[i], &chunks[i])) exit(65);
+		} else {
+			SourceFile source;
+			openSourceOrExit(paths[i], &source);
+			bool compiled = compile(vm, source.chars, &chunks[i]);
+			doneWithSource(vm, &source);
+			if (!compiled) exit(65);
+		}
+	}
+	freezeVM(vm);
+
+	bool ok = runParallel(vm, chunks, count, repeat, workers);
+	for (int i = 0; i < count; i++) freeChunk(vm, &chunks[i]);
+	free(chunks);
+	if (!ok) exit(70);
+}
+
+static void usage() {
+	fprintf(stderr, "Usage: clox [--profile] [--sample-profile HZ [--sample-output PATH]] [--no-optimize] [--jit] [--borrow-strings] [--scan-thread] [--compile-only] [--bench N]\n"
+			"            [--output-buffer BYTES] [--flush-lines] [--max-stack SLOTS] [--mem-stats] [--mem-stats-json PATH]\n"
+			"            [--parallel N [--repeat K]] [--session | --session-socket PATH] [path...]\n");
+	exit(64);
+}
+
 /* From this tiny seed, I will grow my entire VM */
 int main(int argc, const char* argv[]) {
-	printf("Hello\n");
-	initVM();
+#if defined(__unix__) || defined(__APPLE__)
+	if (isatty(fileno(stdout))) outputFlushPolicy = FLUSH_EVERY_LINE;	/* like stdio, show each line as it's printed */
+#endif
+	VM vm;
+	initVM(&vm);
 
-	if (argc == 1) {
-		repl();
-	} else if (argc == 2) {
-		runFile(argv[1]);
+	bool compileOnly = false;
+	int benchRuns = 0;
+	int workers = 0;
+	int repeat = 1;
+	int sampleRate = 0;
+	const char* samplePath = "clox.folded";
+	bool session = false;
+	const char* sessionSocket = NULL;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {	/* options come first, then the script paths */
+		if (strcmp(argv[i], "--profile") == 0) {
+			initProfiler();
+		} else if (strcmp(argv[i], "--sample-profile") == 0) {
+			if (i + 1 == argc || (sampleRate = atoi(argv[++i])) <= 0) usage();
+		} else if (strcmp(argv[i], "--sample-output") == 0) {
+			if (i + 1 == argc) usage();
+			samplePath = argv[++i];
+		} else if (strcmp(argv[i], "--no-optimize") == 0) {
+			optimizerEnabled = false;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			jitEnabled = true;
+		} else if (strcmp(argv[i], "--borrow-strings") == 0) {
+			borrowStrings = true;
+		} else if (strcmp(argv[i], "--scan-thread") == 0) {
+			scanThread = true;
+		} else if (strcmp(argv[i], "--compile-only") == 0) {
+			compileOnly = true;
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			if (i + 1 == argc || (benchRuns = atoi(argv[++i])) <= 0) usage();
+		} else if (strcmp(argv[i], "--parallel") == 0) {
+			if (i + 1 == argc || (workers = atoi(argv[++i])) <= 0) usage();
+		} else if (strcmp(argv[i], "--repeat") == 0) {
+			if (i + 1 == argc || (repeat = atoi(argv[++i])) <= 0) usage();
+		} else if (strcmp(argv[i], "--output-buffer") == 0) {
+			if (i + 1 == argc || atoi(argv[i + 1]) <= 0) usage();
+			outputBufferSize = (size_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--flush-lines") == 0) {
+			outputFlushPolicy = FLUSH_EVERY_LINE;
+		} else if (strcmp(argv[i], "--max-stack") == 0) {
+			if (i + 1 == argc || (vm.stackLimit = atoi(argv[++i])) <= 0) usage();
+		} else if (strcmp(argv[i], "--mem-stats") == 0) {
+			memoryReport = true;
+		} else if (strcmp(argv[i], "--mem-stats-json") == 0) {
+			if (i + 1 == argc) usage();
+			memoryReportPath = argv[++i];
+		} else if (strcmp(argv[i], "--session") == 0) {
+			session = true;
+		} else if (strcmp(argv[i], "--session-socket") == 0) {
+			if (i + 1 == argc) usage();
+			sessionSocket = argv[++i];
+		} else {
+			usage();
+		}
+	}
+	/* In a session stdout carries nothing but framed responses. */
+	if (!session && sessionSocket == NULL) printf("Hello\n");
+	const char** paths = argv + i;
+	int pathCount = argc - i;
+	const char* path = pathCount > 0 ? paths[0] : NULL;
+
+	/* --parallel refuses it below */
+	if (sampleRate > 0 && workers == 0 && !startSampler(sampleRate, samplePath)) exit(64);
+
+	if (session || sessionSocket != NULL) {
+		if (pathCount > 0 || workers > 0 || compileOnly || benchRuns > 0) usage();
+		bool served = sessionSocket != NULL ? serveSessionSocket(&vm, sessionSocket) : serveSession(&vm);
+		if (!served) exit(74);
+	} else if (workers > 0) {
+		if (pathCount == 0 || compileOnly || benchRuns > 0) usage();
+		if (profiler.enabled || sampleRate > 0) {	/* their counters belong to the whole process */
+			fprintf(stderr, "--profile and --sample-profile can't be combined with --parallel.\n");
+			exit(64);
+		}
+		runParallelFiles(&vm, paths, pathCount, workers, repeat);
+	} else if (pathCount > 1) {
+		usage();
+	} else if (compileOnly) {
+		if (path == NULL) usage();
+		compileFile(&vm, path);
+	} else if (benchRuns > 0) {
+		if (path == NULL) usage();
+		benchFile(&vm, path, benchRuns);
+	} else if (path == NULL) {
+		borrowStrings = false;	/* each REPL line reuses the same buffer */
+		repl(&vm);
 	} else {
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+		runFile(&vm, path);
 	}
 
-	freeVM();
+	printProfile();
+	freeProfiler();
+	writeSamples();
+	freeSampler();
+	reportMemory(&vm);
+	freeVM(&vm);
 	return 0;
 }
@@ -1,37 +1,488 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib/memory.h"
 #include "lib/vm.h"
 
-void* reallocate(void *pointer, size_t oldSize, size_t newSize) {
+#ifndef SYSTEM_ALLOCATOR
+/* Every request of SMALL_MAX bytes or less comes out of a slab: a
+ * SLAB_SIZE block that is also aligned to SLAB_SIZE, so masking off the low
+ * bits of any pointer into it finds its header. A pool slab is carved into
+ * blocks of one size class, 16, 32, ... SMALL_MAX bytes, and freed blocks go
+ * on that class's free list. An arena slab is bump allocated for the
+ * compiler's scratch arrays, and is rewound all at once when it's done.
+ *
+ * Larger requests go to malloc, with a small header linking them into one
+ * list, so teardown can drop everything without walking vm->objects. */
+#define SLAB_SIZE	(64 * 1024)
+#define SLAB_HEADER	64	/* keeps the first block 16-byte aligned */
+#define SMALL_MAX	256
+#define SIZE_CLASS(size)	(((size) + 15) / 16 - 1)
+#define SIZE_CLASSES		(SIZE_CLASS(SMALL_MAX) + 1)
+#define ROUND_UP(size)		(((size) + 15) & ~(size_t)15)
+
+typedef enum {
+	SLAB_POOL,
+	SLAB_ARENA,
+} SlabKind;
+
+typedef struct Slab {
+	SlabKind kind;
+	struct Slab* next;	/* the other slabs of its kind */
+	size_t used;	/* bytes handed out so far, header included */
+} Slab;
+
+typedef struct FreeBlock {
+	struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct LargeBlock {
+	struct LargeBlock* prev;
+	struct LargeBlock* next;
+} LargeBlock;
+
+#define LARGE_HEADER	ROUND_UP(sizeof(LargeBlock))
+
+/* One per VM, made by initHeap(). */
+typedef struct Heap {
+	Slab* slabs;	/* the pool slabs */
+	Slab* arenaSlabs;	/* newest first, so the head is the one being bumped */
+	Slab* current[SIZE_CLASSES];	/* the slab each class is carving new blocks out of */
+	FreeBlock* freeLists[SIZE_CLASSES];
+	void* arenaLast;	/* the arena's most recent allocation, which can grow in place */
+	LargeBlock* large;
+} Heap;
+
+static void* systemAllocate(VM* vm, size_t size) {
+	void* result = malloc(size);
+	if (result == NULL) exit(1);	// allocation can fail if there isn't enough memory and malloc() will return NULL
+	vm->allocationStats.systemAllocations++;
+	return result;
+}
+
+static void systemFree(VM* vm, void* pointer) {
+	free(pointer);
+	vm->allocationStats.systemFrees++;
+}
+
+static Slab* newSlab(VM* vm, SlabKind kind) {
+	Slab* slab = (Slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+	if (slab == NULL) exit(1);
+	vm->allocationStats.systemAllocations++;
+	slab->kind = kind;
+	slab->used = SLAB_HEADER;
+	Slab** list = kind == SLAB_POOL ? &vm->heap->slabs : &vm->heap->arenaSlabs;
+	slab->next = *list;
+	*list = slab;
+	return slab;
+}
+
+static Slab* slabOf(void* pointer) {
+	return (Slab*)((uintptr_t)pointer & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void* poolAllocate(VM* vm, size_t size) {
+	int sizeClass = SIZE_CLASS(size);
+	vm->allocationStats.poolAllocations++;
+
+	FreeBlock* block = vm->heap->freeLists[sizeClass];
+	if (block != NULL) {
+		vm->heap->freeLists[sizeClass] = block->next;
+		return block;
+	}
+
+	size_t blockSize = (size_t)(sizeClass + 1) * 16;
+	Slab* slab = vm->heap->current[sizeClass];
+	if (slab == NULL || slab->used + blockSize > SLAB_SIZE) {
+		slab = newSlab(vm, SLAB_POOL);
+		vm->heap->current[sizeClass] = slab;
+	}
+	void* result = (char*)slab + slab->used;
+	slab->used += blockSize;
+	return result;
+}
+
+static void poolFree(VM* vm, void* pointer, size_t size) {
+	int sizeClass = SIZE_CLASS(size);
+	FreeBlock* block = (FreeBlock*)pointer;
+	block->next = vm->heap->freeLists[sizeClass];
+	vm->heap->freeLists[sizeClass] = block;
+}
+
+static void* arenaAllocate(VM* vm, size_t size) {
+	size = ROUND_UP(size);
+	vm->allocationStats.arenaAllocations++;
+	Slab* arena = vm->heap->arenaSlabs;
+	if (arena == NULL || arena->used + size > SLAB_SIZE) arena = newSlab(vm, SLAB_ARENA);
+	void* result = (char*)arena + arena->used;
+	arena->used += size;
+	vm->heap->arenaLast = result;
+	return result;
+}
+
+/* Bumping the arena again if pointer was the last thing it handed out. */
+static bool arenaGrowInPlace(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+	if (pointer != vm->heap->arenaLast) return false;
+	size_t used = vm->heap->arenaSlabs->used - ROUND_UP(oldSize) + ROUND_UP(newSize);
+	if (used > SLAB_SIZE) return false;
+	vm->heap->arenaSlabs->used = used;
+	return true;
+}
+
+static void* largeAllocate(VM* vm, size_t size) {
+	LargeBlock* block = (LargeBlock*)systemAllocate(vm, LARGE_HEADER + size);
+	block->prev = NULL;
+	block->next = vm->heap->large;
+	if (vm->heap->large != NULL) vm->heap->large->prev = block;
+	vm->heap->large = block;
+	return (char*)block + LARGE_HEADER;
+}
+
+static void unlinkLarge(VM* vm, LargeBlock* block) {
+	if (block->prev != NULL) block->prev->next = block->next;
+	else vm->heap->large = block->next;
+	if (block->next != NULL) block->next->prev = block->prev;
+}
+
+static void* largeResize(VM* vm, void* pointer, size_t newSize) {
+	LargeBlock* block = (LargeBlock*)((char*)pointer - LARGE_HEADER);
+	unlinkLarge(vm, block);
+	block = (LargeBlock*)realloc(block, LARGE_HEADER + newSize);
+	if (block == NULL) exit(1);
+	vm->allocationStats.systemAllocations++;
+	block->prev = NULL;
+	block->next = vm->heap->large;
+	if (vm->heap->large != NULL) vm->heap->large->prev = block;
+	vm->heap->large = block;
+	return (char*)block + LARGE_HEADER;
+}
+
+static void* allocate(VM* vm, size_t size, MemoryKind kind) {
+	if (size > SMALL_MAX) return largeAllocate(vm, size);
+	if (vm->arenaActive && kind == MEM_SCRATCH) return arenaAllocate(vm, size);
+	return poolAllocate(vm, size);
+}
+
+static void release(VM* vm, void* pointer, size_t size) {
+	if (pointer == NULL) return;
+	if (size > SMALL_MAX) {
+		LargeBlock* block = (LargeBlock*)((char*)pointer - LARGE_HEADER);
+		unlinkLarge(vm, block);
+		systemFree(vm, block);
+	} else if (slabOf(pointer)->kind == SLAB_POOL) {
+		poolFree(vm, pointer, size);
+	}
+	/* Arena memory stays put until endCompilerArena(). */
+}
+
+/* Everything the arena handed out is dead once the compile is over. The
+ * newest slab is kept for the next compile, so a REPL line doesn't cost a
+ * slab from the system each time. */
+static void rewindArena(VM* vm) {
+	Slab* kept = vm->heap->arenaSlabs;
+	if (kept == NULL) return;
+	while (kept->next != NULL) {
+		Slab* next = kept->next->next;
+		systemFree(vm, kept->next);
+		kept->next = next;
+	}
+	kept->used = SLAB_HEADER;
+	vm->heap->arenaLast = NULL;
+}
+#endif
+
+void initHeap(VM* vm) {
+	memset(&vm->allocationStats, 0, sizeof(vm->allocationStats));
+	memset(&vm->memoryStats, 0, sizeof(vm->memoryStats));
+	vm->arenaActive = false;
+#ifdef SYSTEM_ALLOCATOR
+	vm->heap = NULL;
+#else
+	vm->heap = (Heap*)calloc(1, sizeof(Heap));
+	if (vm->heap == NULL) exit(1);
+#endif
+}
+
+static const char* memoryKindNames[MEM_KIND_COUNT] = {
+	[MEM_STRING] = "string",
+	[MEM_ROPE] = "rope",
+	[MEM_NUMBER_ARRAY] = "number array",
+	[MEM_CODE] = "code",
+	[MEM_LINES] = "lines",
+	[MEM_CONSTANTS] = "constants",
+	[MEM_CONSTANT_INDEX] = "constant index",
+	[MEM_GLOBALS] = "globals",
+	[MEM_TABLE] = "table",
+	[MEM_INTERN_TABLE] = "intern table",
+	[MEM_SCRATCH] = "scratch",
+};
+
+const char* memoryKindName(MemoryKind kind) {
+	return memoryKindNames[kind];
+}
+
+/* A resize counts as neither an allocation nor a free, only as a change in
+ * live bytes. */
+static inline void countMemory(VM* vm, MemoryKind kind, size_t oldSize, size_t newSize) {
+	MemoryStats* stats = &vm->memoryStats;
+	MemoryUsage* usage = &stats->kinds[kind];
+	if (oldSize == 0) usage->allocations++;
+	if (newSize == 0) usage->frees++;
+	usage->live += newSize - oldSize;
+	stats->live += newSize - oldSize;
+	if (usage->live > usage->peak) usage->peak = usage->live;
+	if (stats->live > stats->peak) stats->peak = stats->live;
+}
+
+void* reallocate(VM* vm, void *pointer, size_t oldSize, size_t newSize, MemoryKind kind) {
+	vm->bytesAllocated += newSize - oldSize;	/* wraps around correctly when shrinking */
+	if (oldSize != 0 || newSize != 0) countMemory(vm, kind, oldSize, newSize);
+	if (newSize > oldSize) collectIfNeeded(vm);
+
+#ifdef SYSTEM_ALLOCATOR
 	if (newSize == 0) {
 		free(pointer);	// When newSize is zero, we handle the deallocation case ourselves by calling free()
+		vm->allocationStats.systemFrees++;
 		return NULL;
 	}
 
 	// Otherwise, we rely on the C standard library's realloc()
-	void *result = realloc(pointer, newSize);
+	void* result = realloc(pointer, newSize);
 	if (result == NULL) exit(1);	// allocation can fail if there isn't enough memory and realloc() will return NULL
+	vm->allocationStats.systemAllocations++;
 	return result;
+#else
+	if (newSize == 0) {
+		release(vm, pointer, oldSize);	// When newSize is zero, we're freeing
+		return NULL;
+	}
+	if (pointer == NULL) return allocate(vm, newSize, kind);
+
+	/* Stay where we are whenever the block we already have fits the new size. */
+	if (oldSize > SMALL_MAX && newSize > SMALL_MAX) return largeResize(vm, pointer, newSize);
+	if (oldSize <= SMALL_MAX && newSize <= SMALL_MAX) {
+		Slab* slab = slabOf(pointer);
+		if (slab->kind == SLAB_POOL && SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) return pointer;
+		if (slab->kind == SLAB_ARENA &&
+			(ROUND_UP(newSize) <= ROUND_UP(oldSize) || arenaGrowInPlace(vm, pointer, oldSize, newSize))) {
+			return pointer;
+		}
+	}
+
+	void* result = allocate(vm, newSize, kind);
+	memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+	release(vm, pointer, oldSize);
+	return result;
+#endif
+}
+
+/* Besides picking the arena for scratch arrays, arenaActive holds off the
+ * collector: the compiler and the image loader keep fresh objects in C locals
+ * the collector can't see. */
+void beginCompilerArena(VM* vm) {
+	vm->arenaActive = true;
+}
+
+void endCompilerArena(VM* vm) {
+	vm->arenaActive = false;
+#ifndef SYSTEM_ALLOCATOR
+	rewindArena(vm);
+#endif
 }
 
-static void freeObject(Obj* object) {
+/* The collector is a precise mark-sweep with two generations. New objects go
+ * on vm->youngObjects. Once the nursery has taken GC_NURSERY_SIZE bytes, a
+ * minor collection marks from the roots but stops at old objects, since
+ * they're assumed alive. Surviving young objects are promoted onto vm->objects
+ * and the rest are freed, so short-lived temporaries like the strings
+ * concatenate() makes cost almost nothing to get rid of. After the whole
+ * heap has doubled, a major collection marks and sweeps both generations.
+ *
+ * A minor collection can only skip old objects because none of them point at
+ * young ones. Strings and number arrays point at nothing, and a rope's
+ * children are always older than the rope. The one exception is a rope
+ * flattened after being promoted. flattenRope() records those in
+ * vm->remembered, and a minor collection treats their children as roots.
+ *
+ * vm->strings is weak: freeing a string deletes its entry there. */
+
+static void freeObject(VM* vm, Obj* object) {
 	switch (object->type) {
 		case OBJ_STRING: {
 			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(char, string->chars, string->length + 1);
-			FREE(ObjString, object);
+			tableDelete(&vm->strings, string);
+			reallocate(vm, object, stringSize(string), 0, MEM_STRING);
+			break;
+		}
+		case OBJ_ROPE:	/* its children are objects of their own, freed on their turn */
+			FREE(vm, MEM_ROPE, ObjRope, object);
+			break;
+		case OBJ_NUMBER_ARRAY:
+			reallocate(vm, object, NUMBER_ARRAY_SIZE(((ObjNumberArray*)object)->count), 0, MEM_NUMBER_ARRAY);
+			break;
+	}
+}
+
+/* The gray stack and the remembered set use the system allocator directly,
+ * as allocating through reallocate() could start another collection. */
+static void appendObject(Obj*** array, int* count, int* capacity, Obj* object) {
+	if (*count + 1 > *capacity) {
+		*capacity = GROW_CAPACITY(*capacity);
+		*array = (Obj**)realloc(*array, sizeof(Obj*) * *capacity);
+		if (*array == NULL) exit(1);
+	}
+	(*array)[(*count)++] = object;
+}
+
+void markObject(VM* vm, Obj* object) {
+	if (object == NULL || object->isMarked) return;
+	if (object->isOld && (!vm->majorCollection || object->isFrozen)) return;	/* frozen objects are someone else's */
+	object->isMarked = true;
+	if (object->type != OBJ_ROPE) return;	/* nothing else has anything to trace, so skip the gray stack */
+	appendObject(&vm->grayStack, &vm->grayCount, &vm->grayCapacity, object);
+}
+
+void markValue(VM* vm, Value value) {
+	if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
+}
+
+void rememberObject(VM* vm, Obj* object) {
+	appendObject(&vm->remembered, &vm->rememberedCount, &vm->rememberedCapacity, object);
+}
+
+static void blackenObject(VM* vm, Obj* object) {
+	switch (object->type) {
+		case OBJ_STRING:
+		case OBJ_NUMBER_ARRAY:
+			break;
+		case OBJ_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			markObject(vm, rope->left);
+			markObject(vm, rope->right);
+			markObject(vm, (Obj*)rope->flat);
 			break;
 		}
 	}
 }
 
-/* A function for freeing the objects */
-void freeObjects() {
-	Obj* object = vm.objects;
-	while (object != NULL) {	/*if it hasn't reached yet the end of the list, i suppose?*/
-		Obj* next = object->next;	/* retrieves the pointer to the next object in the linked list, freeds the current and move to the next.*/
-		freeObject(object);	/* This is responsible for freeing the object.*/
-		object = next; /* after freeing, update the object pointer to point to the next object in the linked list, which continues the loop.*/
+static void markRoots(VM* vm) {
+	for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+		markValue(vm, *slot);
+	}
+	for (int i = 0; i < vm->globalValues.count; i++) {
+		markValue(vm, vm->globalValues.values[i]);
 	}
+	for (int i = 0; i < vm->globalNames.capacity; i++) {
+		markObject(vm, (Obj*)vm->globalNames.entries[i].key);	/* NULL for every free slot */
+	}
+	if (vm->chunk != NULL) {
+		for (int i = 0; i < vm->chunk->constants.count; i++) {
+			markValue(vm, vm->chunk->constants.values[i]);
+		}
+	}
+	if (!vm->majorCollection) {
+		for (int i = 0; i < vm->rememberedCount; i++) {
+			blackenObject(vm, vm->remembered[i]);
+		}
+	}
+}
+
+/* Frees every unmarked object on list, which is vm->objects or
+ * vm->youngObjects, and clears the mark on the rest. Survivors of the young
+ * list are promoted onto vm->objects. */
+static void sweep(VM* vm, Obj** list, bool promote) {
+	Obj* object = *list;
+	*list = NULL;
+	while (object != NULL) {
+		Obj* next = object->next;
+		if (!object->isMarked) {
+			freeObject(vm, object);
+		} else {
+			object->isMarked = false;
+			Obj** into = promote ? &vm->objects : list;
+			object->isOld = true;
+			object->next = *into;
+			*into = object;
+		}
+		object = next;
+	}
+}
+
+void collectGarbage(VM* vm, bool major) {
+	vm->majorCollection = major;
+	vm->allocationStats.collections++;
+
+	markRoots(vm);
+	while (vm->grayCount > 0) {
+		blackenObject(vm, vm->grayStack[--vm->grayCount]);
+	}
+
+	if (major) sweep(vm, &vm->objects, false);	/* first, so promoted objects aren't swept with their marks cleared */
+	sweep(vm, &vm->youngObjects, true);
+	vm->rememberedCount = 0;
+	vm->youngBytes = 0;
+
+	if (major) {
+		vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+		if (vm->nextGC < GC_INITIAL_HEAP) vm->nextGC = GC_INITIAL_HEAP;
+	}
+}
+
+void collectIfNeeded(VM* vm) {
+	if (vm->arenaActive) return;
+#ifdef DEBUG_STRESS_GC
+	collectGarbage(vm, (vm->allocationStats.collections + 1) % 16 == 0);	/* a minor collection every time, a major one now and then */
+#else
+	if (vm->bytesAllocated > vm->nextGC) {
+		collectGarbage(vm, true);
+	} else if (vm->youngBytes > GC_NURSERY_SIZE) {
+		collectGarbage(vm, false);
+	}
+#endif
+}
+
+/* A function for freeing the objects. With the pools every object lives in
+ * a slab or on the large list, so shutting down hands those back whole
+ * instead of visiting each object. That also frees every other array that
+ * came through reallocate(), so this has to be the last thing freeVM()
+ * does. */
+void freeObjects(VM* vm) {
+#ifdef SYSTEM_ALLOCATOR
+	Obj* lists[] = {vm->objects, vm->youngObjects};
+	for (int i = 0; i < 2; i++) {
+		Obj* object = lists[i];
+		while (object != NULL) {	/*if it hasn't reached yet the end of the list, i suppose?*/
+			Obj* next = object->next;	/* retrieves the pointer to the next object in the linked list, freeds the current and move to the next.*/
+			freeObject(vm, object);	/* This is responsible for freeing the object.*/
+			object = next; /* after freeing, update the object pointer to point to the next object in the linked list, which continues the loop.*/
+		}
+	}
+#else
+	while (vm->heap->slabs != NULL) {
+		Slab* next = vm->heap->slabs->next;
+		systemFree(vm, vm->heap->slabs);
+		vm->heap->slabs = next;
+	}
+	while (vm->heap->arenaSlabs != NULL) {
+		Slab* next = vm->heap->arenaSlabs->next;
+		systemFree(vm, vm->heap->arenaSlabs);
+		vm->heap->arenaSlabs = next;
+	}
+	while (vm->heap->large != NULL) {
+		LargeBlock* next = vm->heap->large->next;
+		systemFree(vm, vm->heap->large);
+		vm->heap->large = next;
+	}
+	free(vm->heap);
+	vm->heap = NULL;
+#endif
+	vm->objects = NULL;
+	vm->youngObjects = NULL;
+
+	free(vm->grayStack);
+	free(vm->remembered);
+	vm->grayStack = NULL;
+	vm->grayCapacity = 0;
+	vm->remembered = NULL;
+	vm->rememberedCapacity = 0;
 }
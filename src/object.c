@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "lib/hash.h"
 #include "lib/memory.h"
 #include "lib/object.h"
 #include "lib/table.h"
@@ -9,8 +10,8 @@
 
 /* Like the previous macro, this exists mainly to avoid the need to redundantly
  * cast a void* back to the desired type.*/
-#define ALLOCATE_OBJ(type, objectType) \
-	(type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+	(type*)allocateObject(vm, sizeof(type), objectType)
 
 /* here is the actual implementation of the macro.
  * It allocates an object of the given size on the heap.
@@ -18,11 +19,15 @@
  * The caller passes in the numbber of bytes so that
  * there is room for the extra payload fields needed
  * by the specific object type being created.*/
-static Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+	Obj* object = (Obj*)reallocate(vm, NULL, 0, size, objectMemory(type));
 	object->type = type;
-	object->next = vm.objects;	/* Every time we allocate an Obj, we insert it in the list.*/
-	vm.objects = object;
+	object->isMarked = false;
+	object->isOld = false;
+	object->isFrozen = false;
+	object->next = vm->youngObjects;	/* Every time we allocate an Obj, we insert it in the nursery's list.*/
+	vm->youngObjects = object;
+	vm->youngBytes += size;
 	return object;
 }
 /* then it initializes the Obj state -- right now, that's just the type tag.
@@ -30,52 +35,184 @@ static Obj* allocateObject(size_t size, ObjType type) {
  * the ObjString fields.*/
 
 
-/* It creates a new ObjString on the heap and then initializes its fields.
- * It's sort of like a constructor in an OOP language. As such, it first
- * calls the "base class" constructor to initialize the Obj state, using
- * the new macro ALLOCATE_OBJ*/
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {	/* Whenever we allocate string, we pass in its hash code.*/
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/* It creates a new ObjString on the heap. The header and the characters are
+ * one allocation, so this can't go through ALLOCATE_OBJ, and the string stays
+ * off the object lists until internString() adds it. That also means the
+ * collector can't see it, so nothing has to keep it reachable meanwhile. */
+ObjString* allocateString(VM* vm, int length) {
+	ObjString* string = (ObjString*)reallocate(vm, NULL, 0, STRING_SIZE(length), MEM_STRING);
+	string->obj.type = OBJ_STRING;
+	string->obj.isMarked = false;
+	string->obj.isOld = false;
+	string->obj.isFrozen = false;
+	string->obj.next = NULL;
 	string->length = length;
-	string->chars = chars;
+	string->hash = 0;
+	string->chars = string->storage;
+	string->storage[length] = '\0';
+	return string;
+}
+
+/* Makes a freshly built string a real object: it goes into vm->strings and
+ * then into the nursery. Growing vm->strings can collect, so the string only
+ * joins the object list afterwards, where a sweep could find it. */
+static ObjString* internString(VM* vm, ObjString* string, uint32_t hash) {	/* Whenever we intern a string, we pass in its hash code.*/
 	string->hash = hash;
-	tableSet(&vm.strings, string, NIL_VAL);	/* I think string is the key and after setting up the table it returns the */
+	tableSet(vm, &vm->strings, string, NIL_VAL);	/* I think string is the key and after setting up the table it returns the */
+	string->obj.next = vm->youngObjects;
+	vm->youngObjects = (Obj*)string;
+	vm->youngBytes += stringSize(string);
 	return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-	uint32_t hash = 2166136261u;
-	for (int i = 0; i < length; i++) {
-		hash ^= (uint8_t)key[i];
-		hash *= 16777619;
+/* The interned string with these characters, looking through the frozen
+ * strings of the VM this one shares code with after its own. */
+static ObjString* findString(VM* vm, const char* chars, int length, uint32_t hash) {
+	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+	if (interned == NULL && vm->shared != NULL) {
+		interned = tableFindString(&vm->shared->strings, chars, length, hash);
 	}
-	return hash;
+	return interned;
 }
 
-ObjString* takeString(char* chars, int length) {
-	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString* takeString(VM* vm, ObjString* string) {
+	uint32_t hash = hashString(string->chars, string->length);
+	ObjString* interned = findString(vm, string->chars, string->length, hash);
 	if (interned != NULL) {
-		FREE_ARRAY(char, chars, length + 1);
+		reallocate(vm, string, stringSize(string), 0, MEM_STRING);
 		return interned;
 	}
-	return allocateString(chars, length, hash);
+	return internString(vm, string, hash);
+}
+
+ObjString* copyString(VM* vm, const char* chars, int length) {
+	return copyStringHashed(vm, chars, length, hashString(chars, length));
+}
+
+ObjString* copyStringHashed(VM* vm, const char* chars, int length, uint32_t hash) {
+	ObjString* interned = findString(vm, chars, length, hash);
+	if (interned != NULL) return interned;
+	ObjString* string = allocateString(vm, length);
+	memcpy(string->storage, chars, length);	/* destination, source, size*/
+	return internString(vm, string, hash);
+}
+
+ObjString* borrowString(VM* vm, const char* chars, int length) {
+	return borrowStringHashed(vm, chars, length, hashString(chars, length));
 }
 
-ObjString* copyString(const char* chars, int length) {
-	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString* borrowStringHashed(VM* vm, const char* chars, int length, uint32_t hash) {
+	ObjString* interned = findString(vm, chars, length, hash);
 	if (interned != NULL) return interned;
-	char * heapChars =  ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);	/* destination, source, size*/
-	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	ObjString* string = (ObjString*)reallocate(vm, NULL, 0, sizeof(ObjString), MEM_STRING);
+	string->obj.type = OBJ_STRING;
+	string->obj.isMarked = false;
+	string->obj.isOld = false;
+	string->obj.isFrozen = false;
+	string->obj.next = NULL;
+	string->length = length;
+	string->chars = chars;
+	return internString(vm, string, hash);
+}
+
+ObjRope* makeRope(VM* vm, Obj* left, Obj* right, int length) {
+	ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->left = left;
+	rope->right = right;
+	rope->flat = NULL;
+	return rope;
+}
+
+ObjNumberArray* newNumberArray(VM* vm, int count) {
+	ObjNumberArray* array = (ObjNumberArray*)allocateObject(vm, NUMBER_ARRAY_SIZE(count), OBJ_NUMBER_ARRAY);
+	array->count = count;
+	return array;
+}
+
+/* Copies the rope's leaves into one buffer, back to front. A rope built by a
+ * loop is a long left-leaning chain, so this uses an explicit stack instead
+ * of recursing. Visiting the right child first makes the stack stay small for
+ * that shape. */
+static ObjString* flattenRope(VM* vm, ObjRope* rope) {
+	if (rope->flat != NULL) return rope->flat;
+
+	ObjString* string = allocateString(vm, rope->length);
+	char* chars = string->storage;
+	int end = rope->length;
+
+	int capacity = 8;
+	int count = 0;
+	Obj** pending = ALLOCATE(vm, MEM_SCRATCH, Obj*, capacity);
+	pending[count++] = rope->left;
+	pending[count++] = rope->right;
+
+	while (count > 0) {
+		Obj* node = pending[--count];
+		if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat != NULL) {
+			node = (Obj*)((ObjRope*)node)->flat;
+		}
+
+		if (node->type == OBJ_STRING) {
+			ObjString* leaf = (ObjString*)node;
+			end -= leaf->length;
+			memcpy(chars + end, leaf->chars, leaf->length);
+			continue;
+		}
+
+		if (count + 2 > capacity) {
+			int oldCapacity = capacity;
+			capacity = GROW_CAPACITY(oldCapacity);
+			pending = GROW_ARRAY(vm, MEM_SCRATCH, Obj*, pending, oldCapacity, capacity);
+		}
+		pending[count++] = ((ObjRope*)node)->left;
+		pending[count++] = ((ObjRope*)node)->right;
+	}
+	FREE_ARRAY(vm, MEM_SCRATCH, Obj*, pending, capacity);
+
+	rope->flat = takeString(vm, string);
+	rope->left = NULL;
+	rope->right = NULL;
+	/* The only way an old object ever comes to point at a young one. */
+	if (rope->obj.isOld && !rope->flat->obj.isOld) rememberObject(vm, (Obj*)rope);
+	return rope->flat;
+}
+
+ObjString* flattenString(VM* vm, Obj* string) {
+	if (string->type == OBJ_ROPE) return flattenRope(vm, (ObjRope*)string);
+	return (ObjString*)string;
 }
 
-void printObject(Value value) {
+/* Flat strings are interned, so for them identity is equality. Ropes have to
+ * be flattened first, unless the lengths already tell them apart. */
+bool objectsEqual(VM* vm, Obj* a, Obj* b) {
+	if (a == b) return true;
+	if (a->type == OBJ_STRING && b->type == OBJ_STRING) return false;
+	if (a->type == OBJ_NUMBER_ARRAY || b->type == OBJ_NUMBER_ARRAY) return false;	/* arrays are only ever equal to themselves */
+	if (stringLength(a) != stringLength(b)) return false;
+	return flattenString(vm, a) == flattenString(vm, b);
+}
+
+void writeObject(VM* vm, OutputBuffer* output, Value value) {
 	switch (OBJ_TYPE(value)) {
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			writeOutput(output, AS_CSTRING(value), AS_STRING(value)->length);
+			break;
+		case OBJ_ROPE: {
+			ObjString* flat = AS_FLAT_STRING(vm, value);
+			writeOutput(output, flat->chars, flat->length);
+			break;
+		}
+		case OBJ_NUMBER_ARRAY: {
+			ObjNumberArray* array = AS_NUMBER_ARRAY(value);
+			char buffer[NUMBER_BUFFER_SIZE];
+			writeOutput(output, "[", 1);
+			for (int i = 0; i < array->count; i++) {
+				if (i > 0) writeOutput(output, ", ", 2);
+				writeOutput(output, buffer, (size_t)formatNumber(array->values[i], buffer));
+			}
+			writeOutput(output, "]", 1);
 			break;
+		}
 	}
 }
@@ -0,0 +1,468 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/memory.h"
+#include "lib/object.h"
+#include "lib/optimizer.h"
+
+bool optimizerEnabled = true;
+
+/* A jump written into the new code whose operand can only be filled in once
+ * we know where its target ended up. */
+typedef struct {
+	int operand;	/* offset of the two operand bytes in the new code */
+	int target;	/* offset of the target in the old code */
+	bool backward;	/* OP_LOOP counts back from the end of the instruction */
+} JumpFixup;
+
+typedef struct {
+	VM* vm;	/* owns the chunk, so everything below is allocated from it */
+	Chunk* chunk;	/* the chunk being rewritten */
+	bool* isTarget;	/* isTarget[offset] is true if any jump can land on that old offset */
+	Chunk out;	/* the rewritten code and line table */
+	JumpFixup* fixups;
+	int fixupCount;
+	int fixupCapacity;
+} Optimizer;
+
+static bool isJump(uint8_t instruction) {
+	return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP;
+}
+
+/* Old offset the jump instruction at offset lands on. */
+static int jumpTarget(Chunk* chunk, int offset) {
+	int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+	if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+	return offset + 3 + jump;
+}
+
+/* True if the instruction at offset is op and nothing jumps straight to it,
+ * which is what makes it safe to fold into the instruction before it. */
+static bool interior(Optimizer* optimizer, int offset, uint8_t op) {
+	return offset < optimizer->chunk->count &&
+		   optimizer->chunk->code[offset] == op &&
+		   !optimizer->isTarget[offset];
+}
+
+/* The compiler pairs OP_JUMP_IF_FALSE with an OP_POP right after it and
+ * another at its target, so the condition is popped on both paths. When
+ * that holds, the jump can pop the condition itself and land one past the
+ * target's OP_POP. */
+static bool popsOnBothPaths(Optimizer* optimizer, int offset) {
+	Chunk* chunk = optimizer->chunk;
+	if (!interior(optimizer, offset + 3, OP_POP)) return false;
+
+	int target = jumpTarget(chunk, offset);
+	return target < chunk->count && chunk->code[target] == OP_POP;
+}
+
+static void emit(Optimizer* optimizer, uint8_t byte, int line) {
+	writeChunk(optimizer->vm, &optimizer->out, byte, line);
+}
+
+/* Writes a jump with a placeholder operand and remembers to patch it. */
+static void emitJump(Optimizer* optimizer, uint8_t instruction, int target, int line) {
+	if (optimizer->fixupCapacity < optimizer->fixupCount + 1) {
+		int oldCapacity = optimizer->fixupCapacity;
+		optimizer->fixupCapacity = GROW_CAPACITY(oldCapacity);
+		optimizer->fixups = GROW_ARRAY(optimizer->vm, MEM_SCRATCH, JumpFixup, optimizer->fixups, oldCapacity, optimizer->fixupCapacity);
+	}
+
+	emit(optimizer, instruction, line);
+	JumpFixup* fixup = &optimizer->fixups[optimizer->fixupCount++];
+	fixup->operand = optimizer->out.count;
+	fixup->target = target;
+	fixup->backward = instruction == OP_LOOP;
+	emit(optimizer, 0xff, line);
+	emit(optimizer, 0xff, line);
+}
+
+/* Swaps out's code and line table into chunk, keeping its constants. */
+static void replaceCode(VM* vm, Chunk* chunk, Chunk* out) {
+	FREE_ARRAY(vm, MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(vm, MEM_LINES, LineStart, chunk->lines, chunk->lineCapacity);
+	chunk->code = out->code;
+	chunk->count = out->count;
+	chunk->capacity = out->capacity;
+	chunk->lines = out->lines;
+	chunk->lineCount = out->lineCount;
+	chunk->lineCapacity = out->lineCapacity;
+}
+
+/* One instruction, as the control-flow pass sees it. Jumps point at the
+ * instruction they land on by index rather than by offset so instructions
+ * can be dropped without patching anything until the code is written out. */
+typedef struct {
+	int offset;	/* where it starts in the old code, for its operands */
+	int line;
+	uint8_t op;	/* can change: a jump may turn into OP_LOOP or back */
+	int target;	/* for jumps, the index of the instruction they land on */
+	bool removed;
+	bool targeted;	/* some live jump lands here */
+	bool reached;
+} Node;
+
+typedef struct {
+	Node* nodes;
+	int count;
+} Flow;
+
+/* Any jump, including the fused ones, as the pass runs again after fusion. */
+static bool isBranch(uint8_t instruction) {
+	switch (instruction) {
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_LESS:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool isUnconditional(uint8_t instruction) {
+	return instruction == OP_JUMP || instruction == OP_LOOP;
+}
+
+/* The first instruction at or after index that's still there. Dropped
+ * instructions never do anything, so a jump to one carries on from it. */
+static int skipRemoved(Flow* flow, int index) {
+	while (index < flow->count && flow->nodes[index].removed) index++;
+	return index;
+}
+
+static int nextLive(Flow* flow, int index) {
+	return skipRemoved(flow, index + 1);
+}
+
+/* Follows jump i through any jumps it lands on for as long as that's where
+ * control would end up anyway: through unconditional jumps, and for
+ * OP_JUMP_IF_FALSE through another one, which sees the same falsey value
+ * and jumps too. Conditional jumps only go forward, and no jump may get
+ * further than 16 bits can reach. A chain that goes round in circles, as in
+ * while (true) {}, is left alone. */
+static int threadJump(Flow* flow, int i) {
+	Node* jump = &flow->nodes[i];
+	int target = skipRemoved(flow, jump->target);
+	for (int steps = 0; target < flow->count; steps++) {
+		if (steps == flow->count) return skipRemoved(flow, jump->target);
+		Node* at = &flow->nodes[target];
+		bool follows = isUnconditional(at->op) ||
+				(jump->op == OP_JUMP_IF_FALSE && at->op == OP_JUMP_IF_FALSE);
+		if (!follows) break;
+
+		int next = skipRemoved(flow, at->target);
+		if (next >= flow->count || next == target) break;
+		if (!isUnconditional(jump->op) && next <= i) break;
+		int distance = flow->nodes[next].offset - jump->offset;
+		if (distance < 0) distance = -distance;
+		if (distance + 3 > UINT16_MAX) break;
+		target = next;
+	}
+	return target;
+}
+
+/* Whether the instruction pushes a constant, and if so whether it's falsey. */
+static bool pushesConstant(Flow* flow, Chunk* chunk, int index, bool* falsey) {
+	Node* node = &flow->nodes[index];
+	uint8_t* code = chunk->code + node->offset;
+	switch (node->op) {
+		case OP_TRUE:	*falsey = false; return true;
+		case OP_FALSE:
+		case OP_NIL:	*falsey = true; return true;
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG: {
+			int constant = node->op == OP_CONSTANT ? code[1] : (code[1] << 16) | (code[2] << 8) | code[3];
+			Value value = chunk->constants.values[constant];
+			*falsey = IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+/* Rewrites a branch on a constant: one that's never taken disappears along
+ * with the constant and the OP_POP the compiler put after it, and one that's
+ * always taken becomes an OP_JUMP past the OP_POP at its target. The branch
+ * and that first OP_POP mustn't be jump targets themselves, or the value they
+ * see might not be the constant. */
+static bool foldCondition(Flow* flow, Chunk* chunk, int i) {
+	bool falsey;
+	if (!pushesConstant(flow, chunk, i, &falsey)) return false;
+	int branch = nextLive(flow, i);
+	if (branch >= flow->count) return false;
+	Node* jump = &flow->nodes[branch];
+	if (jump->op != OP_JUMP_IF_FALSE || jump->targeted) return false;
+
+	if (!falsey) {
+		int pop = nextLive(flow, branch);
+		jump->removed = true;
+		if (pop < flow->count && flow->nodes[pop].op == OP_POP && !flow->nodes[pop].targeted) {
+			flow->nodes[i].removed = true;
+			flow->nodes[pop].removed = true;
+		}
+		return true;
+	}
+
+	int target = skipRemoved(flow, jump->target);
+	jump->op = OP_JUMP;
+	if (target < flow->count && flow->nodes[target].op == OP_POP) {
+		flow->nodes[i].removed = true;
+		jump->target = target + 1;
+	}
+	return true;
+}
+
+/* Marks everything control can reach from the first instruction. */
+static void markReachable(Flow* flow, int* pending) {
+	for (int i = 0; i < flow->count; i++) flow->nodes[i].reached = false;
+	int pendingCount = 0;
+	int first = skipRemoved(flow, 0);
+	if (first < flow->count) {
+		flow->nodes[first].reached = true;
+		pending[pendingCount++] = first;
+	}
+
+	while (pendingCount > 0) {
+		int index = pending[--pendingCount];
+		Node* node = &flow->nodes[index];
+		int successors[2];
+		int successorCount = 0;
+		if (isBranch(node->op)) successors[successorCount++] = skipRemoved(flow, node->target);
+		if (node->op != OP_RETURN && !isUnconditional(node->op)) successors[successorCount++] = nextLive(flow, index);
+
+		for (int i = 0; i < successorCount; i++) {
+			int successor = successors[i];
+			if (successor >= flow->count || flow->nodes[successor].reached) continue;
+			flow->nodes[successor].reached = true;
+			pending[pendingCount++] = successor;
+		}
+	}
+}
+
+/* One round of every simplification. Returns whether anything changed. */
+static bool simplifyFlow(Flow* flow, Chunk* chunk, int* pending) {
+	bool changed = false;
+
+	for (int i = 0; i < flow->count; i++) flow->nodes[i].targeted = false;
+	for (int i = 0; i < flow->count; i++) {
+		Node* node = &flow->nodes[i];
+		if (node->removed || !isBranch(node->op)) continue;
+		int target = threadJump(flow, i);
+		if (target != skipRemoved(flow, node->target)) changed = true;
+		node->target = target;
+		if (isUnconditional(node->op)) node->op = target > i ? OP_JUMP : OP_LOOP;
+		if (target < flow->count) flow->nodes[target].targeted = true;
+	}
+
+	for (int i = 0; i < flow->count; i++) {
+		if (!flow->nodes[i].removed && foldCondition(flow, chunk, i)) changed = true;
+	}
+
+	markReachable(flow, pending);
+	for (int i = 0; i < flow->count; i++) {
+		Node* node = &flow->nodes[i];
+		if (node->removed) continue;
+		if (!node->reached ||
+			(node->op == OP_JUMP && skipRemoved(flow, node->target) == nextLive(flow, i))) {
+			node->removed = true;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+/* Runs on the compiler's output and again after fusion. It threads jumps
+ * that land on other jumps, like the OP_JUMP at the end of an if's
+ * then-branch inside a loop landing on the loop's OP_LOOP, and drops
+ * branches on constants such as while (true)'s. Then it drops whatever can
+ * no longer be reached and jumps to the very next instruction. Every
+ * instruction that survives keeps the source line it came from, so runtime
+ * errors still report the right one. */
+static void optimizeControlFlow(VM* vm, Chunk* chunk) {
+	int oldCount = chunk->count;
+	int* indexAt = ALLOCATE(vm, MEM_SCRATCH, int, oldCount + 1);
+	Flow flow;
+	flow.count = 0;
+	for (int offset = 0; offset < oldCount; offset += instructionLength(chunk->code[offset])) flow.count++;
+	flow.nodes = ALLOCATE(vm, MEM_SCRATCH, Node, flow.count);
+
+	int index = 0;
+	for (int offset = 0; offset < oldCount; offset += instructionLength(chunk->code[offset])) {
+		indexAt[offset] = index;
+		Node* node = &flow.nodes[index++];
+		node->offset = offset;
+		node->line = getLine(chunk, offset);
+		node->op = chunk->code[offset];
+		node->target = -1;
+		node->removed = false;
+	}
+	indexAt[oldCount] = flow.count;
+	for (int i = 0; i < flow.count; i++) {
+		if (isBranch(flow.nodes[i].op)) flow.nodes[i].target = indexAt[jumpTarget(chunk, flow.nodes[i].offset)];
+	}
+
+	int* pending = ALLOCATE(vm, MEM_SCRATCH, int, flow.count);
+	while (simplifyFlow(&flow, chunk, pending)) {}
+
+	/* Write out what's left. newOffsets reuses indexAt, now by index. */
+	Chunk out;
+	initChunk(&out);
+	int* newOffsets = indexAt;
+	for (int i = 0; i < flow.count; i++) {
+		Node* node = &flow.nodes[i];
+		newOffsets[i] = out.count;
+		if (node->removed) continue;
+
+		int length = instructionLength(node->op);
+		writeChunk(vm, &out, node->op, node->line);
+		for (int j = 1; j < length; j++) writeChunk(vm, &out, chunk->code[node->offset + j], node->line);
+	}
+	newOffsets[flow.count] = out.count;
+
+	/* A dropped target's offset is that of the next instruction kept. */
+	for (int i = 0; i < flow.count; i++) {
+		Node* node = &flow.nodes[i];
+		if (node->removed || !isBranch(node->op)) continue;
+		int operand = newOffsets[i] + 1;
+		int target = newOffsets[node->target];
+		int jump = node->op == OP_LOOP ? operand + 2 - target : target - (operand + 2);
+		out.code[operand] = (jump >> 8) & 0xff;
+		out.code[operand + 1] = jump & 0xff;
+	}
+
+	replaceCode(vm, chunk, &out);
+	FREE_ARRAY(vm, MEM_SCRATCH, int, pending, flow.count);
+	FREE_ARRAY(vm, MEM_SCRATCH, Node, flow.nodes, flow.count);
+	FREE_ARRAY(vm, MEM_SCRATCH, int, indexAt, oldCount + 1);
+}
+
+/* Tries to fuse the sequence starting at offset. Returns the offset just
+ * past what was consumed, or -1 if no pattern matched. */
+static int fuse(Optimizer* optimizer, int offset, int line) {
+	Chunk* chunk = optimizer->chunk;
+	uint8_t* code = chunk->code;
+
+	switch (code[offset]) {
+		case OP_GET_LOCAL:
+			// x = x + c; as a statement, e.g. the increment clause of a for loop.
+			if (interior(optimizer, offset + 2, OP_CONSTANT) &&
+				interior(optimizer, offset + 4, OP_ADD) &&
+				interior(optimizer, offset + 5, OP_SET_LOCAL) &&
+				code[offset + 6] == code[offset + 1] &&
+				interior(optimizer, offset + 7, OP_POP)) {
+				emit(optimizer, OP_ADD_LOCAL_CONSTANT, line);
+				emit(optimizer, code[offset + 1], line);
+				emit(optimizer, code[offset + 3], line);
+				return offset + 8;
+			}
+			// a + b with both operands in locals.
+			if (interior(optimizer, offset + 2, OP_GET_LOCAL) &&
+				interior(optimizer, offset + 4, OP_ADD)) {
+				emit(optimizer, OP_ADD_LOCALS, line);
+				emit(optimizer, code[offset + 1], line);
+				emit(optimizer, code[offset + 3], line);
+				return offset + 5;
+			}
+			return -1;
+
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS: {
+			// A comparison used directly as an if/while/for condition.
+			if (!interior(optimizer, offset + 1, OP_JUMP_IF_FALSE) ||
+				!popsOnBothPaths(optimizer, offset + 1)) {
+				return -1;
+			}
+			uint8_t fused = code[offset] == OP_EQUAL ? OP_JUMP_IF_NOT_EQUAL :
+							code[offset] == OP_GREATER ? OP_JUMP_IF_NOT_GREATER : OP_JUMP_IF_NOT_LESS;
+			emitJump(optimizer, fused, jumpTarget(chunk, offset + 1) + 1, line);
+			return offset + 5;
+		}
+
+		case OP_JUMP_IF_FALSE:
+			if (!popsOnBothPaths(optimizer, offset)) return -1;
+			emitJump(optimizer, OP_POP_JUMP_IF_FALSE, jumpTarget(chunk, offset) + 1, line);
+			return offset + 4;
+
+		default:
+			return -1;
+	}
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+	optimizeControlFlow(vm, chunk);
+
+	int oldCount = chunk->count;
+	Optimizer optimizer;
+	optimizer.vm = vm;
+	optimizer.chunk = chunk;
+	optimizer.fixups = NULL;
+	optimizer.fixupCount = 0;
+	optimizer.fixupCapacity = 0;
+	initChunk(&optimizer.out);
+
+	/* First find every offset control can enter by jumping. Nothing may be
+	 * fused into the middle of a sequence that some jump lands inside. The
+	 * instruction after a popping target counts too, since fused jumps go
+	 * there instead. */
+	optimizer.isTarget = ALLOCATE(vm, MEM_SCRATCH, bool, chunk->count + 1);
+	memset(optimizer.isTarget, 0, sizeof(bool) * (chunk->count + 1));
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+		if (!isJump(chunk->code[offset])) continue;
+		int target = jumpTarget(chunk, offset);
+		optimizer.isTarget[target] = true;
+		if (target < chunk->count && chunk->code[target] == OP_POP) optimizer.isTarget[target + 1] = true;
+	}
+
+	/* newOffsets maps each old instruction start to where it now begins. */
+	int* newOffsets = ALLOCATE(vm, MEM_SCRATCH, int, chunk->count + 1);
+	int offset = 0;
+	while (offset < chunk->count) {
+		newOffsets[offset] = optimizer.out.count;
+		int line = getLine(chunk, offset);
+
+		int next = fuse(&optimizer, offset, line);
+		if (next != -1) {
+			offset = next;
+			continue;
+		}
+
+		uint8_t instruction = chunk->code[offset];
+		if (isJump(instruction)) {
+			emitJump(&optimizer, instruction, jumpTarget(chunk, offset), line);
+			offset += 3;
+			continue;
+		}
+
+		int length = instructionLength(instruction);
+		for (int i = 0; i < length; i++) emit(&optimizer, chunk->code[offset + i], line);
+		offset += length;
+	}
+	newOffsets[chunk->count] = optimizer.out.count;
+
+	/* Every target is an instruction start that was never fused away, so
+	 * it has an entry in newOffsets. */
+	for (int i = 0; i < optimizer.fixupCount; i++) {
+		JumpFixup* fixup = &optimizer.fixups[i];
+		int target = newOffsets[fixup->target];
+		int jump = fixup->backward ? fixup->operand + 2 - target : target - (fixup->operand + 2);
+		optimizer.out.code[fixup->operand] = (jump >> 8) & 0xff;
+		optimizer.out.code[fixup->operand + 1] = jump & 0xff;
+	}
+
+	/* The code only ever shrinks, so every jump still fits in 16 bits. */
+	replaceCode(vm, chunk, &optimizer.out);
+
+	FREE_ARRAY(vm, MEM_SCRATCH, int, newOffsets, oldCount + 1);
+	FREE_ARRAY(vm, MEM_SCRATCH, bool, optimizer.isTarget, oldCount + 1);
+	FREE_ARRAY(vm, MEM_SCRATCH, JumpFixup, optimizer.fixups, optimizer.fixupCapacity);
+
+	/* Fused jumps skip the OP_POP at their target, which can leave it, and
+	 * an OP_JUMP over it, dead. */
+	optimizeControlFlow(vm, chunk);
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/output.h"
+
+size_t outputBufferSize = OUTPUT_BUFFER_SIZE;
+FlushPolicy outputFlushPolicy = FLUSH_WHEN_FULL;
+
+void initOutput(OutputBuffer* output) {
+	output->bytes = NULL;
+	output->length = 0;
+	output->lineEnd = 0;
+	output->capacity = 0;
+	output->policy = outputFlushPolicy;
+}
+
+void freeOutput(OutputBuffer* output) {
+	flushOutput(output);
+	free(output->bytes);
+	initOutput(output);
+}
+
+void flushOutput(OutputBuffer* output) {
+	if (output->length == 0 || output->policy == FLUSH_NEVER) return;
+	fwrite(output->bytes, 1, output->length, stdout);
+	fflush(stdout);
+	output->length = 0;
+	output->lineEnd = 0;
+}
+
+void clearOutput(OutputBuffer* output) {
+	output->length = 0;
+	output->lineEnd = 0;
+}
+
+/* FLUSH_NEVER's way of making room. */
+static void growOutput(OutputBuffer* output, size_t length) {
+	size_t capacity = output->capacity;
+	while (length > capacity - output->length) capacity *= 2;
+	char* bytes = (char*)realloc(output->bytes, capacity);
+	if (bytes == NULL) exit(1);
+	output->bytes = bytes;
+	output->capacity = capacity;
+}
+
+/* Sends the finished lines on and keeps the one in progress, so that output
+ * from different threads can only interleave between lines. */
+static void flushLines(OutputBuffer* output) {
+	if (output->lineEnd == 0) return;
+	fwrite(output->bytes, 1, output->lineEnd, stdout);
+	fflush(stdout);
+	output->length -= output->lineEnd;
+	memmove(output->bytes, output->bytes + output->lineEnd, output->length);
+	output->lineEnd = 0;
+}
+
+void writeOutput(OutputBuffer* output, const char* bytes, size_t length) {
+	if (output->bytes == NULL) {
+		output->capacity = outputBufferSize;
+		output->policy = outputFlushPolicy;
+		output->bytes = (char*)malloc(output->capacity);
+		if (output->bytes == NULL) exit(1);
+	}
+	if (output->policy == FLUSH_NEVER && length > output->capacity - output->length) growOutput(output, length);
+	if (length > output->capacity - output->length) flushLines(output);
+	if (length > output->capacity - output->length) {	/* a line longer than the buffer */
+		flushOutput(output);
+		if (length > output->capacity) {	/* too big to buffer, so it goes straight out */
+			fwrite(bytes, 1, length, stdout);
+			return;
+		}
+	}
+	memcpy(output->bytes + output->length, bytes, length);
+	output->length += length;
+}
+
+void writeLine(OutputBuffer* output) {
+	writeOutput(output, "\n", 1);
+	output->lineEnd = output->length;
+	if (output->policy == FLUSH_EVERY_LINE) flushOutput(output);
+}
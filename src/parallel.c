@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lib/parallel.h"
+#include "lib/vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define PARALLEL_THREADS	/* without pthreads, the workers take turns on the calling thread */
+#endif
+
+/* One worker's share of the jobs, as indices into the run's job numbers.
+ * The owner takes from the back and thieves from the front, so they only
+ * ever meet over the last job. The jobs are all known before any worker
+ * starts, so a queue only shrinks. */
+typedef struct {
+#ifdef PARALLEL_THREADS
+	pthread_mutex_t lock;
+#endif
+	int* jobs;
+	int head;	/* the next job a thief would take */
+	int tail;	/* one past the next job the owner would take */
+} JobQueue;
+
+typedef struct {
+	struct Runner* runner;
+	int id;
+	JobQueue queue;
+	int jobsRun;
+	int jobsStolen;
+	double busy;	/* seconds spent inside interpretChunk() */
+	bool failed;
+#ifdef PARALLEL_THREADS
+	pthread_t thread;
+#endif
+} Worker;
+
+typedef struct Runner {
+	VM* shared;
+	Chunk* chunks;
+	int chunkCount;
+	Worker* workers;
+	int workerCount;
+} Runner;
+
+static double now() {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void lockQueue(JobQueue* queue) {
+#ifdef PARALLEL_THREADS
+	pthread_mutex_lock(&queue->lock);
+#else
+	(void)queue;
+#endif
+}
+
+static void unlockQueue(JobQueue* queue) {
+#ifdef PARALLEL_THREADS
+	pthread_mutex_unlock(&queue->lock);
+#else
+	(void)queue;
+#endif
+}
+
+/* The next job for worker, its own if it has any left and otherwise one
+ * stolen from the first other worker that does. -1 once every queue is empty. */
+static int takeJob(Runner* runner, Worker* worker) {
+	JobQueue* own = &worker->queue;
+	lockQueue(own);
+	int job = own->head < own->tail ? own->jobs[--own->tail] : -1;
+	unlockQueue(own);
+	if (job != -1) return job;
+
+	for (int i = 1; i < runner->workerCount; i++) {
+		JobQueue* victim = &runner->workers[(worker->id + i) % runner->workerCount].queue;
+		lockQueue(victim);
+		if (victim->head < victim->tail) job = victim->jobs[victim->head++];
+		unlockQueue(victim);
+		if (job != -1) {
+			worker->jobsStolen++;
+			return job;
+		}
+	}
+	return -1;
+}
+
+static void* workerMain(void* argument) {
+	Worker* worker = (Worker*)argument;
+	Runner* runner = worker->runner;
+	VM vm;
+	initWorkerVM(&vm, runner->shared);
+
+	int job;
+	while ((job = takeJob(runner, worker)) != -1) {
+		for (int i = 0; i < vm.globalValues.count; i++) {	/* every run starts from a fresh set of globals */
+			vm.globalValues.values[i] = UNDEFINED_VAL;
+		}
+		resetStack(&vm);
+		double start = now();
+		if (interpretChunk(&vm, &runner->chunks[job % runner->chunkCount]) != INTERPRET_OK) {
+			worker->failed = true;
+		}
+		worker->busy += now() - start;
+		worker->jobsRun++;
+	}
+
+	freeVM(&vm);
+	return NULL;
+}
+
+bool runParallel(VM* shared, Chunk* chunks, int chunkCount, int repeat, int workers) {
+	int jobCount = chunkCount * repeat;
+	Runner runner;
+	runner.shared = shared;
+	runner.chunks = chunks;
+	runner.chunkCount = chunkCount;
+	runner.workerCount = workers;
+	runner.workers = (Worker*)calloc(workers, sizeof(Worker));	/* like the profiler, this is outside any VM's heap */
+	int* jobs = (int*)malloc(sizeof(int) * jobCount);
+	if (runner.workers == NULL || jobs == NULL) {
+		fprintf(stderr, "Not enough memory to run %d jobs.\n", jobCount);
+		exit(74);
+	}
+
+	/* Worker w gets jobs w, w + workers, w + 2 * workers and so on, kept
+	 * next to each other in jobs so its queue is one slice of the array. */
+	int next = 0;
+	for (int w = 0; w < workers; w++) {
+		Worker* worker = &runner.workers[w];
+		worker->runner = &runner;
+		worker->id = w;
+		worker->queue.jobs = jobs + next;
+		worker->queue.head = 0;
+		for (int job = w; job < jobCount; job += workers) jobs[next++] = job;
+		worker->queue.tail = (int)(jobs + next - worker->queue.jobs);
+#ifdef PARALLEL_THREADS
+		pthread_mutex_init(&worker->queue.lock, NULL);
+#endif
+	}
+
+	double start = now();
+#ifdef PARALLEL_THREADS
+	for (int w = 0; w < workers; w++) {
+		if (pthread_create(&runner.workers[w].thread, NULL, workerMain, &runner.workers[w]) != 0) {
+			fprintf(stderr, "Could not start worker %d.\n", w);
+			exit(74);
+		}
+	}
+	for (int w = 0; w < workers; w++) pthread_join(runner.workers[w].thread, NULL);
+#else
+	for (int w = 0; w < workers; w++) workerMain(&runner.workers[w]);
+#endif
+	double wall = now() - start;
+
+	fprintf(stderr, "parallel: %d scripts x %d, %d jobs on %d workers in %.3f ms, %.1f jobs/s\n",
+			chunkCount, repeat, jobCount, workers, wall * 1e3, jobCount / wall);
+	bool ok = true;
+	for (int w = 0; w < workers; w++) {
+		Worker* worker = &runner.workers[w];
+		fprintf(stderr, "  worker %-3d %6d jobs (%d stolen)  busy %10.3f ms  %5.1f%% utilized\n",
+				w, worker->jobsRun, worker->jobsStolen, worker->busy * 1e3, 100 * worker->busy / wall);
+		if (worker->failed) ok = false;
+#ifdef PARALLEL_THREADS
+		pthread_mutex_destroy(&worker->queue.lock);
+#endif
+	}
+
+	free(jobs);
+	free(runner.workers);
+	return ok;
+}
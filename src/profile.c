@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/debug.h"
+#include "lib/memory.h"
+#include "lib/profile.h"
+
+/* How many rows of the pair and line reports to print. */
+#define PROFILE_TOP 20
+
+Profiler profiler;
+
+void initProfiler() {
+	profiler.enabled = true;
+	profiler.previous = -1;
+	memset(profiler.opCounts, 0, sizeof(profiler.opCounts));
+	profiler.pairCounts = (uint64_t*)calloc(UINT8_COUNT * UINT8_COUNT, sizeof(uint64_t));
+	if (profiler.pairCounts == NULL) exit(1);
+	profiler.lineCounts = NULL;
+	profiler.lineCapacity = 0;
+}
+
+void freeProfiler() {
+	if (!profiler.enabled) return;
+	free(profiler.pairCounts);
+	free(profiler.lineCounts);
+	profiler.enabled = false;
+}
+
+void profileInstruction(Chunk* chunk, int offset) {
+	uint8_t instruction = chunk->code[offset];
+	profiler.opCounts[instruction]++;
+	if (profiler.previous != -1) {
+		profiler.pairCounts[profiler.previous * UINT8_COUNT + instruction]++;
+	}
+	profiler.previous = instruction;
+
+	int line = getLine(chunk, offset);
+	if (line >= profiler.lineCapacity) {	/* lines only grow, so double until this one fits */
+		int oldCapacity = profiler.lineCapacity;
+		int capacity = GROW_CAPACITY(oldCapacity);
+		while (capacity <= line) capacity *= 2;
+		profiler.lineCounts = (uint64_t*)realloc(profiler.lineCounts, sizeof(uint64_t) * capacity);
+		if (profiler.lineCounts == NULL) exit(1);
+		memset(profiler.lineCounts + oldCapacity, 0, sizeof(uint64_t) * (capacity - oldCapacity));
+		profiler.lineCapacity = capacity;
+	}
+	profiler.lineCounts[line]++;
+}
+
+/* One row of a report: what was counted and how often. */
+typedef struct {
+	int key;
+	uint64_t count;
+} ProfileRow;
+
+static int compareRows(const void* a, const void* b) {
+	uint64_t countA = ((const ProfileRow*)a)->count;
+	uint64_t countB = ((const ProfileRow*)b)->count;
+	if (countA != countB) return countA < countB ? 1 : -1;	/* descending */
+	return ((const ProfileRow*)a)->key - ((const ProfileRow*)b)->key;
+}
+
+/* Copies the non-zero counters into rows and sorts them, hottest first.
+ * Returns how many rows were filled. */
+static int collectRows(ProfileRow* rows, uint64_t* counts, int length) {
+	int count = 0;
+	for (int i = 0; i < length; i++) {
+		if (counts[i] == 0) continue;
+		rows[count].key = i;
+		rows[count].count = counts[i];
+		count++;
+	}
+	qsort(rows, count, sizeof(ProfileRow), compareRows);
+	return count;
+}
+
+uint64_t profiledInstructions() {
+	uint64_t total = 0;
+	for (int i = 0; i < UINT8_COUNT; i++) total += profiler.opCounts[i];
+	return total;
+}
+
+void printProfile() {
+	if (!profiler.enabled) return;
+
+	uint64_t total = profiledInstructions();
+	if (total == 0) total = 1;	/* avoid dividing by zero when nothing ran */
+
+	ProfileRow* rows = (ProfileRow*)malloc(sizeof(ProfileRow) * UINT8_COUNT * UINT8_COUNT);
+	if (rows == NULL) exit(1);
+
+	fprintf(stderr, "== opcodes ==\n");
+	int count = collectRows(rows, profiler.opCounts, UINT8_COUNT);
+	for (int i = 0; i < count; i++) {
+		fprintf(stderr, "%-20s %12llu %6.2f%%\n", opcodeName((uint8_t)rows[i].key),
+				(unsigned long long)rows[i].count, 100.0 * rows[i].count / total);
+	}
+
+	fprintf(stderr, "== opcode pairs ==\n");
+	count = collectRows(rows, profiler.pairCounts, UINT8_COUNT * UINT8_COUNT);
+	for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+		fprintf(stderr, "%-20s %-20s %12llu %6.2f%%\n",
+				opcodeName((uint8_t)(rows[i].key / UINT8_COUNT)),
+				opcodeName((uint8_t)(rows[i].key % UINT8_COUNT)),
+				(unsigned long long)rows[i].count, 100.0 * rows[i].count / total);
+	}
+
+	free(rows);
+
+	fprintf(stderr, "== lines ==\n");
+	rows = (ProfileRow*)malloc(sizeof(ProfileRow) * (profiler.lineCapacity + 1));
+	if (rows == NULL) exit(1);
+	count = collectRows(rows, profiler.lineCounts, profiler.lineCapacity);
+	for (int i = 0; i < count && i < PROFILE_TOP; i++) {
+		fprintf(stderr, "line %-8d %12llu %6.2f%%\n", rows[i].key,
+				(unsigned long long)rows[i].count, 100.0 * rows[i].count / total);
+	}
+	free(rows);
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/memory.h"
+#include "lib/sampler.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define SAMPLER_TIMER
+#endif
+
+Sampler sampler;
+
+#ifdef SAMPLER_TIMER
+/* All a signal handler can safely do is set a flag. run() polls it along
+ * with the --profile check it already makes before every instruction. */
+static void onTimer(int signal) {
+	(void)signal;
+	sampler.pending = 1;
+}
+
+static void setTimer(int hz) {
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = hz > 0 ? (hz >= 1000000 ? 1 : 1000000 / hz) : 0;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+bool startSampler(int hz, const char* path) {
+#ifdef SAMPLER_TIMER
+	sampler.enabled = true;
+	sampler.pending = 0;
+	sampler.path = path;
+	sampler.frames = NULL;
+	sampler.frameCount = 0;
+	sampler.frameCapacity = 0;
+	sampler.samples = NULL;
+	sampler.sampleCount = 0;
+	sampler.sampleCapacity = 0;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onTimer;
+	action.sa_flags = SA_RESTART;	/* so reads and writes carry on rather than fail with EINTR */
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+	setTimer(hz);
+	return true;
+#else
+	(void)hz;
+	(void)path;
+	fprintf(stderr, "--sample-profile needs a POSIX interval timer, which this platform lacks.\n");
+	return false;
+#endif
+}
+
+void takeSample(Chunk* chunk, const uint8_t* ip) {
+	sampler.pending = 0;
+
+	if (sampler.sampleCount + 1 > sampler.sampleCapacity) {
+		sampler.sampleCapacity = GROW_CAPACITY(sampler.sampleCapacity);
+		sampler.samples = (Sample*)realloc(sampler.samples, sizeof(Sample) * sampler.sampleCapacity);
+		if (sampler.samples == NULL) exit(1);
+	}
+	if (sampler.frameCount + 1 > sampler.frameCapacity) {
+		sampler.frameCapacity = GROW_CAPACITY(sampler.frameCapacity);
+		sampler.frames = (SampleFrame*)realloc(sampler.frames, sizeof(SampleFrame) * sampler.frameCapacity);
+		if (sampler.frames == NULL) exit(1);
+	}
+
+	/* The line is looked up now, while the chunk's still around to ask.
+	 * With call frames, this would push one frame per active call. */
+	Sample* sample = &sampler.samples[sampler.sampleCount++];
+	sample->firstFrame = sampler.frameCount;
+	sample->frameCount = 1;
+	SampleFrame* frame = &sampler.frames[sampler.frameCount++];
+	frame->function = "script";
+	frame->line = getLine(chunk, (int)(ip - chunk->code));
+}
+
+/* Orders samples frame by frame, so that equal stacks end up next to each
+ * other and come out sorted the way flamegraph tools expect. */
+static int compareSamples(const void* a, const void* b) {
+	const Sample* x = (const Sample*)a;
+	const Sample* y = (const Sample*)b;
+	for (int i = 0; i < x->frameCount && i < y->frameCount; i++) {
+		SampleFrame* frameX = &sampler.frames[x->firstFrame + i];
+		SampleFrame* frameY = &sampler.frames[y->firstFrame + i];
+		int names = strcmp(frameX->function, frameY->function);
+		if (names != 0) return names;
+		if (frameX->line != frameY->line) return frameX->line < frameY->line ? -1 : 1;
+	}
+	return x->frameCount - y->frameCount;
+}
+
+void writeSamples() {
+	if (!sampler.enabled) return;
+#ifdef SAMPLER_TIMER
+	setTimer(0);
+#endif
+
+	FILE* file = fopen(sampler.path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Could not write samples to \"%s\".\n", sampler.path);
+		return;
+	}
+
+	qsort(sampler.samples, sampler.sampleCount, sizeof(Sample), compareSamples);
+	for (int i = 0; i < sampler.sampleCount;) {
+		int same = i + 1;
+		while (same < sampler.sampleCount &&
+			   compareSamples(&sampler.samples[i], &sampler.samples[same]) == 0) {
+			same++;
+		}
+
+		Sample* sample = &sampler.samples[i];
+		for (int j = 0; j < sample->frameCount; j++) {
+			SampleFrame* frame = &sampler.frames[sample->firstFrame + j];
+			fprintf(file, "%s%s:%d", j == 0 ? "" : ";", frame->function, frame->line);
+		}
+		fprintf(file, " %d\n", same - i);
+		i = same;
+	}
+	fclose(file);
+	fprintf(stderr, "%d samples written to \"%s\".\n", sampler.sampleCount, sampler.path);
+}
+
+void freeSampler() {
+	if (!sampler.enabled) return;
+	free(sampler.frames);
+	free(sampler.samples);
+	sampler.enabled = false;
+}
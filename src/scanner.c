@@ -2,22 +2,32 @@
 #include <string.h>
 
 #include "lib/common.h"
+#include "lib/hash.h"
 #include "lib/scanner.h"
+#include "lib/simd.h"
 
-typedef struct {
-	const char *start;
-	const char *current;
-	int line;
-} Scanner;
-
-Scanner scanner;
+void initScanner(Scanner* scanner, const char *source) {
+	scanner->start = source;
+	scanner->current = source;
+	scanner->end = source + strlen(source);
+	scanner->line = 1;
+}
 
-void initScanner(const char *source) {
-	scanner.start = source;
-	scanner.current = source;
-	scanner.line = 1;
+/* The loops below that look at a whole SIMD_WIDTH block of source at a time
+ * only run while a block starting at current fits before the end of the
+ * source. Whatever is left over, and everything on targets without SIMD,
+ * goes through the one-character-at-a-time loops that follow them. */
+#ifdef SIMD_WIDTH
+static bool blockFits(Scanner* scanner) {
+	return scanner->end - scanner->current >= SIMD_WIDTH;
 }
 
+#define FULL_BLOCK ((uint32_t)((1u << SIMD_WIDTH) - 1))
+
+/* Bits below the lowest set bit of mask. */
+#define BITS_BEFORE(mask) (((mask) & -(mask)) - 1)
+#endif
+
 static bool isAlpha(char c) {
 	return (c >= 'a' && c <= 'z') ||
 			(c >= 'A' && c <= 'Z') ||
@@ -28,183 +38,254 @@ static bool isDigit(char c) {
 	return c >= '0' && c <= '9';
 }
 
-static bool isAtEnd() {
-	return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+	return *scanner->current == '\0';
 }
 
-static char advance() {
-	scanner.current++;
-	return scanner.current[-1];
+static char advance(Scanner* scanner) {
+	scanner->current++;
+	return scanner->current[-1];
 }
 
-static char peek() {	 /* we use peek() to check for the newline but not consume it. That way, the newline will be the current character on the */
-	return *scanner.current; /* next turn of the outer loop in skipWhitespace() and we'll recognize it and increment scanner.line. */
+static char peek(Scanner* scanner) {	 /* we use peek() to check for the newline but not consume it. That way, the newline will be the current character on the */
+	return *scanner->current; /* next turn of the outer loop in skipWhitespace() and we'll recognize it and increment scanner->line. */
 }
 
-static char peekNext() {	/* This is like peek() but for one character past the current one. If the current character and */
-	if (isAtEnd()) return '\0';	/* next one are both /, we consume them and then any other characters until the next newline */
-	return scanner.current[1];	/* or the end of the source code. */
+static char peekNext(Scanner* scanner) {	/* This is like peek() but for one character past the current one. If the current character and */
+	if (isAtEnd(scanner)) return '\0';	/* next one are both /, we consume them and then any other characters until the next newline */
+	return scanner->current[1];	/* or the end of the source code. */
 }
 
-static bool match(char expected) {
-	if (isAtEnd()) return false;
-	if (*scanner.current != expected) return false;
-	scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+	if (isAtEnd(scanner)) return false;
+	if (*scanner->current != expected) return false;
+	scanner->current++;
 	return true;
 }
 
 /* converts scanned characters or lexemes to a token */
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
 	Token token;
 	token.type = type;
-	token.start = scanner.start;
-	token.length = (int)(scanner.current - scanner.start);
-	token.line = scanner.line;
+	token.start = scanner->start;
+	token.length = (int)(scanner->current - scanner->start);
+	token.line = scanner->line;
+	token.hash = 0;
+	return token;
+}
+
+/* The compiler turns every identifier and string literal into an ObjString,
+ * so hash them now, while their bytes are still in cache, and interning
+ * never has to go over them again. */
+static Token hashedToken(Scanner* scanner, TokenType type, const char* chars, int length) {
+	Token token = makeToken(scanner, type);
+	token.hash = hashString(chars, length);
 	return token;
 }
 
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner* scanner, const char *message) {
 	Token token;
 	token.type = TOKEN_ERROR;
 	token.start = message;
 	token.length = (int)strlen(message);
-	token.line = scanner.line;
+	token.line = scanner->line;
+	token.hash = 0;
 	return token;
 }
 
-static void skipWhitespace() {
+/* Skips a run of whitespace a block at a time. Most gaps between tokens are a
+ * single space, which the scalar loop handles faster, so skipWhitespace()
+ * only calls this for indentation and other runs. */
+static void skipBlankRun(Scanner* scanner) {
+#ifdef SIMD_WIDTH
+	while (blockFits(scanner)) {
+		Bytes16 block = loadBytes(scanner->current);
+		uint32_t newlines = equalMask(block, '\n');
+		uint32_t other = ~(equalMask(block, ' ') | equalMask(block, '\t') |
+						   equalMask(block, '\r') | newlines) & FULL_BLOCK;
+		if (other == 0) {
+			scanner->line += countBits(newlines);
+			scanner->current += SIMD_WIDTH;
+			continue;
+		}
+		scanner->line += countBits(newlines & BITS_BEFORE(other));
+		scanner->current += lowestBit(other);
+		return;
+	}
+#endif
+}
+
+static void skipWhitespace(Scanner* scanner) {
 	for (;;) {
-		char c = peek();
+		char c = peek(scanner);
 		switch (c) {
+			case '\n':
+				scanner->line++;
+				/* fall through */
 			case ' ':
 			case '\r':
 			case '\t':
-				advance();
-				break;
-			case '\n':
-				scanner.line++;
-				advance();
+				advance(scanner);
+				if (peek(scanner) == ' ' || peek(scanner) == '\t') skipBlankRun(scanner);
 				break;
 			case '/':
-				if (peekNext() == '/') {
-					// A comment goes until the end of the line.
-					while (peek() != '\n' && !isAtEnd()) advance();
-			} else {
-				return;
-			}
+				if (peekNext(scanner) == '/') {
+					// A comment goes until the end of the line. memchr() is
+					// already vectorized in every libc worth using.
+					const char* newline = memchr(scanner->current, '\n', scanner->end - scanner->current);
+					scanner->current = newline != NULL ? newline : scanner->end;
+				} else {
+					return;
+				}
+				break;
 			default:
 				return;
 		}
 	}
 }
 
-static TokenType checkKeyword(int start, int length, const char * rest, TokenType type) {
-	if (scanner.current - scanner.start == start + length && 
-		memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char * rest, TokenType type) {
+	if (scanner->current - scanner->start == start + length && 
+		memcmp(scanner->start + start, rest, length) == 0) {
 		return type;
 	}
 
 	return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-	switch (scanner.start[0]) {
-		case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-		case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-		case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+static TokenType identifierType(Scanner* scanner) {
+	switch (scanner->start[0]) {
+		case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+		case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+		case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
 		case 'f': 
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-					case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-					case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-					case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+			if (scanner->current - scanner->start > 1) {
+				switch (scanner->start[1]) {
+					case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+					case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+					case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
 				}
 			}
 			break;
-		case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-		case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-		case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-		case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-		case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-		case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+		case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
+		case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+		case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+		case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+		case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+		case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
 		case 't': 
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-					case 'h': checkKeyword(2, 2, "is", TOKEN_THIS);
-					case 'r': checkKeyword(2, 2, "ue", TOKEN_TRUE);
+			if (scanner->current - scanner->start > 1) {
+				switch (scanner->start[1]) {
+					case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+					case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
 				}
 			}
 			break;
-		case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-		case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+		case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+		case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
 	}
 	return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-	while (isAlpha(peek()) || isDigit(peek())) advance();
-	return makeToken(identifierType());
+/* Keywords never become strings, so only real identifiers get a hash. */
+static Token identifierToken(Scanner* scanner) {
+	TokenType type = identifierType(scanner);
+	if (type != TOKEN_IDENTIFIER) return makeToken(scanner, type);
+	return hashedToken(scanner, type, scanner->start, (int)(scanner->current - scanner->start));
+}
+
+static Token identifier(Scanner* scanner) {
+#ifdef SIMD_WIDTH
+	while (blockFits(scanner)) {
+		Bytes16 block = loadBytes(scanner->current);
+		uint32_t other = ~(rangeMask(block, 'a', 'z') | rangeMask(block, 'A', 'Z') |
+						   rangeMask(block, '0', '9') | equalMask(block, '_')) & FULL_BLOCK;
+		if (other != 0) {
+			scanner->current += lowestBit(other);
+			return identifierToken(scanner);
+		}
+		scanner->current += SIMD_WIDTH;
+	}
+#endif
+	while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+	return identifierToken(scanner);
 }
 
-static Token number() {
-	while (isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+	while (isDigit(peek(scanner))) advance(scanner);
 
 	// Look for a fractional part.
-	if (peek() == '.' && isDigit(peekNext())) {
+	if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
 		// Consume the ".".
-		advance();
+		advance(scanner);
 
-		while (isDigit(peek())) advance();
+		while (isDigit(peek(scanner))) advance(scanner);
 	}
 
-	return makeToken(TOKEN_NUMBER);
+	return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-	while (peek() != '"' && !isAtEnd()) {
-		if (peek() == '\n') scanner.line++;
-		advance();
+static Token string(Scanner* scanner) {
+#ifdef SIMD_WIDTH
+	while (blockFits(scanner)) {
+		Bytes16 block = loadBytes(scanner->current);
+		uint32_t quotes = equalMask(block, '"');
+		uint32_t newlines = equalMask(block, '\n');
+		if (quotes != 0) {
+			scanner->line += countBits(newlines & BITS_BEFORE(quotes));
+			scanner->current += lowestBit(quotes);
+			break;
+		}
+		scanner->line += countBits(newlines);
+		scanner->current += SIMD_WIDTH;
+	}
+#endif
+	while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+		if (peek(scanner) == '\n') scanner->line++;
+		advance(scanner);
 	}
 
-	if (isAtEnd()) return errorToken("Unterminated string.");
+	if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
 	// The closing quote.
-	advance();
-	return makeToken(TOKEN_STRING);
+	advance(scanner);
+	return hashedToken(scanner, TOKEN_STRING, scanner->start + 1, (int)(scanner->current - scanner->start) - 2);
 }
 
-Token scanToken() {
-	skipWhitespace();
-	scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+	skipWhitespace(scanner);
+	scanner->start = scanner->current;
 
 	/* if the null byte is not reached then skip */
-	if (isAtEnd()) return makeToken(TOKEN_EOF);
+	if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-	char c = advance();
-	if (isAlpha(c)) return identifier();
-	if (isDigit(c)) return number();
+	char c = advance(scanner);
+	if (isAlpha(c)) return identifier(scanner);
+	if (isDigit(c)) return number(scanner);
 
 	switch (c) {
 		// One character lexemes
-		case '(': return makeToken(TOKEN_LEFT_PAREN);
-		case ')': return makeToken(TOKEN_RIGHT_PAREN);
-		case '{': return makeToken(TOKEN_LEFT_BRACE);
-		case '}': return makeToken(TOKEN_RIGHT_BRACE);
-		case ';': return makeToken(TOKEN_SEMICOLON);
-		case ',': return makeToken(TOKEN_COMMA);
-		case '.': return makeToken(TOKEN_DOT);
-		case '-': return makeToken(TOKEN_MINUS);
-		case '+': return makeToken(TOKEN_PLUS);
-		case '/': return makeToken(TOKEN_SLASH);
-		case '*': return makeToken(TOKEN_STAR);
+		case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+		case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+		case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+		case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+		case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+		case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+		case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+		case ',': return makeToken(scanner, TOKEN_COMMA);
+		case '.': return makeToken(scanner, TOKEN_DOT);
+		case '-': return makeToken(scanner, TOKEN_MINUS);
+		case '+': return makeToken(scanner, TOKEN_PLUS);
+		case '/': return makeToken(scanner, TOKEN_SLASH);
+		case '*': return makeToken(scanner, TOKEN_STAR);
 		// two-character lexemes
-		case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-		case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-		case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-		case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+		case '!': return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+		case '=': return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+		case '<': return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+		case '>': return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 		// Literal tokens
-		case '"': return string();
+		case '"': return string(scanner);
 	}
 
-	return errorToken("Unexpected character.");
+	return errorToken(scanner, "Unexpected character.");
 }
@@ -0,0 +1,305 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/compiler.h"
+#include "lib/memory.h"
+#include "lib/output.h"
+#include "lib/session.h"
+#include "lib/source.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define SESSION_IO
+#endif
+
+#define SESSION_READ_SIZE (64 * 1024)	/* the least read() is asked for at a time */
+#define SESSION_BATCH_BYTES (64 * 1024)	/* responses are sent early once this many are waiting */
+#define SESSION_MAX_HEADER 20	/* digits and all, more than any valid length needs */
+#define SESSION_MAX_MESSAGE (INT_MAX - 1)	/* the scanner and compiler count in ints */
+/* Messages that each bring new literals would grow the constants forever.
+ * Past this many the chunk starts over with none. */
+#define SESSION_MAX_CONSTANTS (1 << 16)
+
+#ifdef SESSION_IO
+/* A growable run of bytes from the system allocator, like OutputBuffer's. */
+typedef struct {
+	char* bytes;
+	size_t length;
+	size_t capacity;
+} Bytes;
+
+typedef struct {
+	VM* vm;
+	Chunk chunk;	/* every message's code, see the header */
+	int in;
+	int out;
+	Bytes input;	/* what has been read and not handled yet starts at inputStart */
+	size_t inputStart;
+	size_t pendingFrame;	/* the length of the frame at inputStart, once its header is in */
+	Bytes responses;	/* waiting to be written */
+} Session;
+
+static void reserveBytes(Bytes* bytes, size_t length) {
+	if (length <= bytes->capacity) return;
+	size_t capacity = bytes->capacity < SESSION_READ_SIZE ? SESSION_READ_SIZE : bytes->capacity;
+	while (capacity < length) capacity *= 2;
+	char* grown = (char*)realloc(bytes->bytes, capacity);
+	if (grown == NULL) exit(1);
+	bytes->bytes = grown;
+	bytes->capacity = capacity;
+}
+
+static void appendBytes(Bytes* bytes, const char* chars, size_t length) {
+	if (length == 0) return;	/* chars may be NULL, such as an output buffer nothing was printed to */
+	reserveBytes(bytes, bytes->length + length);
+	memcpy(bytes->bytes + bytes->length, chars, length);
+	bytes->length += length;
+}
+
+static bool writeAll(int fd, const char* bytes, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		bytes += written;
+		length -= (size_t)written;
+	}
+	return true;
+}
+
+static bool sendResponses(Session* session) {
+	bool sent = writeAll(session->out, session->responses.bytes, session->responses.length);
+	session->responses.length = 0;
+	return sent;
+}
+
+static void respond(Session* session, const char* status, const char* output, size_t length) {
+	char header[64];
+	int headerLength = snprintf(header, sizeof(header), "%s %zu\n", status, length);
+	appendBytes(&session->responses, header, (size_t)headerLength);
+	appendBytes(&session->responses, output, length);
+}
+
+/* Compiles and runs one message. source ends in the '\0' the scanner needs. */
+static InterpretResult runMessage(Session* session, const char* source) {
+	VM* vm = session->vm;
+	if (session->chunk.constants.count > SESSION_MAX_CONSTANTS) {
+		/* The old constants have mostly been promoted by now, so only a major
+		 * collection gets them back. Waiting for the heap to double would
+		 * let the intern table grow with them, and the heap with it. */
+		resetChunkConstants(vm, &session->chunk);
+		collectGarbage(vm, true);
+	} else {
+		resetChunkCode(vm, &session->chunk);
+	}
+	InterpretResult result = INTERPRET_COMPILE_ERROR;
+	if (compile(vm, source, &session->chunk)) result = interpretChunk(vm, &session->chunk);
+	/* Messages that only allocate while compiling never reach a collection otherwise. */
+	collectIfNeeded(vm);
+	return result;
+}
+
+static void handleMessage(Session* session, char* source, size_t length) {
+	/* Borrow the byte after the message, the next one's first, for the '\0'
+	 * instead of copying it out. There always is one, see readInput(). */
+	char next = source[length];
+	source[length] = '\0';
+	InterpretResult result = runMessage(session, source);
+	source[length] = next;
+
+	static const char* statuses[] = {
+		[INTERPRET_OK] = "ok",
+		[INTERPRET_COMPILE_ERROR] = "compile-error",
+		[INTERPRET_RUNTIME_ERROR] = "runtime-error",
+	};
+	OutputBuffer* output = &session->vm->output;
+	respond(session, statuses[result], output->bytes, output->length);
+	clearOutput(output);
+}
+
+typedef enum {
+	FRAME_READY,
+	FRAME_INCOMPLETE,	/* wait for more input */
+	FRAME_MALFORMED,
+} FrameStatus;
+
+/* Looks for a whole message at the start of the unhandled input. */
+static FrameStatus nextFrame(Session* session, char** source, size_t* length) {
+	char* start = session->input.bytes + session->inputStart;
+	size_t available = session->input.length - session->inputStart;
+	if (available == 0) return FRAME_INCOMPLETE;
+	char* newline = (char*)memchr(start, '\n', available < SESSION_MAX_HEADER ? available : SESSION_MAX_HEADER);
+	if (newline == NULL) return available < SESSION_MAX_HEADER ? FRAME_INCOMPLETE : FRAME_MALFORMED;
+	if (newline == start) return FRAME_MALFORMED;
+
+	size_t messageLength = 0;
+	for (char* c = start; c < newline; c++) {
+		if (*c < '0' || *c > '9') return FRAME_MALFORMED;
+		messageLength = messageLength * 10 + (size_t)(*c - '0');
+		if (messageLength > SESSION_MAX_MESSAGE) return FRAME_MALFORMED;
+	}
+
+	size_t frameLength = (size_t)(newline + 1 - start) + messageLength;
+	if (frameLength > available) {
+		session->pendingFrame = frameLength;
+		return FRAME_INCOMPLETE;
+	}
+	*source = session->input.bytes + session->inputStart + (newline + 1 - start);
+	*length = messageLength;
+	session->inputStart += frameLength;
+	session->pendingFrame = 0;
+	return FRAME_READY;
+}
+
+/* Moves the unhandled input to the front and reads after it. Returns false
+ * at the end of the input or on an error. */
+static bool readInput(Session* session) {
+	Bytes* input = &session->input;
+	size_t unhandled = input->length - session->inputStart;
+	if (session->inputStart > 0) memmove(input->bytes, input->bytes + session->inputStart, unhandled);
+	input->length = unhandled;
+	session->inputStart = 0;
+
+	/* Room for all of a frame whose header is in, so one read() can bring
+	 * in the rest. The + 1 keeps a byte spare past the end for
+	 * handleMessage()'s '\0'. */
+	size_t wanted = input->length + SESSION_READ_SIZE;
+	if (session->pendingFrame > wanted) wanted = session->pendingFrame;
+	reserveBytes(input, wanted + 1);
+	for (;;) {
+		ssize_t count = read(session->in, input->bytes + input->length, input->capacity - input->length - 1);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		input->length += (size_t)count;
+		return true;
+	}
+}
+
+/* Serves one input until it ends. Returns false if it broke off. */
+static bool serve(Session* session) {
+	session->input.length = 0;
+	session->inputStart = 0;
+	session->pendingFrame = 0;
+	session->responses.length = 0;
+	for (;;) {
+		char* source;
+		size_t length;
+		FrameStatus status;
+		while ((status = nextFrame(session, &source, &length)) == FRAME_READY) {
+			handleMessage(session, source, length);
+			if (session->responses.length >= SESSION_BATCH_BYTES && !sendResponses(session)) return false;
+		}
+
+		if (status == FRAME_MALFORMED) {
+			respond(session, "protocol-error", "", 0);
+			sendResponses(session);
+			fprintf(stderr, "Malformed message length, closing the session.\n");
+			return false;
+		}
+		/* Everything that has arrived is handled, so answer before waiting. */
+		if (session->responses.length > 0 && !sendResponses(session)) return false;
+		if (!readInput(session)) break;
+	}
+
+	if (session->input.length > session->inputStart) {
+		fprintf(stderr, "Input ended in the middle of a message.\n");
+		return false;
+	}
+	return true;
+}
+
+static void initSession(Session* session, VM* vm) {
+	session->vm = vm;
+	initChunk(&session->chunk);
+	session->input = (Bytes){NULL, 0, 0};
+	session->inputStart = 0;
+	session->pendingFrame = 0;
+	session->responses = (Bytes){NULL, 0, 0};
+
+	borrowStrings = false;	/* the input buffer is reused */
+	outputFlushPolicy = FLUSH_NEVER;
+	flushOutput(&vm->output);
+	vm->output.policy = FLUSH_NEVER;
+	signal(SIGPIPE, SIG_IGN);	/* a client that goes away is a failed write(), not the end of clox */
+}
+
+static void freeSession(Session* session) {
+	freeChunk(session->vm, &session->chunk);
+	free(session->input.bytes);
+	free(session->responses.bytes);
+}
+
+bool serveSession(VM* vm) {
+	Session session;
+	initSession(&session, vm);
+	session.in = STDIN_FILENO;
+	session.out = STDOUT_FILENO;
+	bool ok = serve(&session);
+	freeSession(&session);
+	return ok;
+}
+
+bool serveSessionSocket(VM* vm, const char* path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+		return false;
+	}
+	strcpy(address.sun_path, path);
+
+	/* A socket left behind by an earlier session would fail the bind(), but
+	 * anything else at path is not ours to remove. */
+	struct stat status;
+	if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 8) < 0) {
+		fprintf(stderr, "Could not listen on \"%s\": %s.\n", path, strerror(errno));
+		if (listener >= 0) close(listener);
+		return false;
+	}
+
+	Session session;
+	initSession(&session, vm);
+	for (;;) {
+		int connection = accept(listener, NULL, NULL);
+		if (connection < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not accept a connection on \"%s\": %s.\n", path, strerror(errno));
+			break;
+		}
+		session.in = connection;
+		session.out = connection;
+		serve(&session);	/* a broken connection only ends itself */
+		close(connection);
+	}
+	freeSession(&session);
+	close(listener);
+	unlink(path);
+	return false;
+}
+#else
+bool serveSession(VM* vm) {
+	(void)vm;
+	fprintf(stderr, "--session isn't supported on this platform.\n");
+	return false;
+}
+
+bool serveSessionSocket(VM* vm, const char* path) {
+	(void)vm;
+	(void)path;
+	fprintf(stderr, "--session-socket isn't supported on this platform.\n");
+	return false;
+}
+#endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SOURCE_MMAP
+#endif
+
+#include "lib/source.h"
+#include "lib/vm.h"
+
+bool borrowStrings = false;
+
+#ifdef SOURCE_MMAP
+/* The scanner needs a '\0' after the last character, and a file mapping
+ * can't provide one past the end of the file. So reserve one byte more than
+ * the file as anonymous, zero-filled memory and map the file over the start
+ * of it. The rest of the file's last page reads as zeros too, so the byte
+ * after the last character is zero whether or not the file ends on a page
+ * boundary. */
+static bool mapSource(int fd, size_t length, SourceFile* file) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (length + 1 + page - 1) / page * page;
+	void* memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (memory == MAP_FAILED) return false;
+	if (length > 0 &&
+		mmap(memory, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(memory, size);
+		return false;
+	}
+	madvise(memory, length, MADV_SEQUENTIAL);	/* the scanner reads it front to back once */
+
+	file->chars = (const char*)memory;
+	file->length = length;
+	file->memory = memory;
+	file->size = size;
+	file->mapped = true;
+	return true;
+}
+#endif
+
+bool openSource(const char* path, SourceFile* file) {
+	FILE* stream = fopen(path, "rb");
+	if (stream == NULL) {	/* If the user doesn't have permission or a wrong path/to/file is provided */
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+
+	fseek(stream, 0L, SEEK_END);
+	size_t length = ftell(stream);
+	rewind(stream);
+
+#ifdef SOURCE_MMAP
+	if (mapSource(fileno(stream), length, file)) {
+		fclose(stream);	/* the mapping stays valid without the descriptor */
+		return true;
+	}
+#endif
+
+	/* No mmap, or it failed: read the whole file into a buffer. */
+	char* buffer = (char*)malloc(length + 1);	/* we add 1 for the null byte */
+	if (buffer == NULL) {	/* If there is not enough memory and we failed to read the Lox script*/
+		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+		fclose(stream);
+		return false;
+	}
+	size_t bytesRead = fread(buffer, sizeof(char), length, stream);
+	fclose(stream);
+	if (bytesRead < length) {
+		fprintf(stderr, "Could not read file \"%s\".\n", path);
+		free(buffer);
+		return false;
+	}
+	buffer[bytesRead] = '\0';
+
+	file->chars = buffer;
+	file->length = length;
+	file->memory = buffer;
+	file->size = length + 1;
+	file->mapped = false;
+	return true;
+}
+
+void closeSource(SourceFile* file) {
+#ifdef SOURCE_MMAP
+	if (file->mapped) {
+		munmap(file->memory, file->size);
+		return;
+	}
+#endif
+	free(file->memory);
+}
+
+void keepSource(VM* vm, SourceFile* file) {
+	if (vm->keptCount + 1 > vm->keptCapacity) {
+		vm->keptCapacity = vm->keptCapacity < 4 ? 4 : vm->keptCapacity * 2;
+		vm->keptSources = (SourceFile*)realloc(vm->keptSources, sizeof(SourceFile) * vm->keptCapacity);
+		if (vm->keptSources == NULL) exit(1);
+	}
+	vm->keptSources[vm->keptCount++] = *file;
+}
+
+void closeKeptSources(VM* vm) {
+	for (int i = 0; i < vm->keptCount; i++) {
+		closeSource(&vm->keptSources[i]);
+	}
+	free(vm->keptSources);
+	vm->keptSources = NULL;
+	vm->keptCount = 0;
+	vm->keptCapacity = 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+
+#include "lib/memory.h"
+#include "lib/stats.h"
+#include "lib/table.h"
+#include "lib/vm.h"
+
+bool memoryReport = false;
+const char* memoryReportPath = NULL;
+
+/* Live entries over capacity, the same ratio TABLE_MAX_LOAD caps, except
+ * that tableSet() counts tombstones against it too. */
+static double loadFactor(const TableStats* stats) {
+	return stats->capacity == 0 ? 0.0 : (double)stats->live / stats->capacity;
+}
+
+static void printTable(const char* name, Table* table) {
+	TableStats stats;
+	tableStats(table, &stats);
+	fprintf(stderr, "%-16s %8d live %8d tombstones %8d slots  load %.3f\n", name,
+			stats.live, stats.tombstones, stats.capacity, loadFactor(&stats));
+	for (int i = 0; i < TABLE_PROBE_BUCKETS; i++) {
+		if (stats.probes[i] == 0) continue;
+		fprintf(stderr, "  %s%d group%s %8d  %6.2f%%\n", i + 1 == TABLE_PROBE_BUCKETS ? ">=" : "  ",
+				i + 1, i == 0 ? " " : "s", stats.probes[i], 100.0 * stats.probes[i] / stats.live);
+	}
+}
+
+static void printMemory(VM* vm) {
+	MemoryStats* memory = &vm->memoryStats;
+	fprintf(stderr, "== memory ==\n");
+	fprintf(stderr, "%-16s %12s %12s %12s %12s\n", "kind", "live", "peak", "allocations", "frees");
+	for (int kind = 0; kind < MEM_KIND_COUNT; kind++) {
+		MemoryUsage* usage = &memory->kinds[kind];
+		if (usage->allocations == 0) continue;
+		fprintf(stderr, "%-16s %12zu %12zu %12llu %12llu\n", memoryKindName((MemoryKind)kind),
+				usage->live, usage->peak,
+				(unsigned long long)usage->allocations, (unsigned long long)usage->frees);
+	}
+	fprintf(stderr, "%-16s %12zu %12zu\n", "total", memory->live, memory->peak);
+
+	AllocationStats* allocator = &vm->allocationStats;
+	fprintf(stderr, "allocator: %llu malloc, %llu free, %llu from pools, %llu from the arena, %llu collections\n",
+			(unsigned long long)allocator->systemAllocations, (unsigned long long)allocator->systemFrees,
+			(unsigned long long)allocator->poolAllocations, (unsigned long long)allocator->arenaAllocations,
+			(unsigned long long)allocator->collections);
+	fprintf(stderr, "value stack: %d slots\n", vm->stackCapacity);
+
+	fprintf(stderr, "== tables ==\n");
+	printTable("strings", &vm->strings);
+	printTable("globals", &vm->globalNames);
+}
+
+static void writeTable(FILE* file, const char* name, Table* table) {
+	TableStats stats;
+	tableStats(table, &stats);
+	fprintf(file, "\"%s\":{\"live\":%d,\"tombstones\":%d,\"capacity\":%d,\"load\":%.6f,\"probes\":[",
+			name, stats.live, stats.tombstones, stats.capacity, loadFactor(&stats));
+	for (int i = 0; i < TABLE_PROBE_BUCKETS; i++) {
+		fprintf(file, "%s%d", i == 0 ? "" : ",", stats.probes[i]);
+	}
+	fprintf(file, "]}");
+}
+
+static void writeMemory(VM* vm, const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Could not write memory stats to \"%s\".\n", path);
+		return;
+	}
+
+	MemoryStats* memory = &vm->memoryStats;
+	fprintf(file, "{\"kinds\":{");
+	for (int kind = 0; kind < MEM_KIND_COUNT; kind++) {
+		MemoryUsage* usage = &memory->kinds[kind];
+		fprintf(file, "%s\"%s\":{\"live\":%zu,\"peak\":%zu,\"allocations\":%llu,\"frees\":%llu}",
+				kind == 0 ? "" : ",", memoryKindName((MemoryKind)kind), usage->live, usage->peak,
+				(unsigned long long)usage->allocations, (unsigned long long)usage->frees);
+	}
+	fprintf(file, "},\"live\":%zu,\"peak\":%zu,", memory->live, memory->peak);
+
+	AllocationStats* allocator = &vm->allocationStats;
+	fprintf(file, "\"allocator\":{\"systemAllocations\":%llu,\"systemFrees\":%llu,"
+			"\"poolAllocations\":%llu,\"arenaAllocations\":%llu,\"collections\":%llu},",
+			(unsigned long long)allocator->systemAllocations, (unsigned long long)allocator->systemFrees,
+			(unsigned long long)allocator->poolAllocations, (unsigned long long)allocator->arenaAllocations,
+			(unsigned long long)allocator->collections);
+	fprintf(file, "\"stackCapacity\":%d,\"tables\":{", vm->stackCapacity);
+	writeTable(file, "strings", &vm->strings);
+	fprintf(file, ",");
+	writeTable(file, "globals", &vm->globalNames);
+	fprintf(file, "}}\n");
+	fclose(file);
+}
+
+void reportMemory(VM* vm) {
+	if (memoryReport) printMemory(vm);
+	if (memoryReportPath != NULL) writeMemory(vm, memoryReportPath);
+}
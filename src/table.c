@@ -3,47 +3,106 @@
 
 #include "lib/memory.h"
 #include "lib/object.h"
+#include "lib/simd.h"
 #include "lib/table.h"
 #include "lib/value.h"
+#include "lib/vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
+/* The table is split into groups of TABLE_GROUP_SIZE slots. A hash picks its
+ * starting group with its low bits (capacity is a power of two, so that's a
+ * mask instead of a division) and its seven-bit tag with its high bits.
+ * Probing moves group by group; inside a group every control byte is
+ * compared against the tag at once, and only the entries whose tag matched
+ * get looked at. */
+#define HASH_TAG(hash) ((uint8_t)((hash) >> 25))
+
+/* One bit per slot in a group, bit i for slot i. */
+typedef uint32_t GroupMask;
+
+#ifdef SIMD_WIDTH
+
+static GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+	return equalMask(loadBytes(group), byte);
+}
+
+/* Empty and deleted are the only states with the high bit set. */
+static GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+	return highBitMask(loadBytes(group));
+}
+
+#else
+
+static GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+	GroupMask mask = 0;
+	for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+		if (group[i] == byte) mask |= (GroupMask)1 << i;
+	}
+	return mask;
+}
+
+static GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+	GroupMask mask = 0;
+	for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+		if (group[i] & 0x80) mask |= (GroupMask)1 << i;
+	}
+	return mask;
+}
+
+#endif
+
+/* vm->strings is accounted apart from every other table, see --mem-stats. */
+static MemoryKind tableMemory(VM* vm, Table* table) {
+	return table == &vm->strings ? MEM_INTERN_TABLE : MEM_TABLE;
+}
+
 /* a function to initialize the parts of the table, setting count and capacity initially to 0
  * and entries to NULL, which denotes that they are empty for starter. */
 void initTable(Table* table) {
 	table->count = 0;
 	table->capacity = 0;
 	table->entries = NULL;
+	table->control = NULL;
 }
 
-void freeTable(Table* table) {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+	FREE_ARRAY(vm, tableMemory(vm, table), Entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, tableMemory(vm, table), uint8_t, table->control, table->capacity);
 	initTable(table);
 }
 
-/* real core of the hash table. Responsible for taking a key and array of buckets,
- * and figuring out which bucket the entry belongs in. This function is also
- * where linear probing and collision handling come into play.*/
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-	uint32_t index = key->hash % capacity;
-	Entry* tombstone = NULL;	/* the first time we pass a tombstone, we store it in this local variable.*/
+/* real core of the hash table. Walks the groups starting at the key's home
+ * group and returns the index of the slot holding key, or -1 once a group
+ * with an empty slot proves the key was never inserted further along. */
+static int findSlot(Table* table, ObjString* key) {
+	uint32_t groupMask = (uint32_t)(table->capacity / TABLE_GROUP_SIZE) - 1;
+	uint32_t group = key->hash & groupMask;
+	uint8_t tag = HASH_TAG(key->hash);
 
 	for (;;) {
-		Entry* entry = &entries[index];
-		if (entry->key == NULL) {
-			if (IS_NIL(entry->value)) {
-				// Empty entry.
-				return tombstone != NULL ? tombstone : entry;
-			} else {
-				// We found a tombstone
-				if (tombstone == NULL) tombstone = entry;
-			}
-		} else if (entry->key == key) {
-			// We found the key.
-			return entry;
+		const uint8_t* control = &table->control[group * TABLE_GROUP_SIZE];
+		for (GroupMask matches = matchByte(control, tag); matches != 0; matches &= matches - 1) {
+			int slot = (int)(group * TABLE_GROUP_SIZE) + lowestBit(matches);
+			if (table->entries[slot].key == key) return slot;
 		}
+		if (matchByte(control, CONTROL_EMPTY) != 0) return -1;
 
-		index = (index + 1) % capacity;
+		group = (group + 1) & groupMask;
+	}
+}
+
+/* The first slot along key's probe sequence that is free to take a new
+ * entry, which reuses the first tombstone we pass. */
+static int findFreeSlot(Table* table, uint32_t hash) {
+	uint32_t groupMask = (uint32_t)(table->capacity / TABLE_GROUP_SIZE) - 1;
+	uint32_t group = hash & groupMask;
+
+	for (;;) {
+		GroupMask free = matchEmptyOrDeleted(&table->control[group * TABLE_GROUP_SIZE]);
+		if (free != 0) return (int)(group * TABLE_GROUP_SIZE) + lowestBit(free);
+
+		group = (group + 1) & groupMask;
 	}
 }
 
@@ -51,97 +110,141 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
 bool tableGet(Table* table, ObjString* key, Value* value) {
 	if (table->count == 0) return false;	/* If the table is empty, we won't find the entry, so we check that first.*/
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);	/*findEntry does the job for finding a entry and it's key*/
-	if (entry->key == NULL) return false;
+	int slot = findSlot(table, key);
+	if (slot == -1) return false;
 
-	*value = entry->value;
+	*value = table->entries[slot].value;
 	return true;
 }
 
 /* A function responsible for Allocating and rezising array of buckets*/
-static void adjustCapacity(Table* table, int capacity) {
-	Entry* entries = ALLOCATE(Entry, capacity);
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+	Table resized;
+	resized.count = 0;
+	resized.capacity = capacity;
+	resized.entries = ALLOCATE(vm, tableMemory(vm, table), Entry, capacity);
+	resized.control = ALLOCATE(vm, tableMemory(vm, table), uint8_t, capacity);
+	memset(resized.control, CONTROL_EMPTY, capacity);
 	for (int i = 0; i < capacity; i++) {
-		entries[i].key = NULL;
-		entries[i].value = NIL_VAL;
+		resized.entries[i].key = NULL;
+		resized.entries[i].value = NIL_VAL;
 	}
 
-	/* walk through the old array front to back. when found a non-empty bucket,
-	 * we insert that into the new array. use findEntry(), passing in the new
-	 * array instead of the one currently stored in the Table.*/
-	table->count = 0;	/* We recalculate the count since it may change during a resize.*/
+	/* Only live entries move over, so the tombstones are dropped and the
+	 * count is recalculated. */
 	for (int i = 0; i < table->capacity; i++) {
-		Entry* entry = &table->entries[i];	/* store the address of per entries in a Entry pointer*/
-		if (entry->key == NULL) continue;	/* if the key of that entry pointer points to is NULL then it is empty, we move to the next entry.*/
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
 
-		Entry* dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
-		table->count++;	/* Then each time we find a non-tombstone entry, we increment it.*/
+		int slot = findFreeSlot(&resized, entry->key->hash);
+		resized.control[slot] = HASH_TAG(entry->key->hash);
+		resized.entries[slot] = *entry;
+		resized.count++;
 	}
 
-	/* After rebuilding the table, transferring all entries to the new array, we free the memory allocated for the old array.*/
-	FREE_ARRAY(Entry, table->entries, table->capacity);
-	table->entries = entries;
-	table->capacity = capacity;
+	FREE_ARRAY(vm, tableMemory(vm, table), Entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, tableMemory(vm, table), uint8_t, table->control, table->capacity);
+	*table = resized;
 }
 
 /* This function adds the given key/value pair to the given hash table.
  * If an entry for that key is already present, the new value overwrites
  * the old value. The function returns true if a new entry was added.*/
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
 	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {	/* don't grow when capacity is full, we grow when array is at least 75% full. */
-		int capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(table, capacity);
+		int capacity = table->capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : table->capacity * 2;
+		adjustCapacity(vm, table, capacity);
 	}
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	bool isNewKey = entry->key == NULL;
-	if (isNewKey && IS_NIL(entry->value)) table->count++;	
-	/* We only increment the count when an entry key and value is both NULL and NIL*/
+	int slot = findSlot(table, key);
+	if (slot != -1) {
+		table->entries[slot].value = value;
+		return false;
+	}
 
-	entry->key = key;
-	entry->value = value;
-	return isNewKey;
+	slot = findFreeSlot(table, key->hash);
+	if (table->control[slot] == CONTROL_EMPTY) table->count++;	/* reusing a tombstone doesn't change the count */
+	table->control[slot] = HASH_TAG(key->hash);
+	table->entries[slot].key = key;
+	table->entries[slot].value = value;
+	return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
 	if (table->count == 0) return false;
 
 	// Find the entry.
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
-
-	// Place a tombstone in the entry.
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	int slot = findSlot(table, key);
+	if (slot == -1) return false;
+
+	/* A probe stops at the first group with an empty slot, so if this group
+	 * already has one, no lookup ever continued past it and the slot can go
+	 * straight back to empty. Otherwise it has to become a tombstone. */
+	const uint8_t* group = &table->control[slot / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE];
+	if (matchByte(group, CONTROL_EMPTY) != 0) {
+		table->control[slot] = CONTROL_EMPTY;
+		table->count--;
+	} else {
+		table->control[slot] = CONTROL_DELETED;
+	}
+	table->entries[slot].key = NULL;
+	table->entries[slot].value = NIL_VAL;
 	return true;
 }
 
+/* A key's probe length is how many groups a lookup for it walks: one if it
+ * sits in its home group, two if it spilled into the next, and so on. */
+void tableStats(Table* table, TableStats* stats) {
+	memset(stats, 0, sizeof(*stats));
+	stats->capacity = table->capacity;
+	if (table->capacity == 0) return;
+
+	uint32_t groupMask = (uint32_t)(table->capacity / TABLE_GROUP_SIZE) - 1;
+	for (int i = 0; i < table->capacity; i++) {
+		if (table->control[i] == CONTROL_DELETED) stats->tombstones++;
+		ObjString* key = table->entries[i].key;
+		if (key == NULL) continue;
+
+		stats->live++;
+		uint32_t home = key->hash & groupMask;
+		uint32_t length = (((uint32_t)i / TABLE_GROUP_SIZE - home) & groupMask) + 1;
+		if (length > TABLE_PROBE_BUCKETS) length = TABLE_PROBE_BUCKETS;
+		stats->probes[length - 1]++;
+	}
+}
+
 /* helper fucntion for copying all of the entries of one hash table into another.*/
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
 	for (int i = 0; i < from->capacity; i++) {
 		Entry* entry = &from->entries[i];
 		if (entry->key != NULL) {
-			tableSet(to, entry->key, entry->value);
+			tableSet(vm, to, entry->key, entry->value);
 		}
 	}
 }
 
+/* Like findSlot(), but compares by contents. This is how strings get
+ * interned, so the tag check filters out almost every non-matching entry
+ * before we ever dereference its key. */
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
 	if (table->count == 0) return NULL;
 
-	uint32_t index = hash % table->capacity;
+	uint32_t groupMask = (uint32_t)(table->capacity / TABLE_GROUP_SIZE) - 1;
+	uint32_t group = hash & groupMask;
+	uint8_t tag = HASH_TAG(hash);
+
 	for (;;) {
-		Entry* entry = &table->entries[index];
-		if (entry->key == NULL) {
-			// Stop if we find an empty non-tombstone entry.
-			if (IS_NIL(entry->value)) return NULL;
-		} else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-			// We found it.
-			return entry->key;
+		const uint8_t* control = &table->control[group * TABLE_GROUP_SIZE];
+		for (GroupMask matches = matchByte(control, tag); matches != 0; matches &= matches - 1) {
+			ObjString* key = table->entries[group * TABLE_GROUP_SIZE + lowestBit(matches)].key;
+			if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0) {
+				// We found it.
+				return key;
+			}
 		}
+		// Stop if the group has an empty non-tombstone slot.
+		if (matchByte(control, CONTROL_EMPTY) != 0) return NULL;
 
-		index = (index + 1) % table->capacity;
+		group = (group + 1) & groupMask;
 	}
 }
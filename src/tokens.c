@@ -0,0 +1,110 @@
+#include "lib/tokens.h"
+
+bool scanThread = false;
+
+/* Scans up to count tokens into the ring from slot stream->scanned on,
+ * stopping after EOF. Returns the new stream->scanned. */
+static unsigned scanBatch(TokenStream* stream, unsigned count) {
+	for (unsigned i = 0; i < count && !stream->ended; i++) {
+		Token token = scanToken(&stream->scanner);
+		stream->ring[stream->scanned++ % TOKEN_RING_SIZE] = token;
+		stream->ended = token.type == TOKEN_EOF;
+	}
+	return stream->scanned;
+}
+
+#ifdef SCAN_THREAD
+/* A batch only goes into slots the parser has released, and is published
+ * under the lock once it's all written, so the parser never sees a token
+ * still being written. */
+static void* scanThreadMain(void* argument) {
+	TokenStream* stream = (TokenStream*)argument;
+	while (!stream->ended) {
+		pthread_mutex_lock(&stream->lock);
+		while (!stream->stop && stream->scanned + TOKEN_BATCH - stream->released > TOKEN_RING_SIZE) {
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		}
+		bool stop = stream->stop;
+		pthread_mutex_unlock(&stream->lock);
+		if (stop) break;
+
+		unsigned scanned = scanBatch(stream, TOKEN_BATCH);
+
+		pthread_mutex_lock(&stream->lock);
+		stream->published = scanned;
+		pthread_cond_broadcast(&stream->changed);
+		pthread_mutex_unlock(&stream->lock);
+	}
+	return NULL;
+}
+
+/* Hands the slots read so far back to the thread and waits for at least
+ * one more token. */
+static void waitForTokens(TokenStream* stream) {
+	pthread_mutex_lock(&stream->lock);
+	stream->released = stream->read;
+	pthread_cond_broadcast(&stream->changed);
+	while (stream->published == stream->read) {
+		pthread_cond_wait(&stream->changed, &stream->lock);
+	}
+	stream->available = stream->published;
+	pthread_mutex_unlock(&stream->lock);
+}
+#endif
+
+void initTokenStream(TokenStream* stream, const char* source) {
+	initScanner(&stream->scanner, source);
+	stream->read = 0;
+	stream->available = 0;
+	stream->scanned = 0;
+	stream->ended = false;
+	stream->threaded = false;
+#ifdef SCAN_THREAD
+	if (!scanThread || stream->scanner.end - source < SCAN_THREAD_MIN) return;
+
+	stream->published = 0;
+	stream->released = 0;
+	stream->stop = false;
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->changed, NULL);
+	stream->threaded = pthread_create(&stream->thread, NULL, scanThreadMain, stream) == 0;
+	if (!stream->threaded) {	/* fall back to scanning on this thread */
+		pthread_mutex_destroy(&stream->lock);
+		pthread_cond_destroy(&stream->changed);
+	}
+#endif
+}
+
+Token nextToken(TokenStream* stream) {
+	if (stream->read == stream->available) {
+		/* The EOF token stays in the slot after it, since nothing follows. */
+		if (stream->read > 0 && stream->ring[(stream->read - 1) % TOKEN_RING_SIZE].type == TOKEN_EOF) {
+			return stream->ring[(stream->read - 1) % TOKEN_RING_SIZE];
+		}
+#ifdef SCAN_THREAD
+		if (stream->threaded) {
+			waitForTokens(stream);
+		} else
+#endif
+		{
+			stream->available = scanBatch(stream, TOKEN_RING_SIZE);
+		}
+	}
+	return stream->ring[stream->read++ % TOKEN_RING_SIZE];
+}
+
+void freeTokenStream(TokenStream* stream) {
+#ifdef SCAN_THREAD
+	if (!stream->threaded) return;
+	pthread_mutex_lock(&stream->lock);
+	stream->stop = true;
+	pthread_cond_broadcast(&stream->changed);
+	pthread_mutex_unlock(&stream->lock);
+	pthread_join(stream->thread, NULL);
+	pthread_mutex_destroy(&stream->lock);
+	pthread_cond_destroy(&stream->changed);
+	stream->threaded = false;
+#else
+	(void)stream;
+#endif
+}
@@ -1,9 +1,16 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "lib/object.h"
 #include "lib/memory.h"
 #include "lib/value.h"
+#include "lib/vm.h"
+
+/* The global slots are the one value array that isn't a chunk's constants. */
+static MemoryKind valueArrayMemory(VM* vm, ValueArray* array) {
+	return array == &vm->globalValues ? MEM_GLOBALS : MEM_CONSTANTS;
+}
 
 void initValueArray(ValueArray *array) {
 	array->values = NULL;
@@ -11,34 +18,165 @@ void initValueArray(ValueArray *array) {
 	array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value) {
+void writeValueArray(VM* vm, ValueArray *array, Value value) {
 	if (array->capacity < array->count + 1) {
 		int oldCapacity = array->capacity;
 		array->capacity = GROW_CAPACITY(oldCapacity);
-		array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+		array->values = GROW_ARRAY(vm, valueArrayMemory(vm, array), Value, array->values, oldCapacity, array->capacity);
 	}
 
 	array->values[array->count] = value;
 	array->count++;
 }
 
-void freeValueArray(ValueArray *array) { 
-	FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray *array) { 
+	FREE_ARRAY(vm, valueArrayMemory(vm, array), Value, array->values, array->capacity);
 	initValueArray(array);
 }
 
-void printValue(Value value) {
-	switch (value.type) {
-		case VAL_BOOL:
-		printf(AS_BOOL(value) ? "true" : "false");
-		break;
-		case VAL_NIL: printf("nil"); break;
-		case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-		case VAL_OBJ: printObject(value); break;
+/* Every power of ten up to here is exact as a double. */
+static const double powersOfTen[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* %g's six significant digits. */
+#define NUMBER_PRECISION 6
+
+/* Writes the decimal digits of n into digits, most significant first. */
+static int integerDigits(uint64_t n, char* digits) {
+	char reversed[20];
+	int count = 0;
+	do {
+		reversed[count++] = (char)('0' + n % 10);
+		n /= 10;
+	} while (n != 0);
+	for (int i = 0; i < count; i++) digits[i] = reversed[count - 1 - i];
+	return count;
+}
+
+/* Lays digits out the way %g does. The leading digit is worth
+ * 10^exponent, and digits has no trailing zeros. */
+static int layOutDigits(char* buffer, bool negative, const char* digits, int count, int exponent) {
+	char* out = buffer;
+	if (negative) *out++ = '-';
+
+	if (exponent < -4 || exponent >= NUMBER_PRECISION) {
+		*out++ = digits[0];
+		if (count > 1) {
+			*out++ = '.';
+			memcpy(out, digits + 1, count - 1);
+			out += count - 1;
+		}
+		*out++ = 'e';
+		*out++ = exponent < 0 ? '-' : '+';
+		int magnitude = exponent < 0 ? -exponent : exponent;
+		if (magnitude >= 100) *out++ = (char)('0' + magnitude / 100);
+		*out++ = (char)('0' + magnitude / 10 % 10);
+		*out++ = (char)('0' + magnitude % 10);
+	} else if (exponent >= 0) {
+		for (int i = 0; i <= exponent || i < count; i++) {
+			if (i == exponent + 1) *out++ = '.';
+			*out++ = i < count ? digits[i] : '0';
+		}
+	} else {
+		*out++ = '0';
+		*out++ = '.';
+		for (int i = -1; i > exponent; i--) *out++ = '0';
+		memcpy(out, digits, count);
+		out += count;
 	}
+	*out = '\0';
+	return (int)(out - buffer);
+}
+
+/* %g rounds the exact value to six significant digits, which rarely needs
+ * more than the shortest decimal that reads back as the same double: when
+ * that has six digits or fewer, it's exactly what %g prints. Integers are
+ * exact, so they get rounded here (to nearest, ties to even, like printf)
+ * however many digits they have. Only numbers whose shortest form is longer,
+ * like 0.1 + 0.2, and infinities and NaNs still go through snprintf(). */
+int formatNumber(double number, char* buffer) {
+	if (number == 0) return layOutDigits(buffer, signbit(number), "0", 1, 0);
+
+	bool negative = number < 0;
+	double magnitude = fabs(number);
+	char digits[24];
+	int count;
+	int exponent;
+
+	if (magnitude < 1e19 && magnitude == floor(magnitude)) {
+		count = integerDigits((uint64_t)magnitude, digits);
+		exponent = count - 1;
+		if (count > NUMBER_PRECISION) {
+			char next = digits[NUMBER_PRECISION];
+			bool rest = false;
+			for (int i = NUMBER_PRECISION + 1; i < count; i++) rest |= digits[i] != '0';
+			bool roundUp = next > '5' ||
+					(next == '5' && (rest || (digits[NUMBER_PRECISION - 1] - '0') % 2 == 1));
+			count = NUMBER_PRECISION;
+			if (roundUp) {
+				int i = count - 1;
+				while (i >= 0 && digits[i] == '9') digits[i--] = '0';
+				if (i >= 0) {
+					digits[i]++;
+				} else {	/* 9999995 becomes 1e+07 */
+					digits[0] = '1';
+					exponent++;
+				}
+			}
+		}
+	} else {
+		count = 0;
+		for (int shift = 1; shift < (int)(sizeof(powersOfTen) / sizeof(double)); shift++) {
+			double scaled = magnitude * powersOfTen[shift];
+			if (scaled >= 1e15) break;	/* n below stops being exact */
+			double n = floor(scaled + 0.5);
+			if (n / powersOfTen[shift] != magnitude) continue;	/* not the decimal this double reads back from */
+			count = integerDigits((uint64_t)n, digits);
+			exponent = count - 1 - shift;
+			break;
+		}
+		if (count == 0 || count > NUMBER_PRECISION) {
+			return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+		}
+	}
+
+	while (count > 1 && digits[count - 1] == '0') count--;
+	return layOutDigits(buffer, negative, digits, count, exponent);
+}
+
+void writeValue(VM* vm, OutputBuffer* output, Value value) {
+	if (IS_BOOL(value)) {
+		if (AS_BOOL(value)) {
+			writeOutput(output, "true", 4);
+		} else {
+			writeOutput(output, "false", 5);
+		}
+	} else if (IS_NIL(value)) {
+		writeOutput(output, "nil", 3);
+	} else if (IS_NUMBER(value)) {
+		char buffer[NUMBER_BUFFER_SIZE];
+		writeOutput(output, buffer, (size_t)formatNumber(AS_NUMBER(value), buffer));
+	} else if (IS_OBJ(value)) {
+		writeObject(vm, output, value);
+	}
+}
+
+void printValue(VM* vm, Value value) {
+	writeValue(vm, &vm->output, value);
+	flushOutput(&vm->output);
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+	/* Compare numbers as doubles so NaN != NaN still holds; every other
+	 * value is equal exactly when its bits are. */
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	}
+	return a == b;
+#else
 	if (a.type != b.type) return false;
 	switch (a.type) {
 		case VAL_BOOL:		return AS_BOOL(a) == AS_BOOL(b);
@@ -47,4 +185,5 @@ bool valuesEqual(Value a, Value b) {
 		case VAL_OBJ:		return AS_OBJ(a) == AS_OBJ(b);
 		default:			return false; // Unreachable
 	}
+#endif
 }
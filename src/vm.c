@@ -1,245 +1,903 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "lib/array.h"
 #include "lib/common.h"
 #include "lib/compiler.h"
 #include "lib/debug.h"
+#include "lib/jit.h"
 #include "lib/object.h"
 #include "lib/memory.h"
+#include "lib/profile.h"
+#include "lib/sampler.h"
+#include "lib/source.h"
 #include "lib/vm.h"
 
-VM vm;
-
 /* Points the *stackTop pointer to the beginning of the array to indicate that
  * the stack is empty. */
-static void resetStack() {
-	vm.stackTop = vm.stack;
+void resetStack(VM* vm) {
+	vm->stackTop = vm->stack;
+}
+
+bool reserveStack(VM* vm, int slots) {
+	int used = (int)(vm->stackTop - vm->stack);
+	/* The limit first: the stack starts out with STACK_MAX slots whatever
+	 * --max-stack says, so a smaller limit could otherwise already fit. */
+	if (slots > vm->stackLimit - used) {
+		flushOutput(&vm->output);
+		fprintf(stderr, "Stack overflow: the script needs %d stack slots, the limit is %d.\n",
+				used + slots, vm->stackLimit);
+		return false;
+	}
+	if (slots <= vm->stackCapacity - used) return true;
+
+	int capacity = vm->stackCapacity * 2;
+	if (capacity < used + slots) capacity = used + slots;
+	if (capacity > vm->stackLimit) capacity = vm->stackLimit;
+	Value* stack = (Value*)realloc(vm->stack, sizeof(Value) * capacity);
+	if (stack == NULL) exit(1);
+	vm->stack = stack;
+	vm->stackTop = stack + used;
+	vm->stackCapacity = capacity;
+	return true;
 }
 
-static void runtimeError(const char* format, ...) {
-	va_list args; /* this let us pass an arbitrary number of arguments to runtimeError(). */
+static void runtimeError(VM* vm, const char* format, ...) {
+	flushOutput(&vm->output);	/* so the error comes after what the script printed */
+	va_list args; /* this let us pass an arbitrary number of arguments to runtimeError(vm, ). */
 	va_start(args, format);
 	vfprintf(stderr, format, args); /* flavor of printf() that takes an explicit va_list */
 	va_end(args);
 	fputs("\n", stderr);
 
-	size_t instruction = vm.ip - vm.chunk->code - 1;
-	int line = vm.chunk->lines[instruction];
+	size_t instruction = vm->ip - vm->chunk->code - 1;
+	int line = getLine(vm->chunk, (int)instruction);
 	fprintf(stderr, "[line %d] in script\n", line);
-	resetStack();
+	resetStack(vm);
+}
+
+void initVM(VM* vm) {
+	initHeap(vm);
+	vm->stack = (Value*)malloc(sizeof(Value) * STACK_MAX);
+	if (vm->stack == NULL) exit(1);
+	vm->stackCapacity = STACK_MAX;
+	vm->stackLimit = STACK_LIMIT;
+	resetStack(vm);
+	initOutput(&vm->output);
+	vm->shared = NULL;
+	vm->jit = NULL;
+	vm->chunk = NULL;
+	vm->objects = NULL;	/* When we first initialize the VM, there are no allocated objects.*/
+	vm->youngObjects = NULL;
+	vm->youngBytes = 0;
+	vm->bytesAllocated = 0;
+	vm->nextGC = GC_INITIAL_HEAP;
+	vm->grayStack = NULL;
+	vm->grayCount = 0;
+	vm->grayCapacity = 0;
+	vm->remembered = NULL;
+	vm->rememberedCount = 0;
+	vm->rememberedCapacity = 0;
+	vm->majorCollection = false;
+	vm->keptSources = NULL;
+	vm->keptCount = 0;
+	vm->keptCapacity = 0;
+
+	initTable(&vm->globalNames);	/* we need to initialize the hash table to a valid state when the VM boots up */
+	initValueArray(&vm->globalValues);
+	initTable(&vm->strings);	/* pass the address of field strings via vm and the & operator.*/
+}
+
+void initWorkerVM(VM* vm, VM* shared) {
+	initVM(vm);
+	vm->shared = shared;
+	vm->stackLimit = shared->stackLimit;
+	for (int i = 0; i < shared->globalValues.count; i++) {
+		writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+	}
+}
+
+/* Frozen objects count as old, so a worker's minor collections never look at
+ * them, and markObject() skips them in major ones too. They go on the old
+ * list so that this VM's own collector wouldn't free them either. */
+void freezeVM(VM* vm) {
+	Obj* lists[] = {vm->objects, vm->youngObjects};
+	for (int i = 0; i < 2; i++) {
+		for (Obj* object = lists[i]; object != NULL; object = object->next) {
+			object->isOld = true;
+			object->isFrozen = true;
+		}
+	}
+	while (vm->youngObjects != NULL) {
+		Obj* next = vm->youngObjects->next;
+		vm->youngObjects->next = vm->objects;
+		vm->objects = vm->youngObjects;
+		vm->youngObjects = next;
+	}
+	vm->youngBytes = 0;
+}
+
+void freeVM(VM* vm) {
+	freeOutput(&vm->output);
+	freeJit(vm);
+	freeTable(vm, &vm->globalNames);	/* also this */
+	freeValueArray(vm, &vm->globalValues);
+	freeTable(vm, &vm->strings);	/* when the vm is shut down, we clean up any resources used by the table. */
+	freeObjects(vm);
+	closeKeptSources(vm);	/* after the objects, as borrowed strings point into them */
+	free(vm->stack);
+	vm->stack = NULL;
 }
 
-void initVM() {
-	resetStack();
-	vm.objects = NULL;	/* When we first initialize the VM, there are no allocated objects.*/
+int globalSlot(VM* vm, ObjString* name) {
+	Value slot;
+	if (tableGet(&vm->globalNames, name, &slot)) return (int)AS_NUMBER(slot);
 
-	initTable(&vm.globals);	/* we need to initialize the hash table to a valid state when the VM boots up */
-	initTable(&vm.strings);	/* pass the address of field strings via vm and the & operator.*/
+	writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+	int index = vm->globalValues.count - 1;
+	tableSet(vm, &vm->globalNames, name, NUMBER_VAL((double)index));
+	return index;
 }
 
-void freeVM() {
-	freeTable(&vm.globals);	/* also this */
-	freeTable(&vm.strings);	/* when the vm is shut down, we clean up any resources used by the table. */
-	freeObjects();
+ObjString* globalName(VM* vm, int slot) {
+	Table* names = vm->shared != NULL ? &vm->shared->globalNames : &vm->globalNames;
+	for (int i = 0; i < names->capacity; i++) {
+		Entry* entry = &names->entries[i];
+		if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot) return entry->key;
+	}
+	return NULL;	// Unreachable, every slot is handed out with a name.
 }
 
 /* Push a new value onto the top of the stack */
-void push(Value value) {
-	*vm.stackTop = value;
-	vm.stackTop++;
+void push(VM* vm, Value value) {
+	*vm->stackTop = value;
+	vm->stackTop++;
 }
 
-Value pop() {
-	vm.stackTop--;
-	return *vm.stackTop;
+Value pop(VM* vm) {
+	vm->stackTop--;
+	return *vm->stackTop;
 
 }
 
-static Value peek(int distance) {
-	return vm.stackTop[-1 - distance];
+static Value peek(VM* vm, int distance) {
+	return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value) {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-/* a function to concatenate strings*/
-static void concatenate() {
-	ObjString* b = AS_STRING(pop());
-	ObjString* a = AS_STRING(pop());
+/* valuesEqual() that also looks through ropes. Comparing them can allocate,
+ * so the operands have to stay on the stack until this returns. */
+static bool valuesAreEqual(VM* vm, Value a, Value b) {
+	if (IS_OBJ(a) && IS_OBJ(b)) return objectsEqual(vm, AS_OBJ(a), AS_OBJ(b));
+	return valuesEqual(a, b);
+}
+
+static void undefinedVariable(VM* vm, int slot) {
+	ObjString* name = globalName(vm, slot);
+	runtimeError(vm, "Undefined variable '%.*s'.", name->length, name->chars);
+}
+
+/* Results shorter than this are still copied and interned right away: for
+ * them a rope node costs about as much as the copy, and they usually get
+ * compared or printed soon after. Ropes always have at least this length,
+ * so both operands of a short concatenation are flat. */
+#define ROPE_MIN_LENGTH 32
+
+/* a function to concatenate strings. Anything at least ROPE_MIN_LENGTH long
+ * becomes an ObjRope, so building a string piece by piece doesn't copy
+ * everything built so far on every step. */
+static void concatenate(VM* vm) {
+	/* The operands stay on the stack until the result exists, so a
+	 * collection while allocating it still sees them. */
+	Obj* b = AS_OBJ(peek(vm, 0));
+	Obj* a = AS_OBJ(peek(vm, 1));
+
+	int length = stringLength(a) + stringLength(b);
+	Obj* result;
+	if (stringLength(a) == 0) {
+		result = b;
+	} else if (stringLength(b) == 0) {
+		result = a;
+	} else if (length >= ROPE_MIN_LENGTH) {
+		result = (Obj*)makeRope(vm, a, b, length);
+	} else {
+		ObjString* left = (ObjString*)a;
+		ObjString* right = (ObjString*)b;
+		ObjString* string = allocateString(vm, length);
+		memcpy(string->storage, left->chars, left->length);
+		memcpy(string->storage + left->length, right->chars, right->length);
+		result = (Obj*)takeString(vm, string);
+	}
+
+	pop(vm);
+	pop(vm);
+	push(vm, OBJ_VAL(result));
+}
+
+/* The number array instructions. Each works on vm->stackTop, so run()
+ * stores its frame first, and reports its own runtime error and returns
+ * false when the operands are wrong. Anything that allocates leaves the
+ * operands on the stack until the result exists, like concatenate(). */
+
+/* OP_ARRAY: the count values on top of the stack, first element deepest. */
+static bool buildArray(VM* vm, int count) {
+	Value* elements = vm->stackTop - count;
+	for (int i = 0; i < count; i++) {
+		if (!IS_NUMBER(elements[i])) {
+			runtimeError(vm, "Array elements must be numbers.");
+			return false;
+		}
+	}
+
+	ObjNumberArray* array = newNumberArray(vm, count);
+	for (int i = 0; i < count; i++) array->values[i] = AS_NUMBER(elements[i]);
+	vm->stackTop = elements;
+	push(vm, OBJ_VAL(array));
+	return true;
+}
+
+static bool isWholeNumber(double number, double limit) {
+	return number >= 0 && number < limit && number == (double)(int)number;
+}
+
+static bool newArray(VM* vm) {
+	Value length = peek(vm, 0);
+	if (!IS_NUMBER(length) || !isWholeNumber(AS_NUMBER(length), NUMBER_ARRAY_MAX + 1.0)) {
+		runtimeError(vm, "Array length must be a whole number from 0 to %d.", NUMBER_ARRAY_MAX);
+		return false;
+	}
+
+	int count = (int)AS_NUMBER(length);
+	ObjNumberArray* array = newNumberArray(vm, count);
+	memset(array->values, 0, sizeof(double) * (size_t)count);	/* all bits zero is 0.0 */
+	vm->stackTop[-1] = OBJ_VAL(array);
+	return true;
+}
+
+/* Checks array[index] and returns where the element is, or -1. */
+static int arrayIndex(VM* vm, Value array, Value index) {
+	if (!IS_NUMBER_ARRAY(array)) {
+		runtimeError(vm, "Only arrays can be indexed.");
+		return -1;
+	}
+	if (!IS_NUMBER(index)) {
+		runtimeError(vm, "Array index must be a number.");
+		return -1;
+	}
+
+	double number = AS_NUMBER(index);
+	int count = AS_NUMBER_ARRAY(array)->count;
+	if (!(number >= 0 && number < count)) {
+		char buffer[NUMBER_BUFFER_SIZE];
+		formatNumber(number, buffer);
+		runtimeError(vm, "Array index %s is out of bounds for length %d.", buffer, count);
+		return -1;
+	}
+	if (number != (double)(int)number) {
+		runtimeError(vm, "Array index must be a whole number.");
+		return -1;
+	}
+	return (int)number;
+}
+
+static bool getIndex(VM* vm) {
+	int slot = arrayIndex(vm, peek(vm, 1), peek(vm, 0));
+	if (slot == -1) return false;
+
+	double element = AS_NUMBER_ARRAY(peek(vm, 1))->values[slot];
+	vm->stackTop -= 2;
+	push(vm, NUMBER_VAL(element));
+	return true;
+}
+
+/* array[index] = value leaves value, like any other assignment. */
+static bool setIndex(VM* vm) {
+	int slot = arrayIndex(vm, peek(vm, 2), peek(vm, 1));
+	if (slot == -1) return false;
+	if (!IS_NUMBER(peek(vm, 0))) {
+		runtimeError(vm, "Only numbers can be stored in an array.");
+		return false;
+	}
+
+	Value value = peek(vm, 0);
+	AS_NUMBER_ARRAY(peek(vm, 2))->values[slot] = AS_NUMBER(value);
+	vm->stackTop -= 3;
+	push(vm, value);
+	return true;
+}
+
+static bool valueLength(VM* vm) {
+	Value value = peek(vm, 0);
+	int count;
+	if (IS_NUMBER_ARRAY(value)) {
+		count = AS_NUMBER_ARRAY(value)->count;
+	} else if (IS_ANY_STRING(value)) {
+		count = stringLength(AS_OBJ(value));
+	} else {
+		runtimeError(vm, "Only arrays and strings have a length.");
+		return false;
+	}
+	vm->stackTop[-1] = NUMBER_VAL(count);
+	return true;
+}
+
+/* OP_ARRAY_ADD and OP_ARRAY_MULTIPLY: a new array, with b either an array
+ * as long as a or a number to combine with every element. */
+static bool combineArrays(VM* vm, bool multiply) {
+	Value a = peek(vm, 1);
+	Value b = peek(vm, 0);
+	if (!IS_NUMBER_ARRAY(a)) {
+		runtimeError(vm, "First operand must be an array.");
+		return false;
+	}
+	int count = AS_NUMBER_ARRAY(a)->count;
+	if (!IS_NUMBER(b) && !(IS_NUMBER_ARRAY(b) && AS_NUMBER_ARRAY(b)->count == count)) {
+		runtimeError(vm, "Second operand must be a number or an array of the same length.");
+		return false;
+	}
+
+	ObjNumberArray* result = newNumberArray(vm, count);
+	double* out = result->values;
+	const double* left = AS_NUMBER_ARRAY(a)->values;
+	if (IS_NUMBER(b)) {
+		if (multiply) {
+			multiplyScalar(left, AS_NUMBER(b), out, count);
+		} else {
+			addScalar(left, AS_NUMBER(b), out, count);
+		}
+	} else if (multiply) {
+		multiplyArrays(left, AS_NUMBER_ARRAY(b)->values, out, count);
+	} else {
+		addArrays(left, AS_NUMBER_ARRAY(b)->values, out, count);
+	}
+
+	vm->stackTop -= 2;
+	push(vm, OBJ_VAL(result));
+	return true;
+}
+
+/* OP_ARRAY_SUM, OP_ARRAY_MIN and OP_ARRAY_MAX. */
+static bool reduceArray(VM* vm, uint8_t instruction) {
+	Value value = peek(vm, 0);
+	if (!IS_NUMBER_ARRAY(value)) {
+		runtimeError(vm, "Operand must be an array.");
+		return false;
+	}
+
+	ObjNumberArray* array = AS_NUMBER_ARRAY(value);
+	double result;
+	if (instruction == OP_ARRAY_SUM) {
+		result = sumArray(array->values, array->count);
+	} else if (array->count == 0) {
+		runtimeError(vm, "An empty array has no %s.", instruction == OP_ARRAY_MIN ? "minimum" : "maximum");
+		return false;
+	} else if (instruction == OP_ARRAY_MIN) {
+		result = minArray(array->values, array->count);
+	} else {
+		result = maxArray(array->values, array->count);
+	}
+	vm->stackTop[-1] = NUMBER_VAL(result);
+	return true;
+}
+
+static bool dotProduct(VM* vm) {
+	Value a = peek(vm, 1);
+	Value b = peek(vm, 0);
+	if (!IS_NUMBER_ARRAY(a) || !IS_NUMBER_ARRAY(b) ||
+		AS_NUMBER_ARRAY(a)->count != AS_NUMBER_ARRAY(b)->count) {
+		runtimeError(vm, "Operands must be two arrays of the same length.");
+		return false;
+	}
 
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
+	double result = dotArrays(AS_NUMBER_ARRAY(a)->values, AS_NUMBER_ARRAY(b)->values, AS_NUMBER_ARRAY(a)->count);
+	vm->stackTop -= 2;
+	push(vm, NUMBER_VAL(result));
+	return true;
+}
 
-	ObjString* result = takeString(chars, length);
-	push(OBJ_VAL(result));
+/* Prints the stack and the instruction about to run. Only compiled in when
+ * DEBUG_TRACE_EXECUTION is defined, so the normal build pays nothing. */
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM* vm, uint8_t* ip, Value* stackTop) {
+	printf("		");
+	for (Value *slot = vm->stack; slot < stackTop; slot++) {
+		printf("[");
+		printValue(vm, *slot);
+		printf("]");
+	}
+	printf("\n");
+	disassembleInstruction(vm, vm->chunk, (int)(ip - vm->chunk->code));
 }
+#define TRACE_EXECUTION() traceExecution(vm, ip, stackTop)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+/* --profile flips profiler.enabled at startup, and --sample-profile's timer
+ * sets sampler.pending now and then; otherwise these are two well-predicted
+ * branches per instruction. */
+#define PROFILE_INSTRUCTION() \
+	do { \
+		if (profiler.enabled) profileInstruction(vm->chunk, (int)(ip - vm->chunk->code)); \
+		if (sampler.pending) takeSample(vm->chunk, ip); \
+	} while (false)
 
 /* The beating heart of the VM */
-static InterpretResult run() {	/* For other techniques, look up direct threaded code, jump table and computed goto */
-#define READ_BYTE() (*vm.ip++)	/* reads the byte currently pointed at by ip and then advances the instruction pointer */
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()]) /* reads the next byte from the bytecode, treats the resulting number as an index,
+static InterpretResult run(VM* vm) {
+	/* ip, stackTop and the constants live in locals so the compiler can keep
+	 * them in registers instead of going through vm on every push and pop.
+	 * Anything that looks at the VM's copies, like runtimeError(), or that
+	 * can allocate and so collect, like concatenate(), needs STORE_FRAME()
+	 * first, and LOAD_STACK() after if it changes the stack. */
+	uint8_t* ip = vm->ip;
+	Value* stackTop = vm->stackTop;
+	Value* constants = vm->chunk->constants.values;
+	Value* slots = vm->stack;	/* the locals; reserveStack() already ran, so it won't move */
+	/* Workers share their chunks with other threads, so they run whatever
+	 * form an instruction is in but never rewrite one. */
+	bool quicken = vm->shared == NULL;
+#define STORE_FRAME() (vm->ip = ip, vm->stackTop = stackTop)
+#define LOAD_STACK() (stackTop = vm->stackTop)
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define RUNTIME_ERROR(...) \
+	do { \
+		STORE_FRAME(); \
+		runtimeError(vm, __VA_ARGS__); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
+#define READ_BYTE() (*ip++)	/* reads the byte currently pointed at by ip and then advances the instruction pointer */
+#define READ_CONSTANT() (constants[READ_BYTE()]) /* reads the next byte from the bytecode, treats the resulting number as an index,
 and looks up the corresponding Value in the chunk's constant table. */
 #define READ_SHORT() \
-	(vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
-/* a placeholder for the values and the binary operator */ 
-#define READ_STRING()	AS_STRING(READ_CONSTANT())	/* a macro inside a macro that is also inside a macro */
-#define BINARY_OP(ValueType, op) \
+	(ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+	(ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))	/* 24-bit operand of the _LONG opcodes */
+/* Rewrites the instruction whose opcode byte was just read into opcode.
+ * The generic handlers quicken themselves into the form for the operand
+ * types they just saw, and quickened ones put the generic form back when
+ * their guess is wrong, so a site that sees mixed types keeps working. */
+#define QUICKEN(opcode) \
 	do { \
-		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-			runtimeError("Operands must be numbers."); \
-			return INTERPRET_RUNTIME_ERROR; \
+		if (quicken) ip[-1] = (opcode); \
+	} while (false)
+/* a placeholder for the values and the binary operator. Every operator
+ * that goes through here only takes numbers, so they always quicken. */
+#define BINARY_OP(ValueType, op, quickened) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			RUNTIME_ERROR("Operands must be numbers."); \
 	} \
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		push(ValueType(a op b)); \
+		QUICKEN(quickened); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		PUSH(ValueType(a op b)); \
+	} while (false)
+/* The quickened form of BINARY_OP. Anything but numbers is an error, but
+ * that goes through the generic form so it reports it. */
+#define NUMBER_OP(ValueType, op, generic) \
+	do { \
+		if (!BOTH_NUMBERS(PEEK(0), PEEK(1))) { \
+			QUICKEN(generic); \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		double b = AS_NUMBER(POP()); \
+		PEEK(0) = ValueType(AS_NUMBER(PEEK(0)) op b); \
+	} while (false)
+/* The global opcodes share their bodies with the _LONG forms, which only
+ * differ in how wide the slot operand is. */
+#define GET_GLOBAL(slot) \
+	do { \
+		Value value = vm->globalValues.values[slot]; \
+		if (IS_UNDEFINED(value)) { \
+			STORE_FRAME(); \
+			undefinedVariable(vm, slot); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		PUSH(value); \
+	} while (false)
+/* Compare-and-branch: pops both operands and jumps unless a op b holds.
+ * The operands are checked before the offset is read, while ip[-1] is
+ * still the opcode QUICKEN() rewrites. */
+#define JUMP_UNLESS(op, quickened) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		QUICKEN(quickened); \
+		uint16_t offset = READ_SHORT(); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		if (!(a op b)) ip += offset; \
+	} while (false)
+#define JUMP_UNLESS_NUMBERS(op, generic) \
+	do { \
+		if (!BOTH_NUMBERS(PEEK(0), PEEK(1))) { \
+			QUICKEN(generic); \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		uint16_t offset = READ_SHORT(); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		if (!(a op b)) ip += offset; \
+	} while (false)
+#define SET_GLOBAL(slot) \
+	do { \
+		if (IS_UNDEFINED(vm->globalValues.values[slot])) {	/* assignment never creates a global */ \
+			STORE_FRAME(); \
+			undefinedVariable(vm, slot); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		vm->globalValues.values[slot] = PEEK(0); \
+	} while (false)
+/* The number array handlers, which do their work on vm's copy of the
+ * stack, see buildArray(). */
+#define ARRAY_OP(call) \
+	do { \
+		STORE_FRAME(); \
+		if (!(call)) return INTERPRET_RUNTIME_ERROR; \
+		LOAD_STACK(); \
 	} while (false)
 
+/* With COMPUTED_GOTO every handler ends in its own indirect jump through
+ * dispatchTable, so the branch predictor gets one slot per opcode instead 
+ * of sharing the single jump the switch compiles to. Without it, CASE and
+ * BREAK expand back to a plain switch inside a for loop. */
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[] = {
+		[OP_CONSTANT]		= &&label_OP_CONSTANT,
+		[OP_CONSTANT_LONG]	= &&label_OP_CONSTANT_LONG,
+		[OP_NIL]			= &&label_OP_NIL,
+		[OP_TRUE]			= &&label_OP_TRUE,
+		[OP_FALSE]			= &&label_OP_FALSE,
+		[OP_POP]			= &&label_OP_POP,
+		[OP_GET_LOCAL]		= &&label_OP_GET_LOCAL,
+		[OP_SET_LOCAL]		= &&label_OP_SET_LOCAL,
+		[OP_GET_GLOBAL]		= &&label_OP_GET_GLOBAL,
+		[OP_GET_GLOBAL_LONG]	= &&label_OP_GET_GLOBAL_LONG,
+		[OP_DEFINE_GLOBAL]	= &&label_OP_DEFINE_GLOBAL,
+		[OP_DEFINE_GLOBAL_LONG]	= &&label_OP_DEFINE_GLOBAL_LONG,
+		[OP_SET_GLOBAL]		= &&label_OP_SET_GLOBAL,
+		[OP_SET_GLOBAL_LONG]	= &&label_OP_SET_GLOBAL_LONG,
+		[OP_EQUAL]			= &&label_OP_EQUAL,
+		[OP_GREATER]		= &&label_OP_GREATER,
+		[OP_LESS]			= &&label_OP_LESS,
+		[OP_ADD]			= &&label_OP_ADD,
+		[OP_SUBTRACT]		= &&label_OP_SUBTRACT,
+		[OP_MULTIPLY]		= &&label_OP_MULTIPLY,
+		[OP_DIVIDE]			= &&label_OP_DIVIDE,
+		[OP_NOT]			= &&label_OP_NOT,
+		[OP_NEGATE]			= &&label_OP_NEGATE,
+		[OP_PRINT]			= &&label_OP_PRINT,
+		[OP_JUMP]			= &&label_OP_JUMP,
+		[OP_JUMP_IF_FALSE]	= &&label_OP_JUMP_IF_FALSE,
+		[OP_LOOP]			= &&label_OP_LOOP,
+		[OP_RETURN]			= &&label_OP_RETURN,
+		[OP_ARRAY]					= &&label_OP_ARRAY,
+		[OP_NEW_ARRAY]				= &&label_OP_NEW_ARRAY,
+		[OP_GET_INDEX]				= &&label_OP_GET_INDEX,
+		[OP_SET_INDEX]				= &&label_OP_SET_INDEX,
+		[OP_LENGTH]					= &&label_OP_LENGTH,
+		[OP_ARRAY_ADD]				= &&label_OP_ARRAY_ADD,
+		[OP_ARRAY_MULTIPLY]			= &&label_OP_ARRAY_MULTIPLY,
+		[OP_ARRAY_SUM]				= &&label_OP_ARRAY_SUM,
+		[OP_ARRAY_MIN]				= &&label_OP_ARRAY_MIN,
+		[OP_ARRAY_MAX]				= &&label_OP_ARRAY_MAX,
+		[OP_ARRAY_DOT]				= &&label_OP_ARRAY_DOT,
+		[OP_POP_JUMP_IF_FALSE]		= &&label_OP_POP_JUMP_IF_FALSE,
+		[OP_JUMP_IF_NOT_EQUAL]		= &&label_OP_JUMP_IF_NOT_EQUAL,
+		[OP_JUMP_IF_NOT_GREATER]	= &&label_OP_JUMP_IF_NOT_GREATER,
+		[OP_JUMP_IF_NOT_LESS]		= &&label_OP_JUMP_IF_NOT_LESS,
+		[OP_ADD_LOCALS]				= &&label_OP_ADD_LOCALS,
+		[OP_ADD_LOCAL_CONSTANT]		= &&label_OP_ADD_LOCAL_CONSTANT,
+		[OP_ADD_NUM]				= &&label_OP_ADD_NUM,
+		[OP_ADD_STRING]				= &&label_OP_ADD_STRING,
+		[OP_SUBTRACT_NUM]			= &&label_OP_SUBTRACT_NUM,
+		[OP_MULTIPLY_NUM]			= &&label_OP_MULTIPLY_NUM,
+		[OP_DIVIDE_NUM]				= &&label_OP_DIVIDE_NUM,
+		[OP_GREATER_NUM]			= &&label_OP_GREATER_NUM,
+		[OP_LESS_NUM]				= &&label_OP_LESS_NUM,
+		[OP_JUMP_IF_NOT_GREATER_NUM]	= &&label_OP_JUMP_IF_NOT_GREATER_NUM,
+		[OP_JUMP_IF_NOT_LESS_NUM]		= &&label_OP_JUMP_IF_NOT_LESS_NUM,
+	};
+
+#define DISPATCH() \
+	do { \
+		TRACE_EXECUTION(); \
+		PROFILE_INSTRUCTION(); \
+		goto *dispatchTable[READ_BYTE()]; \
+	} while (false)
+#define CASE(op)	label_##op:
+#define BREAK		DISPATCH()
+
+	DISPATCH();
+	{
+#else
+#define CASE(op)	case op:
+#define BREAK		break
+
 	for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-		printf("		");
-		for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-			printf("[");
-			printValue(*slot);
-			printf("]");
-		}
-		printf("\n");
-		disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+		TRACE_EXECUTION();
+		PROFILE_INSTRUCTION();
+		switch (READ_BYTE()) {
 #endif
-		uint8_t instruction;
-		switch (instruction = READ_BYTE()) {
-			case OP_CONSTANT: {
+			CASE(OP_CONSTANT) {
 				Value constant = READ_CONSTANT();
-				push(constant);
-				break;
-			}
-			case OP_NIL: push(NIL_VAL); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_POP: pop(); break;	/* as the name implies, it pops the top value off the stack and forgets it.*/
-			case OP_GET_LOCAL: {
+				PUSH(constant);
+				BREAK;
+			}
+			CASE(OP_CONSTANT_LONG) {
+				Value constant = constants[READ_LONG()];
+				PUSH(constant);
+				BREAK;
+			}
+			CASE(OP_NIL) PUSH(NIL_VAL); BREAK;
+			CASE(OP_TRUE) PUSH(BOOL_VAL(true)); BREAK;
+			CASE(OP_FALSE) PUSH(BOOL_VAL(false)); BREAK;
+			CASE(OP_POP) stackTop--; BREAK;	/* as the name implies, it pops the top value off the stack and forgets it.*/
+			CASE(OP_GET_LOCAL) {
 				uint8_t slot = READ_BYTE();
-				push(vm.stack[slot]);
-				break;
+				PUSH(slots[slot]);
+				BREAK;
 			}
-			case OP_SET_LOCAL: {
+			CASE(OP_SET_LOCAL) {
 				uint8_t slot = READ_BYTE();
-				vm.stack[slot] = peek(0);
-				break;
-			}
-			case OP_GET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				Value value;
-				if (!tableGet(&vm.globals, name, &value)) {
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				push(value);
-				break;
-			}
-			case OP_DEFINE_GLOBAL: {
-				ObjString* name = READ_STRING();
-				tableSet(&vm.globals, name, peek(0));
-				pop();
-				break;
-			}
-			case OP_SET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				if (tableSet(&vm.globals, name, peek(0))) {
-					tableDelete(&vm.globals, name);
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
-			}
-			case OP_EQUAL: {
-				Value b = pop();
-				Value a = pop();
-				push(BOOL_VAL(valuesEqual(a, b)));
-				break;
-			}
-			case OP_GREATER:	BINARY_OP(BOOL_VAL, >); break; /* we pass in BOOL_VAL since the result value type is Boolean.*/
-			case OP_LESS:		BINARY_OP(BOOL_VAL, <); break;	
-			case OP_ADD: {	/* If both operands are strings, it concatenates.*/
-				if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-					concatenate();
-				} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {	/* If they're both numbers, it adds them.*/
-					double b = AS_NUMBER(pop());
-					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a + b));
+				slots[slot] = PEEK(0);
+				BREAK;
+			}
+			CASE(OP_GET_GLOBAL) {
+				uint8_t slot = READ_BYTE();	/* the compiler already turned the name into a slot */
+				GET_GLOBAL(slot);
+				BREAK;
+			}
+			CASE(OP_GET_GLOBAL_LONG) {
+				uint32_t slot = READ_LONG();
+				GET_GLOBAL(slot);
+				BREAK;
+			}
+			CASE(OP_DEFINE_GLOBAL) {
+				uint8_t slot = READ_BYTE();
+				vm->globalValues.values[slot] = PEEK(0);
+				stackTop--;
+				BREAK;
+			}
+			CASE(OP_DEFINE_GLOBAL_LONG) {
+				uint32_t slot = READ_LONG();
+				vm->globalValues.values[slot] = PEEK(0);
+				stackTop--;
+				BREAK;
+			}
+			CASE(OP_SET_GLOBAL) {
+				uint8_t slot = READ_BYTE();
+				SET_GLOBAL(slot);
+				BREAK;
+			}
+			CASE(OP_SET_GLOBAL_LONG) {
+				uint32_t slot = READ_LONG();
+				SET_GLOBAL(slot);
+				BREAK;
+			}
+			CASE(OP_EQUAL) {	/* comparing ropes can allocate, so the operands stay put until it's done */
+				STORE_FRAME();
+				bool equal = valuesAreEqual(vm, PEEK(1), PEEK(0));
+				stackTop -= 2;
+				PUSH(BOOL_VAL(equal));
+				BREAK;
+			}
+			CASE(OP_GREATER)	BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); BREAK; /* we pass in BOOL_VAL since the result value type is Boolean.*/
+			CASE(OP_LESS)		BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); BREAK;	
+			CASE(OP_ADD) {	/* If both operands are strings, it concatenates.*/
+			genericAdd:
+				if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+					QUICKEN(OP_ADD_STRING);
+					STORE_FRAME();
+					concatenate(vm);
+					LOAD_STACK();
+				} else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {	/* If they're both numbers, it adds them.*/
+					QUICKEN(OP_ADD_NUM);
+					double b = AS_NUMBER(POP());
+					double a = AS_NUMBER(POP());
+					PUSH(NUMBER_VAL(a + b));
 				} else {	/* Any other combination of operand types is a runtime error.*/
-					runtimeError("Operands must be two numbers or two strings.");
-					return INTERPRET_RUNTIME_ERROR;
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
 				}
-				break;
-			}
-			case OP_SUBTRACT:	BINARY_OP(NUMBER_VAL, -); break;
-			case OP_MULTIPLY:	BINARY_OP(NUMBER_VAL, *); break;
-			case OP_DIVIDE:		BINARY_OP(NUMBER_VAL, /); break;
-			case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-			case OP_NEGATE:
-				if (!IS_NUMBER(peek(0))) {
-					runtimeError("Operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
+				BREAK;
+			}
+			CASE(OP_SUBTRACT)	BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); BREAK;
+			CASE(OP_MULTIPLY)	BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); BREAK;
+			CASE(OP_DIVIDE)		BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); BREAK;
+			CASE(OP_NOT) PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); BREAK;
+			CASE(OP_NEGATE)
+				if (!IS_NUMBER(PEEK(0))) {
+					RUNTIME_ERROR("Operand must be a number.");
 				}
-				push(NUMBER_VAL(-AS_NUMBER(pop())));
-				break;
-			case OP_PRINT: {
-				printValue(pop());
-				printf("\n");
-				break;
-			}
-			case OP_JUMP: {
+				PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+				BREAK;
+			CASE(OP_PRINT) {
+				STORE_FRAME();	/* printing a rope flattens it, which can collect */
+				writeValue(vm, &vm->output, PEEK(0));
+				writeLine(&vm->output);
+				stackTop--;
+				BREAK;
+			}
+			CASE(OP_JUMP) {
 				uint16_t offset = READ_SHORT();
-				vm.ip += offset;
-				break;
+				ip += offset;
+				BREAK;
 			}
-			case OP_JUMP_IF_FALSE: {
+			CASE(OP_JUMP_IF_FALSE) {
 				uint16_t offset = READ_SHORT();
-				if (isFalsey(peek(0))) vm.ip += offset;
-				break;
+				if (isFalsey(PEEK(0))) ip += offset;
+				BREAK;
 			}
-			case OP_LOOP: {
+			CASE(OP_LOOP) {
 				uint16_t offset = READ_SHORT();
-				vm.ip -= offset;
-				break;
+				JitCode code = jitEnabled ? jitLoop(vm, ip - offset, ip) : NULL;
+				ip -= offset;
+				if (code != NULL) {	/* run the loop natively until it exits or needs help */
+					STORE_FRAME();
+					ip = code(vm);
+					LOAD_STACK();
+				}
+				BREAK;
 			}
-			case OP_RETURN: {
+			CASE(OP_RETURN) {
+				STORE_FRAME();
 				// Exit interpreter.
-				// printValue(pop());
+				// printValue(pop(vm));
 				// printf("\n");
 				return INTERPRET_OK;
 			}
+			CASE(OP_ARRAY) {
+				int count = READ_BYTE();
+				STORE_FRAME();
+				if (!buildArray(vm, count)) return INTERPRET_RUNTIME_ERROR;
+				LOAD_STACK();
+				BREAK;
+			}
+			CASE(OP_NEW_ARRAY)		ARRAY_OP(newArray(vm)); BREAK;
+			CASE(OP_GET_INDEX)		ARRAY_OP(getIndex(vm)); BREAK;
+			CASE(OP_SET_INDEX)		ARRAY_OP(setIndex(vm)); BREAK;
+			CASE(OP_LENGTH)			ARRAY_OP(valueLength(vm)); BREAK;
+			CASE(OP_ARRAY_ADD)		ARRAY_OP(combineArrays(vm, false)); BREAK;
+			CASE(OP_ARRAY_MULTIPLY)	ARRAY_OP(combineArrays(vm, true)); BREAK;
+			CASE(OP_ARRAY_SUM)		ARRAY_OP(reduceArray(vm, OP_ARRAY_SUM)); BREAK;
+			CASE(OP_ARRAY_MIN)		ARRAY_OP(reduceArray(vm, OP_ARRAY_MIN)); BREAK;
+			CASE(OP_ARRAY_MAX)		ARRAY_OP(reduceArray(vm, OP_ARRAY_MAX)); BREAK;
+			CASE(OP_ARRAY_DOT)		ARRAY_OP(dotProduct(vm)); BREAK;
+			CASE(OP_POP_JUMP_IF_FALSE) {
+				uint16_t offset = READ_SHORT();
+				if (isFalsey(POP())) ip += offset;
+				BREAK;
+			}
+			CASE(OP_JUMP_IF_NOT_EQUAL) {
+				uint16_t offset = READ_SHORT();
+				STORE_FRAME();
+				bool equal = valuesAreEqual(vm, PEEK(1), PEEK(0));
+				stackTop -= 2;
+				if (!equal) ip += offset;
+				BREAK;
+			}
+			CASE(OP_JUMP_IF_NOT_GREATER)	JUMP_UNLESS(>, OP_JUMP_IF_NOT_GREATER_NUM); BREAK;
+			CASE(OP_JUMP_IF_NOT_LESS)		JUMP_UNLESS(<, OP_JUMP_IF_NOT_LESS_NUM); BREAK;
+			CASE(OP_ADD_LOCALS) {
+				Value a = slots[READ_BYTE()];
+				Value b = slots[READ_BYTE()];
+				if (IS_NUMBER(a) && IS_NUMBER(b)) {
+					PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+				} else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+					PUSH(a);
+					PUSH(b);
+					STORE_FRAME();
+					concatenate(vm);
+					LOAD_STACK();
+				} else {
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
+				}
+				BREAK;
+			}
+			CASE(OP_ADD_LOCAL_CONSTANT) {
+				uint8_t slot = READ_BYTE();
+				Value constant = READ_CONSTANT();
+				Value local = slots[slot];
+				if (IS_NUMBER(local) && IS_NUMBER(constant)) {
+					slots[slot] = NUMBER_VAL(AS_NUMBER(local) + AS_NUMBER(constant));
+				} else if (IS_ANY_STRING(local) && IS_ANY_STRING(constant)) {
+					PUSH(local);
+					PUSH(constant);
+					STORE_FRAME();
+					concatenate(vm);
+					LOAD_STACK();
+					slots[slot] = POP();
+				} else {
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
+				}
+				BREAK;
+			}
+			CASE(OP_ADD_NUM) {
+				if (!BOTH_NUMBERS(PEEK(0), PEEK(1))) {	/* most likely strings: let the generic form sort it out */
+					QUICKEN(OP_ADD);
+					goto genericAdd;
+				}
+				double b = AS_NUMBER(POP());
+				PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+				BREAK;
+			}
+			CASE(OP_ADD_STRING) {
+				if (!(IS_ANY_STRING(PEEK(0)) & IS_ANY_STRING(PEEK(1)))) {
+					QUICKEN(OP_ADD);
+					goto genericAdd;
+				}
+				STORE_FRAME();
+				concatenate(vm);
+				LOAD_STACK();
+				BREAK;
+			}
+			CASE(OP_SUBTRACT_NUM)	NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); BREAK;
+			CASE(OP_MULTIPLY_NUM)	NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); BREAK;
+			CASE(OP_DIVIDE_NUM)		NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); BREAK;
+			CASE(OP_GREATER_NUM)	NUMBER_OP(BOOL_VAL, >, OP_GREATER); BREAK;
+			CASE(OP_LESS_NUM)		NUMBER_OP(BOOL_VAL, <, OP_LESS); BREAK;
+			CASE(OP_JUMP_IF_NOT_GREATER_NUM)	JUMP_UNLESS_NUMBERS(>, OP_JUMP_IF_NOT_GREATER); BREAK;
+			CASE(OP_JUMP_IF_NOT_LESS_NUM)		JUMP_UNLESS_NUMBERS(<, OP_JUMP_IF_NOT_LESS); BREAK;
+#ifdef COMPUTED_GOTO
+	}
+#else
 		}
 	}
+#endif
+	#undef QUICKEN
+	#undef NUMBER_OP
+	#undef JUMP_UNLESS_NUMBERS
+	#undef STORE_FRAME
+	#undef LOAD_STACK
+	#undef PUSH
+	#undef POP
+	#undef PEEK
+	#undef RUNTIME_ERROR
 	#undef READ_BYTE
 	#undef READ_SHORT
+	#undef READ_LONG
 	#undef READ_CONSTANT
-	#undef READ_STRING
 	#undef BINARY_OP
+	#undef GET_GLOBAL
+	#undef JUMP_UNLESS
+	#undef SET_GLOBAL
+	#undef ARRAY_OP
+	#undef DISPATCH
+	#undef CASE
+	#undef BREAK
+}
+
+InterpretResult interpretChunk(VM* vm, Chunk *chunk) {
+	vm->chunk = chunk;
+	vm->ip = vm->chunk->code;
+	/* The one overflow check: run() pushes without looking. */
+	if (chunk->maxStack < 0 || !reserveStack(vm, chunk->maxStack)) return INTERPRET_RUNTIME_ERROR;
+	/* A tick that came while compiling isn't this chunk's. Only when sampling,
+	 * since --parallel workers all get here and sampling is refused with it. */
+	if (sampler.enabled) sampler.pending = 0;
+	return run(vm);
 }
 
-InterpretResult interpret(const char *source) {
+InterpretResult interpret(VM* vm, const char *source) {
 	Chunk chunk;
 	initChunk(&chunk); /* create a new empty chunk and pass it over to the compiler.
 	The compiler will take the user's program and fill up the chunk with bytcode. */
 
-	if (!compile(source, &chunk)) {	/* If it does encounter an error, compile() returns false, and we discard the unusable chunk. */
-		freeChunk(&chunk);
+	if (!compile(vm, source, &chunk)) {	/* If it does encounter an error, compile() returns false, and we discard the unusable chunk. */
+		freeChunk(vm, &chunk);
 		return INTERPRET_COMPILE_ERROR;
 	}
 
-	vm.chunk = &chunk;	/* Otherwise, we send the completed chunk over to the VM to be executed. */
-	vm.ip = vm.chunk->code;
-
-	InterpretResult result = run();
+	InterpretResult result = interpretChunk(vm, &chunk);	/* Otherwise, we send the completed chunk over to the VM to be executed. */
 
-	freeChunk(&chunk);	/* When the VM finishes, we free the chunk and we're done. */
+	freeChunk(vm, &chunk);	/* When the VM finishes, we free the chunk and we're done. */
 	return result;
-	// compile(source);
-	// return INTERPRET_OK;
 }